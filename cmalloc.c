@@ -17,3 +17,74 @@ void* cmalloc(size_t size) {
 void cmalloc_stats() {
   je_malloc_stats_print(NULL, NULL, NULL);
 }
+
+struct arena_block {
+  arena_block* next;
+  char data[];
+};
+
+/* Everything handed out is 8 byte aligned */
+static inline size_t arena_round(size_t size) {
+  return (size + 7) & ~(size_t)7;
+}
+
+/* Start an arena with the given capacity, which may be 0 to only allocate
+ * on first use. If that allocation fails the arena starts empty.
+ */
+void arena_init(arena* scratch, size_t capacity) {
+  scratch->capacity = arena_round(capacity);
+  scratch->base = scratch->capacity > 0 ? cmalloc(scratch->capacity) : NULL;
+  if(scratch->base == NULL)
+    scratch->capacity = 0;
+  scratch->used = 0;
+  scratch->overflow = 0;
+  scratch->blocks = NULL;
+}
+
+/* size bytes of scratch memory lasting until the next reset, or NULL if
+ * it doesn't fit and can't be allocated either
+ */
+void* arena_alloc(arena* scratch, size_t size) {
+  size = arena_round(size);
+  if(scratch->capacity - scratch->used >= size) {
+    void* ptr = scratch->base + scratch->used;
+    scratch->used += size;
+    return ptr;
+  }
+
+  arena_block* block = cmalloc(sizeof(arena_block) + size);
+  if(block == NULL)
+    return NULL;
+  block->next = scratch->blocks;
+  scratch->blocks = block;
+  scratch->overflow += size;
+  return block->data;
+}
+
+/* Give back everything handed out since the last reset */
+void arena_reset(arena* scratch) {
+  while(scratch->blocks != NULL) {
+    arena_block* next = scratch->blocks->next;
+    cfree(scratch->blocks);
+    scratch->blocks = next;
+  }
+
+  if(scratch->overflow > 0) {
+    size_t capacity = 2*(scratch->used + scratch->overflow);
+    char* base = cmalloc(capacity);
+    if(base != NULL) {
+      cfree(scratch->base);
+      scratch->base = base;
+      scratch->capacity = capacity;
+    }
+  }
+  scratch->used = 0;
+  scratch->overflow = 0;
+}
+
+void arena_free(arena* scratch) {
+  arena_reset(scratch);
+  cfree(scratch->base);
+  scratch->base = NULL;
+  scratch->capacity = 0;
+}
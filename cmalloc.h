@@ -8,5 +8,24 @@ void cfree(void *ptr);
 void* cmalloc(size_t size);
 void cmalloc_stats();
 
-#endif
+/* Scratch memory handed out by bumping a pointer and given back all at
+ * once by arena_reset. Anything which doesn't fit comes from cmalloc
+ * until the next reset, which then grows the arena to fit it all, so a
+ * reused arena stops allocating once it has seen its largest use.
+ */
+typedef struct arena_block arena_block;
+
+typedef struct arena {
+  char* base;
+  size_t used;
+  size_t capacity;
+  size_t overflow; /*bytes which didn't fit since the last reset*/
+  arena_block* blocks; /*where they went*/
+} arena;
 
+void arena_init(arena* scratch, size_t capacity);
+void* arena_alloc(arena* scratch, size_t size);
+void arena_reset(arena* scratch);
+void arena_free(arena* scratch);
+
+#endif
@@ -1,19 +1,39 @@
 #ifndef _COBB2_H_
 #define _COBB2_H_
 
-/* String contents are stored immediately after the end of this struct*/
+#include <stdint.h>
+
+/* Global strings are referred to by this id in dlines, see phrase.h */
+typedef uint32_t phrase_id;
+
+/* String contents are stored immediately after the end of this struct,
+ * null terminated and followed by their (null terminated) normalized form
+ */
 typedef struct global_data {
   int len;
+  int normalized_len;
+  phrase_id id;
+  unsigned int score; /*current score, kept up to date by writers*/
 } global_data;
 
 
 #define GLOBAL_STR(g) ((char*)g + sizeof(global_data))
+#define GLOBAL_NORMALIZED(g) (GLOBAL_STR(g) + (g)->len + 1)
+#define GLOBAL_SIZE(len, normalized_len) \
+  (sizeof(global_data) + (len) + 1 + (normalized_len) + 1)
+
+/* Start loading memory which will be read soon, so that the miss overlaps
+ * with other work instead of stalling on it
+ */
+#define PREFETCH(addr) __builtin_prefetch((void*)(addr))
+#define CACHE_LINE 64
 
 enum op_ret {
   NO_ERROR = 0,
   MALLOC_FAIL = 1,
   BAD_PARAM = 2,
-  NOT_FOUND = 3
+  NOT_FOUND = 3,
+  IO_ERROR = 4
 };
 
 typedef unsigned short op_result;
@@ -28,6 +48,7 @@ typedef struct upsert_state {
   global_data* global_ptr;
   int old_score;
   unsigned short mode;
+  unsigned short splits; /*hash nodes split so far*/
 } upsert_state;
 
 typedef struct remove_state {
@@ -40,6 +61,27 @@ typedef struct result_entry {
   unsigned int score;
   unsigned int len;
   unsigned int offset;
+  phrase_id id; /*of global_ptr, which results are ordered by*/
 } result_entry;
 
+/* Which results a search returns: only those scoring at least min_score,
+ * and if after is set only those sorting after a result with after_score
+ * and after_id, which is how the page after that result is found.
+ */
+typedef struct search_page {
+  unsigned int min_score;
+  int after;
+  unsigned int after_score;
+  phrase_id after_id;
+} search_page;
+
+/* Whether a result with the given score and id is on a page at all */
+static inline int page_contains(search_page* page,
+                                unsigned int score,
+                                phrase_id id) {
+  return score >= page->min_score &&
+    (!page->after || score < page->after_score ||
+     (score == page->after_score && id < page->after_id));
+}
+
 #endif
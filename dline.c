@@ -1,83 +1,263 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <limits.h>
 #include "cmalloc.h"
 #include "cobb2.h"
 #include "dline.h"
+#include "phrase.h"
 
 /* Functions that operate on a data line (henceforth shortened dline).
  * The dline is the fundamental storage mechanism for data, it is used as
  * elements of hash tables as well as terminating suffixes at trie nodes.
- * dline is a single contiguous block of memory that is reallocated on every
- * update. The layout is as follows:
- * 1. 16 byte dline_entry metadata header
- * 2. Any number of non-null-terminated data characters, whose length is
- * stored as the len field in the preceding dline_etry.
- * 3. 0 to 7 bytes of buffer padding, so that the dline_entry for the next
- * suffix is allocated on a 8 byte boundary.
- * 
- * The termination of a dline is represented as the start of a dline_entry
- * with a magic global_ptr
+ * dline is a single contiguous block of memory. The layout is as follows:
+ * 1. 8 byte dline_header, with the bytes used (including the header) and
+ * the bytes allocated.
+ * then for each suffix:
+ * 2. 16 byte dline_entry, with the phrase id of the string the suffix is
+ * from, its length and its first DLINE_INLINE_LEN bytes.
+ * A suffix always runs to the end of its string, so the rest of it is read
+ * from the global string rather than stored again for every suffix. The
+ * inline bytes settle almost every comparison without going there.
  *
- * Suffixes are stored in score sorted order, within score by global_ptr, and
- * withing global_ptr by length.
- * In actual usage, dlines are immutable: all operations create the a copy of 
- * the a dline with the given update applied to them.
+ * Suffixes are stored in score sorted order, within score by phrase id, and
+ * withing id by length.
+ * Once readers can see a dline it is immutable: dline_upsert/dline_remove
+ * create a copy with the given update applied.
+ *
+ * Large dlines written by dline_build are packed instead when the caller
+ * asks for it, i.e. for a bulk loaded base index which is mostly cold and
+ * won't be written again. After the
+ * header each entry is then:
+ * 1. varint drop in score from the entry before (from UINT_MAX for the
+ * first), varint phrase id and varint len.
+ * 2. a byte counting how much of its inline prefix is shared with the
+ * entry before, followed by the rest of the inline prefix.
+ * Padding takes the whole dline to a multiple of 8 bytes. capacity holds
+ * DLINE_PACKED and the number of entries. Packed dlines are read by
+ * decoding them in order, and are unpacked by the first write to them.
  */
- 
-/* Since a real global_ptr is malloc'ed, it is going to be aligned. This is
- * not, so no worries about collision.
+
+typedef struct dline_header {
+  uint32_t used;
+  uint32_t capacity;
+} dline_header;
+
+#define DLINE_PACKED 0x80000000u
+
+/* Given the address of a current entry, get the address of the next. */
+static inline dline_entry* next_entry(dline_entry* current) {
+  return current + 1;
+}
+
+static inline dline_header* header(dline_t* dline) {
+  return (dline_header*)dline;
+}
+
+static inline dline_entry* first_entry(dline_t* dline) {
+  return (dline_entry*)((char*)dline + sizeof(dline_header));
+}
+
+/* One past the last entry */
+static inline dline_entry* end_entry(dline_t* dline) {
+  return (dline_entry*)((char*)dline + header(dline)->used);
+}
+
+static inline int is_packed(dline_t* dline) {
+  return (header(dline)->capacity & DLINE_PACKED) != 0;
+}
+
+/* Number of entries in a packed dline */
+static inline uint32_t packed_count(dline_t* dline) {
+  return header(dline)->capacity & ~DLINE_PACKED;
+}
+
+static inline unsigned char* first_packed(dline_t* dline) {
+  return (unsigned char*)dline + sizeof(dline_header);
+}
+
+/* Write value 7 bits a byte, low bits first, returning the end. Only
+ * counts the bytes if out is NULL.
  */
-#define DLINE_MAGIC_TERMINATOR (global_data*)0x0011223344556677UL
+static inline unsigned char* put_varint(unsigned char* out,
+                                        uint32_t value,
+                                        uint64_t* size) {
+  do {
+    if(out != NULL)
+      *out++ = (value & 0x7f) | (value >= 0x80 ? 0x80 : 0);
+    (*size)++;
+    value >>= 7;
+  } while(value != 0);
+  return out;
+}
+
+/* Read a varint from in into value, returning where it ends */
+static inline unsigned char* get_varint(unsigned char* in, uint32_t* value) {
+  uint32_t result = *in++;
+  if(result & 0x80) {
+    int shift = 7;
+    unsigned char byte;
+    result &= 0x7f;
+    do {
+      byte = *in++;
+      result |= (uint32_t)(byte & 0x7f) << shift;
+      shift += 7;
+    } while(byte & 0x80);
+  }
+  *value = result;
+  return in;
+}
 
-/* size of the unused buffer between the end of a string and the start
- * of its next dline_entry,
+static inline unsigned int prefix_len(unsigned int len) {
+  return len < DLINE_INLINE_LEN ? len : DLINE_INLINE_LEN;
+}
+
+/* Pack entry after prev (whose score is UINT_MAX for the first entry) at
+ * out, returning the end, and adding its length to size. Only counts the
+ * bytes if out is NULL.
  */
-static inline size_t wasted_buffer(size_t str_len) {
-  return (8-(str_len&7))&7;  
+static unsigned char* pack_entry(unsigned char* out,
+                                 dline_entry* entry,
+                                 dline_entry* prev,
+                                 uint64_t* size) {
+  unsigned int len = prefix_len(entry->len);
+  unsigned int shared = 0;
+  while(shared < len && entry->prefix[shared] == prev->prefix[shared])
+    shared++;
+
+  out = put_varint(out, prev->score - entry->score, size);
+  out = put_varint(out, entry->id, size);
+  out = put_varint(out, entry->len, size);
+  if(out != NULL) {
+    *out++ = shared;
+    memcpy(out, entry->prefix + shared, len - shared);
+    out += len - shared;
+  }
+  *size += 1 + len - shared;
+  return out;
 }
 
-/* Size of a dline entry with a string of the given length, including bytes
- * beyond the end of the string for padding.
+/* Decode the entry packed at in over entry, which holds the one before
+ * it, returning where the next starts
  */
-static inline size_t entry_size(size_t str_len) {
-  return sizeof(dline_entry) + str_len + wasted_buffer(str_len);
+static inline unsigned char* unpack_entry(unsigned char* in,
+                                          dline_entry* entry) {
+  uint32_t drop, id, len16;
+  in = get_varint(in, &drop);
+  in = get_varint(in, &id);
+  in = get_varint(in, &len16);
+  entry->score -= drop;
+  entry->id = id;
+  entry->len = len16;
+  unsigned int len = prefix_len(len16);
+  for(unsigned int i = *in++; i < len; i++)
+    entry->prefix[i] = *in++;
+  for(unsigned int i = len; i < DLINE_INLINE_LEN; i++)
+    entry->prefix[i] = 0;
+  return in;
 }
 
-/* Given the address of a current entry, get the address of the next. */
-static inline dline_entry* next_entry(dline_entry* current) {
-  char* ptr = (char*)current;
-  return (dline_entry*)(ptr + entry_size(current->len));
+/* The global string of an entry, looked up by its id */
+static inline global_data* entry_global(dline_entry* entry) {
+  return phrase_get(entry->id);
 }
 
-/* Pointer to where string starts for a given dline_entry. */
-static inline char* str_offset(dline_entry* entry) {
-  return ((char*)entry) + sizeof(dline_entry);
+/* Where the suffix of an entry is in its normalized global string */
+static inline char* entry_suffix(dline_entry* entry) {
+  global_data* global = entry_global(entry);
+  return GLOBAL_NORMALIZED(global) + global->normalized_len - entry->len;
 }
 
-static global_data* create_global(string_data* string) {
-  global_data* result = cmalloc(sizeof(global_data) + string->length + 1);
+/* Whether the suffix of entry starts with what the cursor is matching,
+ * which must be no longer than it. The entry's len and inline prefix share
+ * a word, which is checked against the start of the match in one go (with
+ * len and the bytes beyond the match masked off) rather than with memcmp.
+ * Most entries in a large dline fail on their first byte or two, so this
+ * settles almost all of them without leaving the dline or making a call.
+ * Only longer matches go on to the global string.
+ */
+static inline int prefix_matches(dline_entry* entry, dline_cursor* cursor) {
+  uint64_t start;
+
+  if(cursor->match_len == 0)
+    return 1;
+  memcpy(&start, &entry->len, sizeof(uint64_t));
+  if((start ^ cursor->match_word) & cursor->match_mask)
+    return 0;
+  return cursor->match_len <= DLINE_INLINE_LEN ||
+    !memcmp(entry_suffix(entry) + DLINE_INLINE_LEN,
+            cursor->match + DLINE_INLINE_LEN,
+            cursor->match_len - DLINE_INLINE_LEN);
+}
+
+/* Copy a string and its normalized form into a newly allocated
+ * global_data, with a phrase id of its own. It goes with phrase_release.
+ */
+global_data* create_global(string_data* string) {
+  global_data* result = cmalloc(GLOBAL_SIZE(string->full_length,
+                                            string->length));
   if(result == NULL)
     return NULL;
-  result->len = string->length;
-  memcpy(GLOBAL_STR(result), string->full, string->length + 1);
+  result->len = string->full_length;
+  result->normalized_len = string->length;
+  result->score = MIN_SCORE;
+  memcpy(GLOBAL_STR(result), string->full, string->full_length + 1);
+  memcpy(GLOBAL_NORMALIZED(result), string->normalized, string->length);
+  GLOBAL_NORMALIZED(result)[string->length] = '\0';
+  if(phrase_add(result) == NO_PHRASE) {
+    cfree(result);
+    return NULL;
+  }
   
   return result;
 }
 
+/* Allocate a dline able to hold at least len bytes, with its header set up
+ * for len used bytes and however many the allocation really has.
+ */
 static dline_t* dline_alloc(size_t len) {
+  size_t capacity = len;
   if(len <= 32) {
-    return cmalloc(32);
+    capacity = 32;
   } else if(len <= 64) {
-    return cmalloc(64);
+    capacity = 64;
   } else if(len <= 96) {
-    return cmalloc(96);
+    capacity = 96;
   } else if(len <= 128) {
-    return cmalloc(128);
-  } else {
-    return cmalloc(len);
+    capacity = 128;
+  }
+
+  dline_t* dline = cmalloc(capacity);
+  if(dline == NULL)
+    return NULL;
+  header(dline)->used = len;
+  header(dline)->capacity = capacity;
+  return dline;
+}
+
+/* A plain copy of a packed dline with spare bytes of capacity beyond its
+ * entries, or NULL if it can't be allocated
+ */
+static dline_t* dline_unpack(dline_t* packed, uint32_t spare) {
+  uint32_t count = packed_count(packed);
+  uint32_t used = sizeof(dline_header) + count*sizeof(dline_entry);
+  dline_t* dline = cmalloc(used + spare);
+  if(dline == NULL)
+    return NULL;
+  header(dline)->used = used;
+  header(dline)->capacity = used + spare;
+
+  unsigned char* in = first_packed(packed);
+  dline_entry decoded = {NO_PHRASE, UINT_MAX, 0, {0}};
+  for(dline_entry* current = first_entry(dline);
+      current < end_entry(dline);
+      current = next_entry(current)) {
+    in = unpack_entry(in, &decoded);
+    *current = decoded;
   }
+  return dline;
 }
 
 /* Apply some function to each element of a dline. Brought out here so
@@ -85,39 +265,149 @@ static dline_t* dline_alloc(size_t len) {
  */
 void dline_iterate(dline_t* dline, void* state, dline_iter_fn function) {
   assert(dline != NULL);
+
+  if(is_packed(dline)) {
+    unsigned char* in = first_packed(dline);
+    dline_entry decoded = {NO_PHRASE, UINT_MAX, 0, {0}};
+    for(uint32_t i = 0; i < packed_count(dline); i++) {
+      in = unpack_entry(in, &decoded);
+      function(&decoded, entry_suffix(&decoded), state);
+    }
+    return;
+  }
   
-  dline_entry* current = (dline_entry*)dline;
+  dline_entry* current = first_entry(dline);
+  dline_entry* end = end_entry(dline);
   
-  while(current->global_ptr != DLINE_MAGIC_TERMINATOR) {
-    function(current, str_offset(current), state);
+  while(current < end) {
+    function(current, entry_suffix(current), state);
     current = next_entry(current);
   }
 }
 
-/* Creates a copy of the given dline with the insert/update applied. If the
- * existing line is NULL, creates a new one with just the single element.
- * Returns status code of the operation.
+/* Set the inline prefix of an entry to the start of suffix */
+static inline void write_prefix(dline_entry* entry,
+                                char* suffix,
+                                unsigned int suffix_len) {
+  memset(entry->prefix, 0, DLINE_INLINE_LEN);
+  memcpy(entry->prefix, suffix,
+         suffix_len < DLINE_INLINE_LEN ? suffix_len : DLINE_INLINE_LEN);
+}
+
+static inline void write_entry(dline_entry* entry,
+                               global_data* global_ptr,
+                               unsigned int score,
+                               string_data* string,
+                               unsigned int start,
+                               unsigned int suffix_len) {
+  entry->id = global_ptr->id;
+  entry->score = score;
+  entry->len = suffix_len;
+  write_prefix(entry, string->normalized + start, suffix_len);
+}
+
+/* Whether an existing entry sorts ahead of a new one with the given fields */
+static inline int sorts_before(dline_entry* current,
+                               unsigned int score,
+                               global_data* global_ptr,
+                               unsigned int len) {
+  return current->score > score || (current->score == score &&
+         current->id > global_ptr->id) ||
+         (current->score == score && current->id == global_ptr->id &&
+          current->len > len);
+}
+
+/* Find the entry for the given suffix of string, only looking at entries
+ * for global_ptr if it is known. Returns NULL if there isn't one.
  */
-op_result dline_upsert(dline_t* existing, /* dline to perform upset on*/
-                       dline_t** result, /* resulting dline*/
-                       string_data* string,/* string information */
-                       unsigned int start,/*offset from start of string*/
-                       unsigned int score, /*score to set*/
-                       upsert_state* state) {/*set on first call*/
+static dline_entry* find_suffix(dline_t* dline,
+                                global_data* global_ptr,
+                                string_data* string,
+                                unsigned int start) {
+  unsigned int suffix_len =
+    start >= string->length ? 0 : string->length - start;
+  unsigned int prefix_len =
+    suffix_len < DLINE_INLINE_LEN ? suffix_len : DLINE_INLINE_LEN;
+  dline_entry* current = first_entry(dline);
+  dline_entry* end = end_entry(dline);
+
+  /* The inline prefix is checked first since it is almost always in cache,
+   * and the global string is almost always not. Past that, an identical
+   * global string with the same suffix length is enough.
+   */
+  while(current < end) {
+    if((global_ptr == NULL || global_ptr->id == current->id) &&
+       suffix_len == current->len &&
+       !memcmp(current->prefix, string->normalized + start, prefix_len)) {
+      global_data* current_ptr = entry_global(current);
+      if(current_ptr->len == string->full_length &&
+         !memcmp(GLOBAL_STR(current_ptr), string->full,
+                 string->full_length)) {
+        return current;
+      }
+    }
+    current = next_entry(current);
+  }
+  return NULL;
+}
+
+/* Where an entry with the given fields goes, ignoring the entry skip (which
+ * is being moved, NULL if none).
+ */
+static dline_entry* seek_insert(dline_t* dline,
+                                unsigned int score,
+                                global_data* global_ptr,
+                                unsigned int len,
+                                dline_entry* skip) {
+  dline_entry* current = first_entry(dline);
+  dline_entry* end = end_entry(dline);
+
+  while(current < end &&
+        (current == skip || sorts_before(current, score, global_ptr, len))) {
+    current = next_entry(current);
+  }
+  return current;
+}
+
+/* Does the work of dline_upsert. With exclusive set existing is changed in
+ * place, which is only done to the private copy a packed dline is unpacked
+ * into, sized so that an insert fits. A packed dline is thus only copied
+ * once by its first write.
+ */
+static op_result upsert(dline_t* existing,
+                        dline_t** result,
+                        string_data* string,
+                        unsigned int start,
+                        unsigned int score,
+                        upsert_state* state,
+                        int exclusive) {
   if(string == NULL || result == NULL || state == NULL)
     return BAD_PARAM;
+
+  if(existing != NULL && is_packed(existing)) {
+    /*written to, so no longer cold: apply the upsert to a plain copy*/
+    dline_t* unpacked = dline_unpack(existing,
+                                     state->mode == UPSERT_MODE_UPDATE ? 0 :
+                                     sizeof(dline_entry));
+    if(unpacked == NULL)
+      return MALLOC_FAIL;
+    op_result res = upsert(unpacked, result, string, start, score, state, 1);
+    if(res != NO_ERROR)
+      cfree(unpacked);
+    return res;
+  }
   
   unsigned int suffix_len =
     start >= string->length ? 0 : string->length - start;
+  if(suffix_len > DLINE_MAX_LEN)
+    return BAD_PARAM;
   
   if(existing == NULL) {
     /*if the dline is NULL, we can't possibily be doing an update*/
     assert(state->mode != UPSERT_MODE_UPDATE);
     
-    /* Create the new dline for this suffix plus space for the trailing
-     * magic terminator pointer.
-     */
-    *result = dline_alloc(entry_size(suffix_len) + sizeof(void*));
+    /* Create the new dline for this suffix */
+    *result = dline_alloc(sizeof(dline_header) + sizeof(dline_entry));
     
     if(*result == NULL) {
       return MALLOC_FAIL;
@@ -134,16 +424,8 @@ op_result dline_upsert(dline_t* existing, /* dline to perform upset on*/
       }
     }
     
-    dline_entry* new_entry = (dline_entry*)*result;
-    
-    /*set up our new dline_t*/
-    new_entry->global_ptr = state->global_ptr;
-    new_entry->score = score;
-    new_entry->len = suffix_len;
-    memcpy(str_offset(new_entry), string->normalized + start, suffix_len);
-    /*trailing magic pointer to indicate end of a dline.*/
-    next_entry(new_entry)->global_ptr = DLINE_MAGIC_TERMINATOR;
-    
+    write_entry(first_entry(*result), state->global_ptr, score, string,
+                start, suffix_len);
     state->mode = UPSERT_MODE_INSERT;
     
     return NO_ERROR;
@@ -157,50 +439,28 @@ op_result dline_upsert(dline_t* existing, /* dline to perform upset on*/
      */
     assert(state->global_ptr == NULL);
     
-    dline_entry* current = existing;
+    dline_entry* found = find_suffix(existing, NULL, string, start);
     
-    /* Not sure whether or not comparing the local suffix first ends up
-     * being faster, but it should be. Those characters are almost always
-     * in cache, and the global string is almost always not. But really, it
-     * is unecessary, since finding an identical global string is enough.
-     */
-    while(current->global_ptr != DLINE_MAGIC_TERMINATOR &&
-          (suffix_len != current->len ||
-           memcmp(str_offset(current), string->normalized + start,
-                  suffix_len) ||
-           current->global_ptr->len != string->length ||
-           memcmp(GLOBAL_STR(current->global_ptr), string->full,
-                  string->length))){
-      current = next_entry(current);        
-    }
-    
-    if(current->global_ptr == DLINE_MAGIC_TERMINATOR) {
+    if(found == NULL) {
       /* We didn't find an entry, do an insert. Re-looping isn't the most
        * efficient way of doing things, but it'll work for now
        */
       state->mode = UPSERT_MODE_INSERT;
-      return dline_upsert(existing, result, string, start, score, state);
     } else {
       /* ran into a identical suffix with a full string identical to ours,
-       * so this is an update. Similar to above, this just recurses for now.
+       * so this is an update.
        */
       state->mode = UPSERT_MODE_UPDATE;
-      state->global_ptr = current->global_ptr;
-      state->old_score = current->score;
-      return dline_upsert(existing, result, string, start, score, state);
+      state->global_ptr = entry_global(found);
+      state->old_score = found->score;
     }
-    
-    return NO_ERROR;
+    return upsert(existing, result, string, start, score, state, exclusive);
     
   } else if(state->mode == UPSERT_MODE_INSERT) {
-    /* Doing an insert, loop until the first item whose score is <= the new
-     * suffix's score, and then copy the data before, insert the new suffix,
-     * and copy the data after.
+    /* Doing an insert, find the first item which sorts after the new
+     * suffix, and then put the new suffix in before it, moving everything
+     * after along.
      */
-    
-    dline_entry* current = existing;
-    uint64_t before_size, after_size = 0;
-    
     if(state->global_ptr == NULL) {
       /*first suffix insert, so create the global_ptr*/
       state->global_ptr = create_global(string);
@@ -212,173 +472,323 @@ op_result dline_upsert(dline_t* existing, /* dline to perform upset on*/
     
     /* Sort order is
      * 1. score
-     * 2. global_ptr within score (important for fast merging of multiple
+     * 2. phrase id within score (important for fast merging of multiple
      * matching suffixes from the same string since this gives us deduping
      * for very cheap)
-     * 3. length within global_ptr (thus when multiple suffixes from the
+     * 3. length within phrase id (thus when multiple suffixes from the
      * same root string on this dline match, return just the longest one,
      * which therefore starts earliest in the string)
      */
-    while(current->global_ptr != DLINE_MAGIC_TERMINATOR &&
-          (current->score > score || (current->score == score &&
-          (uint64_t)current->global_ptr > (uint64_t)state->global_ptr) ||
-          (current->score == score &&
-           (uint64_t)current->global_ptr == (uint64_t)state->global_ptr &&
-           current->len > suffix_len))) {
-      current = next_entry(current);
-    }
+    dline_entry* current = seek_insert(existing, score, state->global_ptr,
+                                       suffix_len, NULL);
+    uint64_t before_size = (uint64_t)current - (uint64_t)existing;
+    uint64_t after_size = header(existing)->used - before_size;
+    uint64_t new_size = header(existing)->used + sizeof(dline_entry);
     
-    before_size = (uint64_t)current - (uint64_t)existing;
-    
-    while(current->global_ptr != DLINE_MAGIC_TERMINATOR) {
-      current = next_entry(current);
-    }
-    
-    after_size = (uint64_t)current - (uint64_t)existing - before_size;
-    
-    *result = dline_alloc(before_size + entry_size(suffix_len) +
-                          after_size + sizeof(void*));
-    
-    if(*result == NULL) {
-      cfree(state->global_ptr);
-      return MALLOC_FAIL;
+    if(exclusive && new_size <= header(existing)->capacity) {
+      /*room to spare, shift the entries after along in place*/
+      memmove(current + 1, current, after_size);
+      header(existing)->used = new_size;
+      *result = existing;
+    } else {
+      *result = dline_alloc(new_size);
+      
+      if(*result == NULL) {
+        return MALLOC_FAIL;
+      }
+      header(*result)->used = new_size;
+      
+      /*copy over entries before our new entry*/
+      memcpy(first_entry(*result), first_entry(existing),
+             before_size - sizeof(dline_header));
+      /*copy over entries after our new entry*/
+      memcpy((char*)*result + before_size + sizeof(dline_entry),
+             current, after_size);
+      if(exclusive)
+        cfree(existing);
     }
     
-    /*copy over entries before our new entry*/
-    memcpy(*result, existing, before_size);
-    
-    dline_entry* new_entry = (dline_entry*)((char*)*result +
-                                            before_size);
-    
-    /*set up our new dline_t*/
-    new_entry->global_ptr = state->global_ptr;
-    new_entry->score = score;
-    new_entry->len = suffix_len;
-    memcpy(str_offset(new_entry), string->normalized + start, suffix_len);
-    
-    /*copy over entries after our new entry*/
-    memcpy(((char*)*result) + before_size + entry_size(suffix_len),
-           ((char*)existing) + before_size, after_size);
-    /*termiante with magic (Ugh Ugly)*/
-    ((dline_entry*)((char*)*result + before_size +
-                   entry_size(suffix_len) + after_size))->global_ptr =
-                   DLINE_MAGIC_TERMINATOR;
-    
+    write_entry((dline_entry*)((char*)*result + before_size),
+                state->global_ptr, score, string, start, suffix_len);
     return NO_ERROR;
   } else if(state->mode == UPSERT_MODE_UPDATE) {
-    /* If surely doing an update, the previous score has been identified.
-     * First seek to the higher of score and old_score, and then the lower.
-     * Using the found offsets, copy over old dline without the old entry
-     * and with the new entry add.
+    /* Doing an update, so the old entry is found along with where the
+     * new one goes in a single pass. The entries between the two shift by
+     * the size of an entry.
      */
     assert(state->global_ptr != NULL);
     
-    /* This works, but its slow due to a double-copy. TODO: make it faster*/
-    dline_t* tmp = NULL;
-    remove_state r_state = {state->global_ptr};
-    op_result update_result = dline_remove(existing,
-                                           &tmp,
-                                           string,
-                                           start,
-                                           &r_state);
-    if(update_result == NO_ERROR) {
-      /* For just this call, we are doing an insert (since the old entry
-       * has been removed). Need to change back after the upsert call
-       */
-      state->mode = UPSERT_MODE_INSERT;
-      update_result = dline_upsert(tmp,
-                                   result,
-                                   string,
-                                   start,
-                                   score,
-                                   state);
-      state->mode = UPSERT_MODE_UPDATE;
-      /* slightly sketchy failure handling here, should be cleaned up */
-      if(update_result != MALLOC_FAIL) {
-        cfree(tmp);
-      }
+    dline_entry* old = find_suffix(existing, state->global_ptr, string,
+                                   start);
+    if(old == NULL)
+      return NOT_FOUND;
+    if(old->score == score) {
+      /*nothing to do, the caller can tell by getting back the same dline*/
+      *result = existing;
+      return NO_ERROR;
     }
     
-    return update_result;
+    dline_entry* current = seek_insert(existing, score, state->global_ptr,
+                                       suffix_len, old);
+    uint64_t size = sizeof(dline_entry);
+    uint64_t old_at = (uint64_t)old - (uint64_t)existing;
+    uint64_t new_at = (uint64_t)current - (uint64_t)existing;
+    
+    if(exclusive) {
+      *result = existing;
+    } else {
+      *result = dline_alloc(header(existing)->used);
+      if(*result == NULL)
+        return MALLOC_FAIL;
+      memcpy(first_entry(*result), first_entry(existing),
+             header(existing)->used - sizeof(dline_header));
+    }
+    
+    char* base = (char*)*result;
+    if(new_at < old_at) {
+      /*moving up, entries in between move down*/
+      memmove(base + new_at + size, base + new_at, old_at - new_at);
+    } else {
+      /*moving down, the entry's old space is taken by those in between*/
+      memmove(base + old_at, base + old_at + size, new_at - old_at - size);
+      new_at -= size;
+    }
+    write_entry((dline_entry*)(base + new_at), state->global_ptr, score,
+                string, start, suffix_len);
+    
+    return NO_ERROR;
   } else {
     return BAD_PARAM;
   }
 }
 
-/* Removes a suffix from a dline by creating a copy without the removed
- * elements, and returns a result code
+/* Creates a copy of the given dline with the insert/update applied. If the
+ * existing line is NULL, creates a new one with just the single element.
+ * If the update doesn't change the score, the existing dline is returned
+ * as the result. Returns status code of the operation.
  */
-op_result dline_remove(dline_t* existing,
-                      dline_t** result,
-                      string_data* string,
-                      unsigned int start,
-                      remove_state* state) {
+op_result dline_upsert(dline_t* existing, /* dline to perform upset on*/
+                       dline_t** result, /* resulting dline*/
+                       string_data* string,/* string information */
+                       unsigned int start,/*offset from start of string*/
+                       unsigned int score, /*score to set*/
+                       upsert_state* state) {/*set on first call*/
+  return upsert(existing, result, string, start, score, state, 0);
+}
+
+/* Does the work of dline_remove. With exclusive set existing, which is
+ * then the private copy of a packed dline, is changed in place, or freed
+ * if it is left empty.
+ */
+static op_result remove_suffix(dline_t* existing,
+                               dline_t** result,
+                               string_data* string,
+                               unsigned int start,
+                               remove_state* state,
+                               int exclusive) {
   if(existing == NULL || result == NULL || string == NULL || state == NULL)
     return BAD_PARAM;
-  
-  dline_entry* current = (dline_entry*)existing;
-  uint64_t before_size, deleted_size, after_size = 0;
-  unsigned int suffix_len =
-    start >= string->length ? 0 : string->length - start;
 
-  
-  while(current->global_ptr != DLINE_MAGIC_TERMINATOR &&
-        ((state->global_ptr != NULL &&
-          state->global_ptr != current->global_ptr) ||
-        (suffix_len != current->len ||
-         memcmp(str_offset(current), string->normalized + start,
-                suffix_len) ||
-         current->global_ptr->len != string->length ||
-         memcmp(GLOBAL_STR(current->global_ptr), string->full,
-                string->length)))) {
-    current = next_entry(current);
+  if(is_packed(existing)) {
+    /*same as for upsert, the removal is applied to a plain copy*/
+    dline_t* unpacked = dline_unpack(existing, 0);
+    if(unpacked == NULL)
+      return MALLOC_FAIL;
+    op_result res = remove_suffix(unpacked, result, string, start, state, 1);
+    if(res != NO_ERROR)
+      cfree(unpacked);
+    return res;
   }
   
-  if(current->global_ptr == DLINE_MAGIC_TERMINATOR) {
+  dline_entry* current = find_suffix(existing, state->global_ptr, string,
+                                     start);
+  if(current == NULL) {
     return NOT_FOUND;
   }
   
-  before_size = (uint64_t)current - (uint64_t)existing;
-  deleted_size = entry_size(current->len);
+  uint64_t before_size = (uint64_t)current - (uint64_t)existing;
+  uint64_t deleted_size = sizeof(dline_entry);
+  uint64_t after_size = header(existing)->used - deleted_size - before_size;
   
   if(state->global_ptr == NULL)
-    state->global_ptr = current->global_ptr;
+    state->global_ptr = entry_global(current);
   
-  while(current->global_ptr != DLINE_MAGIC_TERMINATOR) {
-    current = next_entry(current);
-  }
-  
-  after_size = (uint64_t)current - (uint64_t)existing - deleted_size -
-    before_size;
-  
-  if(before_size == 0 && after_size == 0) {
+  if(before_size == sizeof(dline_header) && after_size == 0) {
     /* If the deleted suffix is the only entry, no need to malloc a new one.
      */
+    if(exclusive)
+      cfree(existing);
     *result = NULL;
     return NO_ERROR;
   }
   
-  *result = dline_alloc(before_size + after_size + sizeof(void*));
-  
-  if(*result == NULL) {
-    return MALLOC_FAIL;
+  if(exclusive) {
+    *result = existing;
+  } else {
+    *result = dline_alloc(before_size + after_size);
+    if(*result == NULL) {
+      return MALLOC_FAIL;
+    }
+    /*copy over entries before the deleted suffix*/
+    memcpy(first_entry(*result), first_entry(existing),
+           before_size - sizeof(dline_header));
   }
   
-  /*copy over entries before the deleted suffix*/
-  memcpy(*result, existing, before_size);
-  
   /*and now the entries after*/
-  memcpy(((char*)*result) + before_size,
-         ((char*)existing) + before_size + deleted_size,
-         after_size);
-  
-  /*terminate with magic (Ugh Ugly)*/
-  ((dline_entry*)((char*)*result + before_size + after_size))->global_ptr =
-    DLINE_MAGIC_TERMINATOR;
+  memmove(((char*)*result) + before_size,
+          ((char*)existing) + before_size + deleted_size,
+          after_size);
+  header(*result)->used = before_size + after_size;
   
   return NO_ERROR;
 }
 
+/* Removes a suffix from a dline by creating a copy without the removed
+ * elements, and returns a result code
+ */
+op_result dline_remove(dline_t* existing,
+                      dline_t** result,
+                      string_data* string,
+                      unsigned int start,
+                      remove_state* state) {
+  return remove_suffix(existing, result, string, start, state, 0);
+}
+
+/* Start a cursor over the suffixes in dline (which may be NULL) starting
+ * with string[start].
+ */
+void dline_cursor_init(dline_cursor* cursor,
+                       dline_t* dline,
+                       string_data* string,
+                       unsigned int start) {
+  unsigned char word[sizeof(uint64_t)] = {0};
+  unsigned char mask[sizeof(uint64_t)] = {0};
+
+  cursor->current = NULL;
+  cursor->end = NULL;
+  cursor->packed = NULL;
+  if(dline != NULL && is_packed(dline)) {
+    cursor->packed_left = packed_count(dline);
+    cursor->decoded.score = UINT_MAX;
+    cursor->packed = first_packed(dline);
+    if(cursor->packed_left > 0)
+      cursor->packed = unpack_entry(cursor->packed, &cursor->decoded);
+  } else if(dline != NULL) {
+    cursor->current = first_entry(dline);
+    cursor->end = end_entry(dline);
+  }
+  cursor->match = string->normalized + start;
+  cursor->match_len = start >= string->length ? 0 : string->length - start;
+  cursor->start = start;
+  cursor->last_id = NO_PHRASE;
+
+  /*laid out like the len and prefix of an entry, with len masked off*/
+  unsigned int word_len = cursor->match_len < DLINE_INLINE_LEN ?
+    cursor->match_len : DLINE_INLINE_LEN;
+  memcpy(word + sizeof(uint16_t), cursor->match, word_len);
+  memset(mask + sizeof(uint16_t), 0xff, word_len);
+  memcpy(&cursor->match_word, word, sizeof(uint64_t));
+  memcpy(&cursor->match_mask, mask, sizeof(uint64_t));
+}
+
+/* Whether entry is a match for the cursor which hasn't been returned yet,
+ * storing it in result if so
+ */
+static inline int cursor_take(dline_cursor* cursor,
+                              dline_entry* entry,
+                              result_entry* result) {
+  if(cursor->match_len > entry->len ||
+     !prefix_matches(entry, cursor) ||
+     entry->id == cursor->last_id)
+    return 0;
+
+  result->global_ptr = entry_global(entry);
+  result->score = entry->score;
+  result->len = entry->len;
+  result->offset = cursor->start;
+  result->id = entry->id;
+  /* Only matched entries count for de-duping: a longer suffix of the
+   * same string which didn't match mustn't hide a shorter one which did
+   */
+  cursor->last_id = entry->id;
+  return 1;
+}
+
+/* dline_cursor_next for a packed dline, decoding as it goes */
+static int packed_cursor_next(dline_cursor* cursor,
+                              unsigned int min_score,
+                              result_entry* result) {
+  while(cursor->packed_left > 0 && cursor->decoded.score >= min_score) {
+    int taken = cursor_take(cursor, &cursor->decoded, result);
+    if(--cursor->packed_left > 0)
+      cursor->packed = unpack_entry(cursor->packed, &cursor->decoded);
+    if(taken)
+      return 1;
+  }
+  return 0;
+}
+
+/* Move the cursor on to the next matching suffix with at least min_score,
+ * storing it in result. Returns 0 once there are no more. Like
+ * dline_search, only the first (longest) match of each global_ptr is
+ * returned.
+ */
+int dline_cursor_next(dline_cursor* cursor,
+                      unsigned int min_score,
+                      result_entry* result) {
+  if(cursor->packed != NULL)
+    return packed_cursor_next(cursor, min_score, result);
+
+  dline_entry* current = cursor->current;
+  dline_entry* end = cursor->end;
+
+  while(current < end && current->score >= min_score) {
+    if(cursor_take(cursor, current, result)) {
+      cursor->current = next_entry(current);
+      return 1;
+    }
+    current = next_entry(current);
+  }
+
+  cursor->current = current;
+  return 0;
+}
+
+/* Whether an entry sorts no later than a result with score and id */
+static inline int sorts_by(dline_entry* entry,
+                           unsigned int score,
+                           phrase_id id) {
+  return entry->score > score || (entry->score == score && entry->id >= id);
+}
+
+/* Move a cursor which hasn't returned anything yet past every suffix
+ * sorting no later than a result with the given score and id, so that it
+ * picks up after that result.
+ */
+void dline_cursor_seek(dline_cursor* cursor,
+                       unsigned int score,
+                       phrase_id id) {
+  if(cursor->packed != NULL) {
+    while(cursor->packed_left > 0 && sorts_by(&cursor->decoded, score, id)) {
+      if(--cursor->packed_left > 0)
+        cursor->packed = unpack_entry(cursor->packed, &cursor->decoded);
+    }
+    return;
+  }
+
+  /*plain entries are all the same size, so can be binary searched*/
+  dline_entry* low = cursor->current;
+  dline_entry* high = cursor->end;
+  while(low < high) {
+    dline_entry* middle = low + (high - low)/2;
+    if(sorts_by(middle, score, id))
+      low = next_entry(middle);
+    else
+      high = middle;
+  }
+  cursor->current = low;
+}
+
 /* Search the given dline for suffixes starting with string[start] and
  * minimum score of min_score. Stores at most result_len number of entries
  * in results, and returns the number of results stored there. Will NOT
@@ -395,32 +805,19 @@ int dline_search(dline_t* dline,
   if(dline == NULL || string == NULL || results == NULL)
     return 0;
   
-  dline_entry* current = (dline_entry*)dline;
+  dline_cursor cursor;
   int num_found = 0;
-  unsigned int match_len =
-    start >= string->length ? 0 : string->length - start;
-  global_data* last_global_ptr = NULL;
-  
-  while(current->global_ptr != DLINE_MAGIC_TERMINATOR &&
-        current->score >= min_score) {
-    if(current->global_ptr != last_global_ptr &&
-       match_len <= current->len &&
-       !memcmp(string->normalized + start, str_offset(current), match_len)) {
-      memcpy(&results[num_found], current, sizeof(dline_entry));
-      results[num_found].offset = start;
-      num_found++;
-      if(num_found == result_len)
-        break;
-    }
-    last_global_ptr = current->global_ptr;
-    current = next_entry(current);
+
+  dline_cursor_init(&cursor, dline, string, start);
+  while(num_found < result_len &&
+        dline_cursor_next(&cursor, min_score, &results[num_found])) {
+    num_found++;
   }
   
   return num_found;
 }
 
 typedef struct dline_debug_state {
-  uint64_t size;
   int print_contents;
 } dline_debug_state;
 
@@ -438,21 +835,19 @@ static void dline_debug_printer(dline_entry* entry,
     assert(tmp != NULL);
     strncpy(tmp, string, entry->len);
     tmp[entry->len] = '\0';
-    printf("ptr: %p\nlen: %u\nscr: %u\n[%s]\n", (void*)entry->global_ptr,
+    printf("id: %u\nlen: %u\nscr: %u\n[%s]\n", entry->id,
            entry->len,
            entry->score,
            tmp);
     cfree(tmp);
   }
-  debug_state->size += entry_size(entry->len);
 }
 
 /* Simple debugging function which outputs all of the contents of a dline.
  */
 void dline_debug(dline_t* dline) {
-  dline_entry* current = (dline_entry*)dline;
-  dline_debug_state state = {0L,1};
-  printf("dline at 0x%llx\n", (uint64_t)current);
+  dline_debug_state state = {1};
+  printf("dline at 0x%llx\n", (uint64_t)dline);
   
   if(dline == NULL) {
     printf("pointer is null, no entries here\n");
@@ -460,19 +855,44 @@ void dline_debug(dline_t* dline) {
   }
   
   dline_iterate(dline, &state, dline_debug_printer);
-  printf("Total length: %llu\n", (state.size + 8));
+  if(is_packed(dline))
+    printf("Packed length: %u\n", header(dline)->used);
+  else
+    printf("Total length: %u of %u\n", header(dline)->used,
+           header(dline)->capacity);
 }
 
-/* return actual size of a dline in bytes
+/* return actual size of a dline in bytes, not counting spare capacity
  */
 uint64_t dline_size(dline_t* dline) {
-  dline_debug_state state = {0L,0};
   if(dline == NULL) {
     return 0;
   }
-  
-  dline_iterate(dline, &state, dline_debug_printer);
-  return state.size + 8;
+  return header(dline)->used;
+}
+
+/* Highest score in a dline, which is that of its first entry. MIN_SCORE if
+ * there is no dline.
+ */
+unsigned int dline_max_score(dline_t* dline) {
+  if(dline == NULL || header(dline)->used == sizeof(dline_header))
+    return MIN_SCORE;
+  if(is_packed(dline)) {
+    uint32_t drop;
+    get_varint(first_packed(dline), &drop);
+    return UINT_MAX - drop;
+  }
+  return first_entry(dline)->score;
+}
+
+/* Copy a dline into dest, which must have dline_size bytes. The copy has
+ * no spare capacity.
+ */
+void dline_copy(dline_t* dline, void* dest) {
+  uint64_t size = dline_size(dline);
+  memcpy(dest, dline, size);
+  if(!is_packed(dest))
+    header(dest)->capacity = size;
 }
 
 
@@ -482,10 +902,108 @@ void result_entry_debug(result_entry* data, int size) {
   printf("for %d entries at %p\n", size, (void*)data);
   
   for(int i = 0; i < size; i++) {
-    printf("Global %p score %d len %d offset %d\n",
+    printf("Global %p id %u score %d len %d offset %d\n",
            (void*)data[i].global_ptr,
+           data[i].id,
            data[i].score,
            data[i].len,
            data[i].offset);
   }
 }
+
+/* qsort comparator putting dline_sources into dline order */
+int dline_source_cmp(const void* a, const void* b) {
+  const dline_source* s1 = (const dline_source*)a;
+  const dline_source* s2 = (const dline_source*)b;
+
+  if(s1->score != s2->score)
+    return s1->score > s2->score ? -1 : 1;
+  if(s1->id != s2->id)
+    return s1->id > s2->id ? -1 : 1;
+  if(s1->len != s2->len)
+    return s1->len > s2->len ? -1 : 1;
+  return 0;
+}
+
+static inline void source_entry(dline_source* source,
+                                unsigned int skip,
+                                dline_entry* entry) {
+  assert(source->len >= skip);
+  entry->id = source->id;
+  entry->score = source->score;
+  entry->len = source->len - skip;
+  write_prefix(entry, source->suffix + skip, entry->len);
+}
+
+/* Pack sources at out (if not NULL), returning the packed size of the
+ * whole dline, padding included
+ */
+static uint64_t pack_sources(dline_source* sources,
+                             int count,
+                             unsigned int skip,
+                             unsigned char* out) {
+  uint64_t size = sizeof(dline_header);
+  dline_entry prev = {NO_PHRASE, UINT_MAX, 0, {0}};
+  for(int i = 0; i < count; i++) {
+    dline_entry entry;
+    source_entry(&sources[i], skip, &entry);
+    out = pack_entry(out, &entry, &prev, &size);
+    prev = entry;
+  }
+  uint64_t padded = (size + 7) & ~(uint64_t)7;
+  if(out != NULL)
+    memset(out, 0, padded - size);
+  return padded;
+}
+
+/* Whether dline_build packs the given sources. Only large dlines are worth
+ * the decoding, and only if it makes them smaller.
+ */
+static inline int should_pack(dline_source* sources,
+                              int count,
+                              unsigned int skip,
+                              int pack) {
+  return pack && count >= DLINE_PACK_MIN_ENTRIES &&
+    pack_sources(sources, count, skip, NULL) <
+    sizeof(dline_header) + count*sizeof(dline_entry);
+}
+
+/* Exact size of the dline dline_build creates from the given sources, with
+ * the first skip bytes of each suffix already matched by the trie. Sources
+ * must already be in dline order, as for dline_build.
+ */
+uint64_t dline_build_size(dline_source* sources,
+                          int count,
+                          unsigned int skip,
+                          int pack) {
+  if(should_pack(sources, count, skip, pack))
+    return pack_sources(sources, count, skip, NULL);
+  return sizeof(dline_header) + count*sizeof(dline_entry);
+}
+
+/* Write a dline holding the given sources, which must already be in dline
+ * order, into dest (which must have dline_build_size bytes). Used to build
+ * whole dlines at once rather than one dline_upsert copy per suffix. With
+ * pack set the dline is packed if it is large, which makes every later
+ * write to it unpack it first, so only cold dlines should be.
+ */
+void dline_build(dline_source* sources,
+                 int count,
+                 unsigned int skip,
+                 int pack,
+                 dline_t* dest) {
+  if(should_pack(sources, count, skip, pack)) {
+    header(dest)->used = pack_sources(sources, count, skip,
+                                      first_packed(dest));
+    header(dest)->capacity = DLINE_PACKED | count;
+    return;
+  }
+
+  dline_entry* current = first_entry(dest);
+  for(int i = 0; i < count; i++) {
+    source_entry(&sources[i], skip, current);
+    current = next_entry(current);
+  }
+  header(dest)->used = (uint64_t)current - (uint64_t)dest;
+  header(dest)->capacity = header(dest)->used;
+}
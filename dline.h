@@ -7,16 +7,63 @@
 
 #define MIN_SCORE 0
 
+/* Longest suffix a dline can hold, and so longest string there can be */
+#define DLINE_MAX_LEN UINT16_MAX
+
+/* Bytes at the start of each suffix kept in its dline entry, the rest
+ * being read from the global string
+ */
+#define DLINE_INLINE_LEN 6
+
+/* dline_build packs dlines with at least this many entries if asked to,
+ * see dline.c
+ */
+#define DLINE_PACK_MIN_ENTRIES 16
+
 typedef void dline_t;
 
+/* A suffix is the last len bytes of the normalized global string with the
+ * given id. Bytes of prefix beyond len are zero.
+ */
 typedef struct dline_entry {
-  global_data* global_ptr;
+  phrase_id id;
   unsigned int score;
-  unsigned int len;
+  uint16_t len;
+  char prefix[DLINE_INLINE_LEN];
 } dline_entry;
 
+/* Walks the suffixes of a dline matching a search one at a time, in dline
+ * order. Only valid as long as the dline is. Packed dlines are decoded an
+ * entry at a time into decoded instead, so a cursor can be moved about.
+ */
+typedef struct dline_cursor {
+  dline_entry* current;
+  dline_entry* end;
+  unsigned char* packed; /*next entry to decode, NULL if not packed*/
+  uint32_t packed_left; /*entries left, counting decoded*/
+  dline_entry decoded;
+  char* match;
+  unsigned int match_len;
+  unsigned int start;
+  uint64_t match_word; /*len and prefix of an entry, see prefix_matches*/
+  uint64_t match_mask;
+  phrase_id last_id;
+} dline_cursor;
+
 typedef void(dline_iter_fn)(dline_entry*, char*, void*);
 
+/* A suffix to be written out by dline_build. suffix is its len bytes,
+ * the start of which are copied into the entry.
+ */
+typedef struct dline_source {
+  phrase_id id;
+  unsigned int score;
+  unsigned int len;
+  char* suffix;
+} dline_source;
+
+global_data* create_global(string_data* string);
+
 void dline_iterate(dline_t* dline, void* state, dline_iter_fn function);
                    
 op_result dline_upsert(dline_t* existing,
@@ -39,10 +86,40 @@ int dline_search(dline_t* dline,
                  result_entry* results,
                  int result_len);
 
+void dline_cursor_init(dline_cursor* cursor,
+                       dline_t* dline,
+                       string_data* string,
+                       unsigned int start);
+
+int dline_cursor_next(dline_cursor* cursor,
+                      unsigned int min_score,
+                      result_entry* result);
+
+void dline_cursor_seek(dline_cursor* cursor,
+                       unsigned int score,
+                       phrase_id id);
+
 void dline_debug(dline_t* dline);
 
 uint64_t dline_size(dline_t* dline);
 
+unsigned int dline_max_score(dline_t* dline);
+
+void dline_copy(dline_t* dline, void* dest);
+
+int dline_source_cmp(const void* a, const void* b);
+
+uint64_t dline_build_size(dline_source* sources,
+                          int count,
+                          unsigned int skip,
+                          int pack);
+
+void dline_build(dline_source* sources,
+                 int count,
+                 unsigned int skip,
+                 int pack,
+                 dline_t* dest);
+
 void result_entry_debug(result_entry* data, int size);
 
 #endif
@@ -0,0 +1,154 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include "cmalloc.h"
+#include "epoch.h"
+
+/* Epoch based reclamation, which lets readers traverse shared structures
+ * without locks while a writer replaces parts of them.
+ * Readers bracket any access to shared memory with epoch_enter/epoch_exit,
+ * which records the global epoch the reader started in. A writer which
+ * unlinks something hands it to epoch_retire instead of freeing it, which
+ * tags it with the current epoch. epoch_reclaim then advances the epoch and
+ * frees everything retired before the oldest epoch a reader is still in,
+ * since no reader can still hold a pointer to it.
+ */
+
+/* Each reader gets its own cache line, so readers never contend */
+typedef struct reader_slot {
+  uint64_t epoch; /*0 if not in a critical section*/
+  int claimed;
+  char padding[64 - sizeof(uint64_t) - sizeof(int)];
+} reader_slot;
+
+typedef struct retired_ptr {
+  void* ptr;
+  uint64_t epoch;
+} retired_ptr;
+
+static uint64_t global_epoch = 1;
+static uint64_t safe_epoch = 1; /*oldest a reader was in at the last reclaim*/
+static reader_slot readers[EPOCH_MAX_THREADS];
+static int num_readers = 0;
+
+static __thread reader_slot* my_slot = NULL;
+static __thread int my_depth = 0;
+
+/* Retired pointers are only ever appended with a nondecreasing epoch, so
+ * the ones safe to free are always a prefix
+ */
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+static retired_ptr* retired = NULL;
+static int num_retired = 0;
+static int retired_capacity = 0;
+
+/* Claim a slot for this thread on its first epoch_enter. Slots are never
+ * given back, threads are expected to live as long as the process.
+ */
+static reader_slot* claim_slot() {
+  for(int i = 0; i < EPOCH_MAX_THREADS; i++) {
+    int unclaimed = 0;
+    if(__atomic_compare_exchange_n(&readers[i].claimed, &unclaimed, 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      int seen = __atomic_load_n(&num_readers, __ATOMIC_SEQ_CST);
+      while(seen < i + 1 &&
+            !__atomic_compare_exchange_n(&num_readers, &seen, i + 1, 0,
+                                         __ATOMIC_SEQ_CST,
+                                         __ATOMIC_SEQ_CST)) {
+      }
+      return &readers[i];
+    }
+  }
+  assert(0 && "too many epoch reader threads");
+  return NULL;
+}
+
+/* Start a read side critical section. Sections may nest, only the
+ * outermost one counts.
+ */
+void epoch_enter() {
+  if(my_depth++ > 0)
+    return;
+  if(my_slot == NULL)
+    my_slot = claim_slot();
+
+  __atomic_store_n(&my_slot->epoch,
+                   __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST),
+                   __ATOMIC_SEQ_CST);
+}
+
+void epoch_exit() {
+  assert(my_depth > 0);
+  if(--my_depth > 0)
+    return;
+  __atomic_store_n(&my_slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Free ptr once no reader can be holding it. It must already be unlinked
+ * from anything readers can reach. Safe to call from any thread.
+ */
+void epoch_retire(void* ptr) {
+  if(ptr == NULL)
+    return;
+
+  pthread_mutex_lock(&retired_lock);
+  if(num_retired == retired_capacity) {
+    int capacity = retired_capacity == 0 ? 1024 : retired_capacity*2;
+    retired_ptr* grown = cmalloc(capacity*sizeof(retired_ptr));
+    assert(grown != NULL);
+    if(retired != NULL) {
+      memcpy(grown, retired, num_retired*sizeof(retired_ptr));
+      cfree(retired);
+    }
+    retired = grown;
+    retired_capacity = capacity;
+  }
+  retired[num_retired].ptr = ptr;
+  retired[num_retired].epoch = __atomic_load_n(&global_epoch,
+                                               __ATOMIC_SEQ_CST);
+  num_retired++;
+  pthread_mutex_unlock(&retired_lock);
+}
+
+/* Advance the epoch and free everything no reader can still see. Called by
+ * the writer after each batch of changes.
+ */
+void epoch_reclaim() {
+  uint64_t min_epoch = __atomic_add_fetch(&global_epoch, 1,
+                                          __ATOMIC_SEQ_CST);
+  int total = __atomic_load_n(&num_readers, __ATOMIC_SEQ_CST);
+
+  for(int i = 0; i < total; i++) {
+    uint64_t epoch = __atomic_load_n(&readers[i].epoch, __ATOMIC_SEQ_CST);
+    if(epoch != 0 && epoch < min_epoch)
+      min_epoch = epoch;
+  }
+
+  __atomic_store_n(&safe_epoch, min_epoch, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_lock(&retired_lock);
+  int freed = 0;
+  while(freed < num_retired && retired[freed].epoch < min_epoch) {
+    cfree(retired[freed].ptr);
+    freed++;
+  }
+  if(freed > 0) {
+    memmove(retired, &retired[freed],
+            (num_retired - freed)*sizeof(retired_ptr));
+    num_retired -= freed;
+  }
+  pthread_mutex_unlock(&retired_lock);
+}
+
+/* The current epoch, which anything unlinked now is tagged with */
+uint64_t epoch_now() {
+  return __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+}
+
+/* Nothing unlinked in an epoch before this one can still be seen by a
+ * reader. Only moves on at epoch_reclaim.
+ */
+uint64_t epoch_safe() {
+  return __atomic_load_n(&safe_epoch, __ATOMIC_SEQ_CST);
+}
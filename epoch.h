@@ -0,0 +1,27 @@
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+#include <stdint.h>
+
+/* Max number of threads which may ever call epoch_enter */
+#define EPOCH_MAX_THREADS 256
+
+/* Publish a pointer (or other word) which concurrent readers may load, after
+ * everything it points to has been written.
+ */
+#define PUBLISH(dest, value) __atomic_store_n(&(dest), (value), \
+                                              __ATOMIC_RELEASE)
+
+/* Load something a writer may concurrently PUBLISH */
+#define READ_SHARED(src) __atomic_load_n(&(src), __ATOMIC_ACQUIRE)
+
+void epoch_enter();
+void epoch_exit();
+
+void epoch_retire(void* ptr);
+void epoch_reclaim();
+
+uint64_t epoch_now();
+uint64_t epoch_safe();
+
+#endif
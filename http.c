@@ -1,23 +1,70 @@
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /*for CPU pinning*/
+#endif
+#include <sched.h>
+#endif
+
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <event2/buffer.h>
 #include <event2/event.h>
 #include <event2/http.h>
 #include <event2/keyvalq_struct.h>
+#include <event2/listener.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/queue.h>
 #include "cmalloc.h"
 #include "dline.h"
+#include "epoch.h"
 #include "http.h"
 #include "parse.h"
+#include "phrase.h"
 #include "server.h"
+#include "session.h"
 
 #define NUM_RESULTS 25
 
+/* Most results a single /complete can ask for with n */
+#define MAX_RESULTS 1000
+
+/* A continuation cursor is the score and id of the last result of a page,
+ * each as 8 hex digits
+ */
+#define CURSOR_CHARS 16
+
+/* Room for everything in a formatted result besides its string */
+#define RESULT_FORMAT_BYTES 80
+
+/* Starting size of each worker's scratch arena, grown to fit as needed */
+#define SCRATCH_BYTES (16*1024)
+
+/* Type-ahead sessions each worker keeps */
+#define SESSION_SLOTS 1024
+
+/* Each worker answers searches out of its own scratch arena and reply
+ * buffer, reused from one request to the next, so that once warmed up the
+ * search path doesn't allocate. Sessions are kept per worker too, a
+ * client's keystrokes usually all arriving over one connection.
+ */
+typedef struct http_worker {
+  server_t* server;
+  int port;
+  int cpu; /*-1 to leave unpinned*/
+  pthread_t thread;
+  arena scratch;
+  struct evbuffer* reply;
+  session_cache* sessions;
+  const char* snapshot_path; /*NULL if snapshots can't be taken*/
+} http_worker;
+
 static inline uint64_t json_replace(char c, char** escaped) {
   switch(c) {
     case '\b':
@@ -46,49 +93,84 @@ static inline uint64_t json_replace(char c, char** escaped) {
   }
 }
 
-/* JSON string escaping, styled in the way of libevent's http escaping*/
-static char* json_escape(char* in) {
-  uint64_t old_len = 0;
-  uint64_t idx = 0;
+/* Length of a string once JSON escaped */
+static uint64_t json_escaped_len(char* in) {
+  uint64_t len = 0;
 
-  while(in[idx] != '\0') {
+  for(uint64_t idx = 0; in[idx] != '\0'; idx++) {
     char* unused = NULL;
-    old_len += json_replace(in[idx], &unused);
-    idx++;
+    len += json_replace(in[idx], &unused);
   }
+  return len;
+}
 
-  char* buffer = cmalloc(old_len + 1);
-  if(buffer == NULL)
-    return NULL;
-
-  char* p = buffer;
-  for(int i = 0; i < idx; i++) {
+/* JSON string escaping, styled in the way of libevent's http escaping.
+ * Writes to out, which must have room for json_escaped_len(in) bytes, and
+ * returns where the escaped string ends there.
+ */
+static char* json_escape(char* in, char* out) {
+  for(uint64_t i = 0; in[i] != '\0'; i++) {
     char* escaped = &in[i];
     uint64_t size = json_replace(in[i], &escaped);
-    memcpy(p, escaped, size);
-    p += size;
+    memcpy(out, escaped, size);
+    out += size;
   }
-  *p = '\0';
+  return out;
+}
 
-  return buffer;
+/* Parse a score given over http, returning 0 if it isn't a valid one */
+static int parse_score(char* score_string, unsigned int* score) {
+  char* end;
+  errno = 0;
+  int64_t converted = strtoll(score_string, &end, 10);
+  if(errno == ERANGE || errno == EINVAL || *score_string == '\0' ||
+     *end != '\0' || converted < 0 || converted > UINT_MAX) {
+    return 0;
+  }
+  *score = (unsigned int)converted;
+  return 1;
 }
 
+/* Parse a continuation cursor, returning 0 if it isn't a valid one */
+static int parse_cursor(char* cursor_string, search_page* page) {
+  if(strlen(cursor_string) != CURSOR_CHARS)
+    return 0;
+  for(int i = 0; i < CURSOR_CHARS; i++) {
+    if(!isxdigit((unsigned char)cursor_string[i]))
+      return 0;
+  }
+  uint64_t converted = strtoull(cursor_string, NULL, 16);
+  page->after = 1;
+  page->after_score = (unsigned int)(converted >> 32);
+  page->after_id = (phrase_id)converted;
+  return 1;
+}
+
+/* Complete a prefix, giving back up to n results (NUM_RESULTS by default)
+ * scoring at least min_score. A full page comes with a cursor, passed back
+ * to get the results following it. First pages can be tagged with a
+ * session, see session.h.
+ */
 void prefix_handler(struct evhttp_request *req, void* arg) {
-  result_entry results[NUM_RESULTS];
-  struct evbuffer* ret = evbuffer_new();
+  http_worker* worker = (http_worker*)arg;
+  struct evbuffer* ret = worker->reply;
   struct evkeyvalq params;
   struct evkeyval* param;
   const char* uri = evhttp_request_get_uri(req);
   char* full_string = NULL;
   char* callback = NULL;
+  char* n_string = NULL;
+  char* min_score_string = NULL;
+  char* cursor_string = NULL;
+  char* session = NULL;
 
   if(ret == NULL) {
     evhttp_send_error(req, 500, "Server Error");
+    return;
   }
 
   if(evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
     evhttp_send_error(req, 405, "must use GET for complete");
-    evbuffer_free(ret);
     return;
   }
 
@@ -100,54 +182,233 @@ void prefix_handler(struct evhttp_request *req, void* arg) {
       full_string = param->value;
     if(param->key != NULL && !strcmp(param->key, "callback"))
       callback = param->value;
+    if(param->key != NULL && !strcmp(param->key, "n"))
+      n_string = param->value;
+    if(param->key != NULL && !strcmp(param->key, "min_score"))
+      min_score_string = param->value;
+    if(param->key != NULL && !strcmp(param->key, "cursor"))
+      cursor_string = param->value;
+    if(param->key != NULL && !strcmp(param->key, "session"))
+      session = param->value;
   }
   if(full_string == NULL) {
     evhttp_send_error(req, 400, "Bad Syntax");
     evhttp_clear_headers(&params);
-    evbuffer_free(ret);
+    return;
+  }
+
+  unsigned int num_results = NUM_RESULTS;
+  search_page page = {MIN_SCORE, 0, 0, NO_PHRASE};
+  if((n_string != NULL && (!parse_score(n_string, &num_results) ||
+                           num_results == 0 ||
+                           num_results > MAX_RESULTS)) ||
+     (min_score_string != NULL &&
+      !parse_score(min_score_string, &page.min_score)) ||
+     (cursor_string != NULL && !parse_cursor(cursor_string, &page))) {
+    evhttp_send_error(req, 400, "Bad Syntax");
+    evhttp_clear_headers(&params);
     return;
   }
 
   /* This strlen is almost certainly a security bug */
   string_data string;
-  assert(!normalize(full_string, &string));
+  result_entry* results = arena_alloc(&worker->scratch,
+                                      num_results*sizeof(result_entry));
+  if(results == NULL ||
+     normalize_arena(full_string, &string, &worker->scratch)) {
+    evhttp_send_error(req, 500, "Server Error");
+    evhttp_clear_headers(&params);
+    arena_reset(&worker->scratch);
+    return;
+  }
 
-  evhttp_add_header(evhttp_request_get_output_headers(req),
-                    "Content-Type", "application/json");
-  if(callback == NULL) {
-    evbuffer_add_printf(ret, "{\"results\":[");
+  /* The global strings results point to are only safe to read until
+   * epoch_exit, as a concurrent update may replace them. The whole reply
+   * is sized up front and formatted into one piece of scratch.
+   */
+  epoch_enter();
+  int len;
+  int truncated;
+  if(session != NULL && !page.after) {
+    len = session_search(worker->sessions, worker->server, session, &string,
+                         results, num_results, page.min_score,
+                         &worker->scratch, &truncated);
   } else {
-    evbuffer_add_printf(ret, "%s({\"results\":[", callback);
+    len = server_search(worker->server, &string, results, num_results,
+                        &page, &worker->scratch, &truncated);
+  }
+  uint64_t size = strlen("({\"results\":[],\"next\":\"\"})\n") +
+    CURSOR_CHARS + 1;
+  if(callback != NULL)
+    size += strlen(callback);
+  for(int i = 0; i < len; i++) {
+    size += json_escaped_len(GLOBAL_STR(results[i].global_ptr)) +
+      RESULT_FORMAT_BYTES;
   }
 
-  int len = server_search((server_t*)arg, &string, results, NUM_RESULTS);
+  char* buffer = arena_alloc(&worker->scratch, size);
+  if(buffer == NULL) {
+    epoch_exit();
+    evhttp_send_error(req, 500, "Server Error");
+    evhttp_clear_headers(&params);
+    arena_reset(&worker->scratch);
+    return;
+  }
+
+  char* p = buffer;
+  if(callback == NULL) {
+    p += sprintf(p, "{\"results\":[");
+  } else {
+    p += sprintf(p, "%s({\"results\":[", callback);
+  }
   for(int i = 0; i < len; i++) {
-    int total = results[i].global_ptr->len;
+    /*the match is found in the normalized string, but reported in the full*/
+    global_data* global = results[i].global_ptr;
+    int total = global->normalized_len;
     int start = total-results[i].len-results[i].offset;
-    char* encoded_string = json_escape(GLOBAL_STR(results[i].global_ptr));
-    
-    if(encoded_string == NULL) {
-      evhttp_send_error(req, 500, "Server Error");
-      evbuffer_free(ret);
-      return;
-    }
-    
-    evbuffer_add_printf(ret,
-      "%s{\"str\":\"%s\",\"scr\":%d,\"st\":%d,\"len\":%d}",
-      i == 0 ? "" : ",",
-      encoded_string,
-      (int)results[i].score,
-      (int)start,
-      (int)(string.length));
-    cfree(encoded_string);
-  }
-  
-  evbuffer_add_printf(ret, "]}%s\n", callback != NULL ? ")" : "");
+    unsigned int full_start, full_end;
+    full_span(GLOBAL_STR(global), global->len, start, start + string.length,
+              &full_start, &full_end);
+
+    p += sprintf(p, "%s{\"str\":\"", i == 0 ? "" : ",");
+    p = json_escape(GLOBAL_STR(global), p);
+    p += sprintf(p, "\",\"scr\":%d,\"st\":%d,\"len\":%d}",
+                 (int)results[i].score,
+                 (int)full_start,
+                 (int)(full_end - full_start));
+  }
+  epoch_exit();
+  p += sprintf(p, "]");
+  /*only a search cut off at num_results has another page*/
+  if(truncated && len > 0) {
+    p += sprintf(p, ",\"next\":\"%08x%08x\"",
+                 results[len-1].score, results[len-1].id);
+  }
+  p += sprintf(p, "}%s\n", callback != NULL ? ")" : "");
+
+  evhttp_add_header(evhttp_request_get_output_headers(req),
+                    "Content-Type", "application/json");
+  evbuffer_add(ret, buffer, p - buffer);
   evhttp_send_reply(req, HTTP_OK, "OK", ret);
-  
+
+  evhttp_clear_headers(&params);
+  arena_reset(&worker->scratch);
+}
+
+/* Look up a single phrase by its exact string, or failing that one which
+ * only differs from it in case or accents, giving back its current score
+ */
+void find_handler(struct evhttp_request* req, void* arg) {
+  http_worker* worker = (http_worker*)arg;
+  struct evbuffer* ret = worker->reply;
+  struct evkeyvalq params;
+  struct evkeyval* param;
+  const char* uri = evhttp_request_get_uri(req);
+  char* phrase = NULL;
+  char* callback = NULL;
+
+  if(ret == NULL) {
+    evhttp_send_error(req, 500, "Server Error");
+    return;
+  }
+
+  if(evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    evhttp_send_error(req, 405, "must use GET for get");
+    return;
+  }
+
+  TAILQ_INIT(&params);
+  evhttp_parse_query(uri, &params);
+
+  TAILQ_FOREACH(param, &params, next) {
+    if(param->key != NULL && !strcmp(param->key, "phrase"))
+      phrase = param->value;
+    if(param->key != NULL && !strcmp(param->key, "callback"))
+      callback = param->value;
+  }
+  if(phrase == NULL) {
+    evhttp_send_error(req, 400, "Bad Syntax");
+    evhttp_clear_headers(&params);
+    return;
+  }
+
+  string_data string;
+  if(normalize_arena(phrase, &string, &worker->scratch)) {
+    evhttp_send_error(req, 500, "Server Error");
+    evhttp_clear_headers(&params);
+    arena_reset(&worker->scratch);
+    return;
+  }
+
+  /*as with searches, the string found is only safe to read until exit*/
+  epoch_enter();
+  global_data* global = server_find(worker->server, &string);
+  char* buffer = NULL;
+  char* p = NULL;
+  if(global != NULL) {
+    uint64_t size = json_escaped_len(GLOBAL_STR(global)) +
+      RESULT_FORMAT_BYTES + 1;
+    if(callback != NULL)
+      size += strlen(callback) + 2;
+    buffer = arena_alloc(&worker->scratch, size);
+  }
+  if(buffer != NULL) {
+    p = buffer;
+    if(callback != NULL)
+      p += sprintf(p, "%s(", callback);
+    p += sprintf(p, "{\"str\":\"");
+    p = json_escape(GLOBAL_STR(global), p);
+    p += sprintf(p, "\",\"scr\":%u}%s\n",
+                 READ_SHARED(global->score),
+                 callback != NULL ? ")" : "");
+  }
+  epoch_exit();
+
+  if(global == NULL) {
+    evhttp_send_error(req, 404, "no such phrase");
+  } else if(buffer == NULL) {
+    evhttp_send_error(req, 500, "Server Error");
+  } else {
+    evhttp_add_header(evhttp_request_get_output_headers(req),
+                      "Content-Type", "application/json");
+    evbuffer_add(ret, buffer, p - buffer);
+    evhttp_send_reply(req, HTTP_OK, "OK", ret);
+  }
+
+  evhttp_clear_headers(&params);
+  arena_reset(&worker->scratch);
+}
+
+/* Remove a phrase, with DELETE on the same path as set */
+void remove_handler(struct evhttp_request* req, void* arg) {
+  struct evkeyvalq params;
+  struct evkeyval* param;
+  const char* uri = evhttp_request_get_uri(req);
+  char* phrase = NULL;
+
+  TAILQ_INIT(&params);
+  evhttp_parse_query(uri, &params);
+
+  TAILQ_FOREACH(param, &params, next) {
+    if(param->key != NULL && !strcmp(param->key, "phrase"))
+      phrase = param->value;
+  }
+  if(phrase == NULL) {
+    evhttp_send_error(req, 400, "Bad Syntax");
+    evhttp_clear_headers(&params);
+    return;
+  }
+
+  op_result result = server_remove((server_t*)arg, phrase);
+  if(result == NOT_FOUND) {
+    evhttp_send_error(req, 404, "no such phrase");
+  } else if(result != NO_ERROR) {
+    evhttp_send_error(req, 500, "Server Error");
+  } else {
+    evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+  }
+
   evhttp_clear_headers(&params);
-  cfree(string.normalized);
-  evbuffer_free(ret);
 }
 
 void upsert_handler(struct evhttp_request *req, void* arg) {
@@ -157,8 +418,13 @@ void upsert_handler(struct evhttp_request *req, void* arg) {
   char* phrase = NULL;
   char* score_string = NULL;
 
-  if(evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
-    evhttp_send_error(req, 405, "must use POST for set");
+  if(evhttp_request_get_command(req) == EVHTTP_REQ_DELETE) {
+    remove_handler(req, arg);
+    return;
+  }
+  if(evhttp_request_get_command(req) != EVHTTP_REQ_POST &&
+     evhttp_request_get_command(req) != EVHTTP_REQ_PUT) {
+    evhttp_send_error(req, 405, "must use POST/PUT or DELETE for set");
     return;
   }
 
@@ -177,15 +443,12 @@ void upsert_handler(struct evhttp_request *req, void* arg) {
     return;
   }
 
-  char* end;
-  int64_t converted = strtoll(score_string, &end, 10);
-  if(errno == ERANGE || errno == EINVAL || *score_string == '\0' ||
-     *end != '\0' || converted < 0 || converted > ULONG_MAX) {
+  unsigned int score;
+  if(!parse_score(score_string, &score)) {
     evhttp_send_error(req, 400, "unparseable score");
     evhttp_clear_headers(&params);
     return;
   }
-  unsigned int score = (unsigned int)converted;
 
   if(server_upsert((server_t*)arg, phrase, score)) {
     evhttp_send_error(req, 500, "Server Error");
@@ -197,27 +460,363 @@ void upsert_handler(struct evhttp_request *req, void* arg) {
 
 }
 
+static const char* batch_status(op_result result) {
+  switch(result) {
+    case NO_ERROR:
+      return "ok";
+    case BAD_PARAM:
+      return "bad line";
+    default:
+      return "error";
+  }
+}
+
+/* Adds the len bytes at data to the partial line *pending (of *pending_len
+ * bytes, NULL if none), which is reallocated to fit them and a terminator.
+ * Returns nonzero if it can't be.
+ */
+static int batch_extend(char** pending,
+                        size_t* pending_len,
+                        char* data,
+                        size_t len) {
+  char* grown = cmalloc(*pending_len + len + 1);
+  if(grown == NULL)
+    return 1;
+  if(*pending != NULL)
+    memcpy(grown, *pending, *pending_len);
+  memcpy(grown + *pending_len, data, len);
+  cfree(*pending);
+  *pending = grown;
+  *pending_len += len;
+  (*pending)[*pending_len] = '\0';
+  return 0;
+}
+
+/* Split a request body into its lines where they sit in the buffer's
+ * chains, terminating each by writing over its newline. Only a line with
+ * no newline in the chain it starts in is copied out (into copies, for
+ * the caller to free), which is one running over into the next chain or
+ * the last line of a body not ending in one. lines must have room for a
+ * line more than there are newlines. Returns the number of lines, or -1
+ * if a copy can't be allocated.
+ */
+static int batch_lines(struct evbuffer_iovec* chains,
+                       int num_chains,
+                       char** lines,
+                       char** copies,
+                       int* num_copies) {
+  static char empty[] = "";
+  char* pending = NULL;
+  size_t pending_len = 0;
+  int count = 0;
+
+  *num_copies = 0;
+  for(int i = 0; i < num_chains; i++) {
+    char* pos = chains[i].iov_base;
+    char* end = pos + chains[i].iov_len;
+    while(pos < end) {
+      char* newline = memchr(pos, '\n', end - pos);
+      if(newline == NULL) {
+        if(batch_extend(&pending, &pending_len, pos, end - pos)) {
+          cfree(pending);
+          return -1;
+        }
+        break;
+      }
+
+      if(pending != NULL) {
+        if(batch_extend(&pending, &pending_len, pos, newline - pos)) {
+          cfree(pending);
+          return -1;
+        }
+        copies[(*num_copies)++] = pending;
+        lines[count++] = pending;
+        pending = NULL;
+        pending_len = 0;
+      } else {
+        *newline = '\0';
+        lines[count++] = pos;
+      }
+      pos = newline + 1;
+    }
+  }
+
+  if(pending != NULL) {
+    copies[(*num_copies)++] = pending;
+    lines[count++] = pending;
+  } else {
+    lines[count++] = empty;
+  }
+  return count;
+}
+
+/* Upsert every phrase<TAB>score line of the request body, all under one
+ * write lock. The body is parsed where it sits in the request's buffer,
+ * chain by chain, splitting lines by writing terminators into it, and the
+ * status of each (non-empty) line is returned by line number.
+ */
+void batch_handler(struct evhttp_request* req, void* arg) {
+  struct evbuffer* body = evhttp_request_get_input_buffer(req);
+
+  if(evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
+    evhttp_send_error(req, 405, "must use POST for batch");
+    return;
+  }
+
+  int num_chains = evbuffer_peek(body, -1, NULL, NULL, 0);
+  struct evbuffer_iovec* chains =
+    cmalloc((num_chains + 1)*sizeof(struct evbuffer_iovec));
+  if(chains == NULL) {
+    evhttp_send_error(req, 500, "Server Error");
+    return;
+  }
+  num_chains = evbuffer_peek(body, -1, NULL, chains, num_chains);
+
+  int num_lines = 1;
+  for(int i = 0; i < num_chains; i++) {
+    char* pos = chains[i].iov_base;
+    char* end = pos + chains[i].iov_len;
+    while((pos = memchr(pos, '\n', end - pos)) != NULL) {
+      num_lines++;
+      pos++;
+    }
+  }
+
+  char** lines = cmalloc(num_lines*sizeof(char*));
+  /*each copy ends in a different chain, or at the end of the body*/
+  char** copies = cmalloc((num_chains + 1)*sizeof(char*));
+  int num_copies = 0;
+  if(lines == NULL || copies == NULL ||
+     batch_lines(chains, num_chains, lines, copies, &num_copies) < 0) {
+    evhttp_send_error(req, 500, "Server Error");
+    cfree(chains);
+    cfree(lines);
+    cfree(copies);
+    return;
+  }
+
+  char** phrases = cmalloc(num_lines*sizeof(char*));
+  unsigned int* scores = cmalloc(num_lines*sizeof(unsigned int));
+  op_result* results = cmalloc(num_lines*sizeof(op_result));
+  int* phrase_lines = cmalloc(num_lines*sizeof(int));
+  int* line_status = cmalloc(num_lines*sizeof(int)); /*-1 for blank lines*/
+  struct evbuffer* ret = evbuffer_new();
+  if(phrases == NULL || scores == NULL || results == NULL ||
+     phrase_lines == NULL || line_status == NULL || ret == NULL) {
+    evhttp_send_error(req, 500, "Server Error");
+  } else {
+    /* Lines which can't be parsed are marked bad here, the rest are
+     * applied together below
+     */
+    int count = 0;
+    for(int i = 0; i < num_lines; i++) {
+      char* line = lines[i];
+      size_t line_len = strlen(line);
+      if(line_len > 0 && line[line_len - 1] == '\r')
+        line[line_len - 1] = '\0';
+
+      char* tab = strrchr(line, '\t');
+      line_status[i] = *line == '\0' ? -1 : BAD_PARAM;
+      if(tab != NULL && tab != line) {
+        *tab = '\0';
+        if(parse_score(tab + 1, &scores[count])) {
+          phrases[count] = line;
+          phrase_lines[count++] = i;
+        }
+      }
+    }
+
+    server_upsert_batch((server_t*)arg, phrases, scores, count, results);
+    for(int i = 0; i < count; i++)
+      line_status[phrase_lines[i]] = results[i];
+
+    evhttp_add_header(evhttp_request_get_output_headers(req),
+                      "Content-Type", "application/json");
+    evbuffer_add_printf(ret, "{\"results\":[");
+    int first = 1;
+    for(int i = 0; i < num_lines; i++) {
+      if(line_status[i] < 0)
+        continue;
+      evbuffer_add_printf(ret, "%s{\"line\":%d,\"status\":\"%s\"}",
+                          first ? "" : ",",
+                          i + 1,
+                          batch_status(line_status[i]));
+      first = 0;
+    }
+    evbuffer_add_printf(ret, "]}\n");
+    evhttp_send_reply(req, HTTP_OK, "OK", ret);
+  }
+
+  cfree(phrases);
+  cfree(scores);
+  cfree(results);
+  cfree(phrase_lines);
+  cfree(line_status);
+  if(ret != NULL)
+    evbuffer_free(ret);
+  for(int i = 0; i < num_copies; i++)
+    cfree(copies[i]);
+  cfree(copies);
+  cfree(lines);
+  cfree(chains);
+}
+
+/* Write a snapshot of the index, for starting from. It always goes to the
+ * path given at startup: one named by the request is refused, since the
+ * file there gets replaced.
+ */
+void snapshot_handler(struct evhttp_request* req, void* arg) {
+  http_worker* worker = (http_worker*)arg;
+  struct evkeyvalq params;
+  struct evkeyval* param;
+  const char* uri = evhttp_request_get_uri(req);
+  int has_path = 0;
+
+  if(evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
+    evhttp_send_error(req, 405, "must use POST for snapshot");
+    return;
+  }
+  if(worker->snapshot_path == NULL) {
+    evhttp_send_error(req, 403, "no snapshot path configured");
+    return;
+  }
+
+  TAILQ_INIT(&params);
+  evhttp_parse_query(uri, &params);
+
+  TAILQ_FOREACH(param, &params, next) {
+    if(param->key != NULL && !strcmp(param->key, "path"))
+      has_path = 1;
+  }
+  if(has_path) {
+    evhttp_send_error(req, 400, "snapshot path is set at startup");
+    evhttp_clear_headers(&params);
+    return;
+  }
+
+  if(server_snapshot_save(worker->server, worker->snapshot_path)) {
+    evhttp_send_error(req, 500, "Server Error");
+  } else {
+    evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+  }
+
+  evhttp_clear_headers(&params);
+}
+
+/* Compact the change log, see server_compact_log */
+void compact_handler(struct evhttp_request* req, void* arg) {
+  if(evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
+    evhttp_send_error(req, 405, "must use POST for compact");
+    return;
+  }
+
+  if(server_compact_log((server_t*)arg)) {
+    evhttp_send_error(req, 500, "Server Error");
+  } else {
+    evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+  }
+}
+
 void quit_handler(struct evhttp_request* req, void* arg) {
   printf("!!!!I was told to Quit!!!!\n");
   evhttp_send_reply(req, HTTP_OK, "OK", NULL);
   exit(0);
 }
 
-void init_and_run(server_t* server, int port) {
+static void pin_to_cpu(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+    fprintf(stderr, "couldn't pin http thread to cpu %d\n", cpu);
+#else
+  fprintf(stderr, "cpu pinning not supported here\n");
+#endif
+}
+
+/* Each worker runs its own event loop with its own listening socket, all
+ * bound to the same port through SO_REUSEPORT so the kernel spreads
+ * connections between them. Searches never block each other, and writes
+ * are serialized inside the server.
+ */
+static void* run_worker(void* arg) {
+  http_worker* worker = (http_worker*)arg;
   struct event_base* base;
   struct evhttp* http;
+  struct evconnlistener* listener;
+  struct sockaddr_in addr;
+
+  if(worker->cpu >= 0)
+    pin_to_cpu(worker->cpu);
 
   base = event_base_new();
   assert(base != NULL);
 
+  arena_init(&worker->scratch, SCRATCH_BYTES);
+  worker->reply = evbuffer_new();
+  assert(worker->reply != NULL);
+  worker->sessions = session_cache_init(SESSION_SLOTS);
+  assert(worker->sessions != NULL);
+
   http = evhttp_new(base);
   assert(http != NULL);
 
-  evhttp_set_cb(http, "/complete", prefix_handler, (void*)server);
-  evhttp_set_cb(http, "/set", upsert_handler, (void*)server);
-  evhttp_set_cb(http, "/admin/quit", quit_handler, (void*)server);
+  evhttp_set_cb(http, "/complete", prefix_handler, (void*)worker);
+  evhttp_set_cb(http, "/get", find_handler, (void*)worker);
+  evhttp_set_cb(http, "/set", upsert_handler, (void*)worker->server);
+  evhttp_set_cb(http, "/batch", batch_handler, (void*)worker->server);
+  evhttp_set_cb(http, "/admin/snapshot", snapshot_handler, (void*)worker);
+  evhttp_set_cb(http, "/admin/compact", compact_handler,
+                (void*)worker->server);
+  evhttp_set_cb(http, "/admin/quit", quit_handler, (void*)worker->server);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(worker->port);
+  listener = evconnlistener_new_bind(base, NULL, NULL,
+    LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT | LEV_OPT_CLOSE_ON_FREE,
+    -1, (struct sockaddr*)&addr, sizeof(addr));
+  if(listener == NULL || evhttp_bind_listener(http, listener) == NULL) {
+    fprintf(stderr, "couldn't listen on port %d\n", worker->port);
+    exit(1);
+  }
 
-  assert(evhttp_bind_socket_with_handle(http, "0.0.0.0", port) != NULL);
   event_base_dispatch(base);
+  return NULL;
+}
+
+/* Serve the server over http on the given port with num_threads event
+ * loops. If pin is set, thread i is pinned to cpu i. Snapshots are written
+ * to snapshot_path, or can't be taken if it is NULL. The calling thread
+ * becomes the last worker, so this never returns.
+ */
+void init_and_run(server_t* server,
+                  int port,
+                  int num_threads,
+                  int pin,
+                  const char* snapshot_path) {
+  assert(num_threads > 0 && num_threads <= EPOCH_MAX_THREADS);
+  http_worker* workers = cmalloc(num_threads*sizeof(http_worker));
+  assert(workers != NULL);
+
+  for(int i = 0; i < num_threads; i++) {
+    workers[i].server = server;
+    workers[i].port = port;
+    workers[i].cpu = pin ? i : -1;
+    workers[i].snapshot_path = snapshot_path;
+  }
+  for(int i = 0; i < num_threads - 1; i++) {
+    int error = pthread_create(&workers[i].thread, NULL, run_worker,
+                               &workers[i]);
+    if(error) {
+      fprintf(stderr, "couldn't start http thread %d: %s\n", i,
+              strerror(error));
+      exit(1);
+    }
+  }
+
+  run_worker(&workers[num_threads - 1]);
   /*Point of no return, hopefully*/
 }
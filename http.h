@@ -4,6 +4,12 @@
 #include "cobb2.h"
 #include "server.h"
 
-void init_and_run(server_t* server, int port);
+#define DEFAULT_HTTP_THREADS 4
+
+void init_and_run(server_t* server,
+                  int port,
+                  int num_threads,
+                  int pin,
+                  const char* snapshot_path);
 
 #endif
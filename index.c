@@ -0,0 +1,182 @@
+#include <string.h>
+#include "cmalloc.h"
+#include "cobb2.h"
+#include "epoch.h"
+#include "index.h"
+
+/* Open addressing with linear probing. Each slot keeps the hash of its
+ * phrase's normalized string next to the pointer, so that probing past
+ * other phrases doesn't have to touch their global strings. Phrases which
+ * normalize the same (differing only in case or accents) hash the same,
+ * and so all lie along one probe sequence.
+ *
+ * Slots are never reused while readers can see the table: a removed
+ * phrase leaves a marker behind, and an added one always takes an empty
+ * slot, so a slot's hash never changes under a reader. Once empty slots
+ * run low the live phrases are copied into a new table, which replaces the
+ * old one, and the old one is retired.
+ */
+
+/* Left in the slot of a removed phrase, so probes carry on past it */
+#define INDEX_REMOVED ((global_data*)1)
+
+typedef struct index_slot {
+  uint64_t hash;
+  global_data* global; /*NULL if never used*/
+} index_slot;
+
+typedef struct index_table {
+  uint64_t mask; /*number of slots - 1, a power of 2*/
+  index_slot slots[];
+} index_table;
+
+struct index_t {
+  index_table* table;
+  uint64_t live; /*slots holding a phrase*/
+  uint64_t used; /*slots holding a phrase or a removed marker*/
+};
+
+/* FNV-1a, like the log's checksum */
+static uint64_t index_hash(char* normalized, unsigned int len) {
+  uint64_t hash = 14695981039346656037ull;
+  for(unsigned int i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char)normalized[i])*1099511628211ull;
+  return hash;
+}
+
+/* A table with room for count phrases at under half full */
+static index_table* table_alloc(uint64_t count) {
+  uint64_t num_slots = INDEX_MIN_SLOTS;
+  while(num_slots < 2*count + 2)
+    num_slots *= 2;
+
+  index_table* table = cmalloc(sizeof(index_table) +
+                               num_slots*sizeof(index_slot));
+  if(table == NULL)
+    return NULL;
+  table->mask = num_slots - 1;
+  memset(table->slots, 0, num_slots*sizeof(index_slot));
+  return table;
+}
+
+/* Put a phrase in the first empty slot along its probe sequence */
+static void table_insert(index_table* table,
+                         uint64_t hash,
+                         global_data* global) {
+  uint64_t i = hash & table->mask;
+  while(table->slots[i].global != NULL)
+    i = (i + 1) & table->mask;
+  table->slots[i].hash = hash;
+  PUBLISH(table->slots[i].global, global);
+}
+
+index_t* index_init() {
+  index_t* index = cmalloc(sizeof(index_t));
+  if(index == NULL)
+    return NULL;
+  index->table = table_alloc(0);
+  if(index->table == NULL) {
+    cfree(index);
+    return NULL;
+  }
+  index->live = index->used = 0;
+  return index;
+}
+
+/* Free an index, which nothing may still be reading */
+void index_clean(index_t* index) {
+  if(index == NULL)
+    return;
+  cfree(index->table);
+  cfree(index);
+}
+
+/* Look up a normalized string. With exact set only the phrase with the
+ * same full string is returned, otherwise that one if there is one, or
+ * else any phrase which normalizes the same. Returns NULL if nothing
+ * matches. Readers must be between epoch_enter and epoch_exit.
+ */
+global_data* index_find(index_t* index, string_data* string, int exact) {
+  index_table* table = READ_SHARED(index->table);
+  uint64_t hash = index_hash(string->normalized, string->length);
+  global_data* found = NULL;
+
+  for(uint64_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+    index_slot* slot = &table->slots[i];
+    global_data* global = READ_SHARED(slot->global);
+    if(global == NULL)
+      return found;
+    if(global == INDEX_REMOVED || slot->hash != hash ||
+       global->normalized_len != string->length ||
+       memcmp(GLOBAL_NORMALIZED(global), string->normalized,
+              string->length)) {
+      continue;
+    }
+
+    if(global->len == string->full_length &&
+       !memcmp(GLOBAL_STR(global), string->full, string->full_length)) {
+      return global;
+    }
+    if(!exact && found == NULL)
+      found = global;
+  }
+}
+
+/* Add a phrase which isn't in the index yet, moving to a bigger table
+ * first if the current one is getting full.
+ */
+op_result index_add(index_t* index, global_data* global) {
+  index_table* table = index->table;
+
+  if(2*(index->used + 1) > table->mask + 1) {
+    /*removed markers are dropped, so this may not really grow*/
+    index_table* grown = table_alloc(2*(index->live + 1));
+    if(grown == NULL)
+      return MALLOC_FAIL;
+    for(uint64_t i = 0; i <= table->mask; i++) {
+      global_data* moved = table->slots[i].global;
+      if(moved != NULL && moved != INDEX_REMOVED)
+        table_insert(grown, table->slots[i].hash, moved);
+    }
+    PUBLISH(index->table, grown);
+    epoch_retire(table);
+    table = grown;
+    index->used = index->live;
+  }
+
+  table_insert(table,
+               index_hash(GLOBAL_NORMALIZED(global), global->normalized_len),
+               global);
+  index->live++;
+  index->used++;
+  return NO_ERROR;
+}
+
+/* Remove a phrase, which must be in the index */
+void index_remove(index_t* index, global_data* global) {
+  index_table* table = index->table;
+  uint64_t hash = index_hash(GLOBAL_NORMALIZED(global),
+                             global->normalized_len);
+
+  for(uint64_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+    if(table->slots[i].global == global) {
+      PUBLISH(table->slots[i].global, INDEX_REMOVED);
+      index->live--;
+      return;
+    }
+    if(table->slots[i].global == NULL)
+      return;
+  }
+}
+
+/* Empty the index, sized to have expected phrases added without growing */
+op_result index_reset(index_t* index, uint64_t expected) {
+  index_table* table = table_alloc(expected);
+  if(table == NULL)
+    return MALLOC_FAIL;
+  index_table* old = index->table;
+  PUBLISH(index->table, table);
+  epoch_retire(old);
+  index->live = index->used = 0;
+  return NO_ERROR;
+}
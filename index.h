@@ -0,0 +1,29 @@
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include <stdint.h>
+#include "cobb2.h"
+#include "parse.h"
+
+/* Hash table of every phrase a server holds, by its normalized string, so
+ * that writers know up front whether an upsert is an insert or an update
+ * (and from what score), and phrases can be looked up directly. Changed by
+ * one writer at a time, while readers look phrases up without locking
+ * between epoch_enter and epoch_exit.
+ */
+
+/* Smallest number of slots an index has */
+#define INDEX_MIN_SLOTS 1024
+
+typedef struct index_t index_t;
+
+index_t* index_init();
+void index_clean(index_t* index);
+
+global_data* index_find(index_t* index, string_data* string, int exact);
+
+op_result index_add(index_t* index, global_data* global);
+void index_remove(index_t* index, global_data* global);
+op_result index_reset(index_t* index, uint64_t expected);
+
+#endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <sys/time.h>
@@ -12,11 +13,17 @@
 #include "cobb2.h"
 #include "dline.h"
 #include "http.h"
+#include "index.h"
 #include "parse.h"
+#include "phrase.h"
 #include "server.h"
 #include "trie.h"
 
-void file_trie_query(char* fname);
+void file_trie_query(char* fname,
+                     char* log,
+                     int num_threads,
+                     int pin,
+                     char* snapshot_path);
 void basic_test();
 void parser_test();
 
@@ -35,11 +42,23 @@ static void get_time(struct timespec* ts) {
   #endif
 }
 
+/* usage: cobb2 [file or snapshot to load] [http threads]
+ *              [pin threads to cpus (0/1)] [change log]
+ *              [path /admin/snapshot writes to]
+ */
 int main(int argc, char** argv) {
-  if(argc >= 2)
-    file_trie_query(argv[1]);
-  else
-    file_trie_query(NULL);
+  int num_threads = argc >= 3 ? atoi(argv[2]) : DEFAULT_HTTP_THREADS;
+  int pin = argc >= 4 ? atoi(argv[3]) : 0;
+  if(num_threads <= 0) {
+    fprintf(stderr, "need at least one http thread\n");
+    return 1;
+  }
+
+  file_trie_query(argc >= 2 ? argv[1] : NULL,
+                  argc >= 5 ? argv[4] : NULL,
+                  num_threads,
+                  pin,
+                  argc >= 6 ? argv[5] : NULL);
   //basic_test();
   //parser_test();
 }
@@ -85,14 +104,14 @@ void basic_test() {
   remove_state rstate = {NULL};
   assert(!dline_remove(line2, &line1, &stringdata2, 6, &rstate));
   assert(rstate.global_ptr == state2.global_ptr);
-  cfree(rstate.global_ptr);
+  phrase_release(rstate.global_ptr->id);
   cfree(line2);
   dline_debug(line1);
   
   rstate.global_ptr = NULL;
   assert(!dline_remove(line1, &line2, &stringdata1, 2, &rstate));
   assert(rstate.global_ptr == state1.global_ptr);
-  cfree(rstate.global_ptr);
+  phrase_release(rstate.global_ptr->id);
   cfree(line1);
   dline_debug(line2);
   
@@ -106,7 +125,7 @@ void basic_test() {
   assert(rstate.global_ptr == state3.global_ptr);
   cfree(line1);
   dline_debug(line2);
-  cfree(rstate.global_ptr);
+  phrase_release(rstate.global_ptr->id);
 }
 
 void input_parse_state(parser_data* data) {
@@ -121,31 +140,67 @@ void input_parse_state(parser_data* data) {
   fgets(min, 500, stdin);
   min[strlen(min)-1] = '\0'; /*damn newline*/
 
-  parser_data_init(data, sin, min);
+  if(parser_data_init(data, sin, min) != NO_ERROR) {
+    fprintf(stderr, "start and middle chars must be UTF-8, with at most %d "
+            "non-ASCII ones each\n", PARSER_MAX_WIDE);
+    exit(1);
+  }
 }
 
 void init_server(server_t* server) {
   input_parse_state(&server->parser);
   /* Magic numbers everywhere */
   server->trie = trie_presplit(32, 127, 2);
+  server->index = index_init();
+  pthread_mutex_init(&server->write_lock, NULL);
+  server->wal = NULL;
+  server->version = 0;
 }
 
-void file_trie_query(char* fname) {
+void file_trie_query(char* fname,
+                     char* log,
+                     int num_threads,
+                     int pin,
+                     char* snapshot_path) {
   server_t server;
 
   init_server(&server);  
 
-  if(fname != NULL) {
+  /*a snapshot is mapped in as is, anything else is read as phrases*/
+  if(fname != NULL && server_snapshot_load(&server, fname) == NO_ERROR) {
+    printf("mapped snapshot %s\n", fname);
+    trie_print_stats();
+  } else if(fname != NULL) {
     FILE* fp = fopen(fname, "r");
     char iline[500]; /*please say this is enough*/
     struct timespec ts_before;
     struct timespec ts_after;
     int read = 0;
 
+    int capacity = 1024;
+    char** lines = cmalloc(capacity*sizeof(char*));
+    unsigned int* scores = cmalloc(capacity*sizeof(unsigned int));
+    assert(lines != NULL && scores != NULL);
+
     get_time(&ts_before);
     while(fgets(iline, 5001, fp)) {
       iline[strlen(iline)-1] = '\0'; /*damn newline*/
-      server_upsert(&server, iline, strlen(iline));
+      if(read == capacity) {
+        capacity *= 2;
+        char** new_lines = cmalloc(capacity*sizeof(char*));
+        unsigned int* new_scores = cmalloc(capacity*sizeof(unsigned int));
+        assert(new_lines != NULL && new_scores != NULL);
+        memcpy(new_lines, lines, read*sizeof(char*));
+        memcpy(new_scores, scores, read*sizeof(unsigned int));
+        cfree(lines);
+        cfree(scores);
+        lines = new_lines;
+        scores = new_scores;
+      }
+      lines[read] = cmalloc(strlen(iline) + 1);
+      assert(lines[read] != NULL);
+      strcpy(lines[read], iline);
+      scores[read] = strlen(iline);
       
       if(read % 10000 == 0) {
         printf("finished %d\n", read);
@@ -154,12 +209,33 @@ void file_trie_query(char* fname) {
     }
 
     fclose(fp);
+    /* Build the whole thing in one go rather than upserting every line,
+     * packed since the base index is mostly read rather than written
+     */
+    op_result loaded = server_bulk_load(&server, lines, scores, read, 1);
+    if(loaded != NO_ERROR) {
+      fprintf(stderr, "couldn't load %s (error %d)\n", fname, loaded);
+      exit(1);
+    }
+    for(int i = 0; i < read; i++)
+      cfree(lines[i]);
+    cfree(lines);
+    cfree(scores);
     get_time(&ts_after);
     int seconds = ts_after.tv_sec-ts_before.tv_sec;
     printf("read %d lines in %ds\n", read, seconds);
     trie_print_stats();
     cmalloc_stats();
   }
+
+  /*changes since the base was made are replayed on top of it*/
+  if(log != NULL) {
+    if(server_open_log(&server, log) != NO_ERROR) {
+      fprintf(stderr, "couldn't replay change log %s\n", log);
+      exit(1);
+    }
+    printf("replayed change log %s\n", log);
+  }
 #if 0
   char iline[500]; /*please say this is enough*/
   result_entry results[25];
@@ -172,7 +248,8 @@ void file_trie_query(char* fname) {
     string_data string;
 
     assert(!normalize(iline, &string));
-    int num = server_search(&server, &string, results, 25);
+    int num = server_search(&server, &string, results, 25, NULL, NULL,
+                            NULL);
     get_time(&ts_after);
     for(int i = 0; i < num; i++) {
       printf("%d %p %s\n", results[i].score, (void*)(results[i].global_ptr),
@@ -187,6 +264,6 @@ void file_trie_query(char* fname) {
     
   }
 #endif
-  init_and_run(&server, 5402);
+  init_and_run(&server, 5402, num_threads, pin, snapshot_path);
 
 }
@@ -1,59 +1,392 @@
-#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include "cmalloc.h"
 #include "cobb2.h"
 #include "parse.h"
 
 /* Functions to process input strings for update/search on a trie.
- * Currently ASCII only, with Unicode to be added later (likely via ICU)
+ * Normalizing lowercases ASCII a word at a time, and folds the case and
+ * diacritics of Latin, Greek and Cyrillic letters in UTF-8 by table. Any
+ * other bytes (including invalid UTF-8) are passed through as they are.
+ * A character never normalizes to more bytes than it had, so the
+ * normalized string always fits in strlen(in)+1 bytes.
  */
 
-/* Returns a normalized copy of a given string. Currently, this just converts
- * the entire string to lowercase. len does not include a null terminator.
- * TODO: leading/trailing whitespace removal, middle whitespace normalization/
- * reduction?. Also, Unicode :(
+#define ASCII_HIGH_BITS 0x8080808080808080ULL
+
+/* What each of U+00C0 to U+017F folds to, "" for those left alone */
+#define LATIN_FOLD_FIRST 0xC0
+#define LATIN_FOLD_LAST 0x17F
+
+static const char latin_fold[][3] = {
+  "a", "a", "a", "a", "a", "a", "ae", "c", /*U+00C0*/
+  "e", "e", "e", "e", "i", "i", "i", "i", /*U+00C8*/
+  "d", "n", "o", "o", "o", "o", "o", "", /*U+00D0*/
+  "o", "u", "u", "u", "u", "y", "th", "ss", /*U+00D8*/
+  "a", "a", "a", "a", "a", "a", "ae", "c", /*U+00E0*/
+  "e", "e", "e", "e", "i", "i", "i", "i", /*U+00E8*/
+  "d", "n", "o", "o", "o", "o", "o", "", /*U+00F0*/
+  "o", "u", "u", "u", "u", "y", "th", "y", /*U+00F8*/
+  "a", "a", "a", "a", "a", "a", "c", "c", /*U+0100*/
+  "c", "c", "c", "c", "c", "c", "d", "d", /*U+0108*/
+  "d", "d", "e", "e", "e", "e", "e", "e", /*U+0110*/
+  "e", "e", "e", "e", "g", "g", "g", "g", /*U+0118*/
+  "g", "g", "g", "g", "h", "h", "h", "h", /*U+0120*/
+  "i", "i", "i", "i", "i", "i", "i", "i", /*U+0128*/
+  "i", "i", "ij", "ij", "j", "j", "k", "k", /*U+0130*/
+  "k", "l", "l", "l", "l", "l", "l", "l", /*U+0138*/
+  "l", "l", "l", "n", "n", "n", "n", "n", /*U+0140*/
+  "n", "n", "n", "n", "o", "o", "o", "o", /*U+0148*/
+  "o", "o", "oe", "oe", "r", "r", "r", "r", /*U+0150*/
+  "r", "r", "s", "s", "s", "s", "s", "s", /*U+0158*/
+  "s", "s", "t", "t", "t", "t", "t", "t", /*U+0160*/
+  "u", "u", "u", "u", "u", "u", "u", "u", /*U+0168*/
+  "u", "u", "u", "u", "w", "w", "y", "y", /*U+0170*/
+  "y", "z", "z", "z", "z", "z", "z", "s", /*U+0178*/
+};
+
+/* Runs of code points first..last which fold to target onwards */
+typedef struct fold_range {
+  uint32_t first;
+  uint32_t last;
+  uint32_t target;
+} fold_range;
+
+static const fold_range fold_ranges[] = {
+  {0x0386, 0x0386, 0x03B1}, /*Greek, dropping tonos and dialytika*/
+  {0x0388, 0x0388, 0x03B5},
+  {0x0389, 0x0389, 0x03B7},
+  {0x038A, 0x038A, 0x03B9},
+  {0x038C, 0x038C, 0x03BF},
+  {0x038E, 0x038E, 0x03C5},
+  {0x038F, 0x038F, 0x03C9},
+  {0x0390, 0x0390, 0x03B9},
+  {0x0391, 0x03A1, 0x03B1},
+  {0x03A3, 0x03A9, 0x03C3},
+  {0x03AA, 0x03AA, 0x03B9},
+  {0x03AB, 0x03AB, 0x03C5},
+  {0x03AC, 0x03AC, 0x03B1},
+  {0x03AD, 0x03AD, 0x03B5},
+  {0x03AE, 0x03AE, 0x03B7},
+  {0x03AF, 0x03AF, 0x03B9},
+  {0x03B0, 0x03B0, 0x03C5},
+  {0x03C2, 0x03C2, 0x03C3}, /*final sigma*/
+  {0x03CA, 0x03CA, 0x03B9},
+  {0x03CB, 0x03CB, 0x03C5},
+  {0x03CC, 0x03CC, 0x03BF},
+  {0x03CD, 0x03CD, 0x03C5},
+  {0x03CE, 0x03CE, 0x03C9},
+  {0x0400, 0x0400, 0x0435}, /*Cyrillic, with e grave and yo as ie*/
+  {0x0401, 0x0401, 0x0435},
+  {0x0402, 0x040F, 0x0452},
+  {0x0410, 0x042F, 0x0430},
+  {0x0450, 0x0450, 0x0435},
+  {0x0451, 0x0451, 0x0435}
+};
+
+#define NUM_FOLD_RANGES ((int)(sizeof(fold_ranges)/sizeof(fold_range)))
+
+/* Lowercase 8 ASCII bytes at once. No byte has its high bit set, so adding
+ * to each can't carry into the next: the high bit of each byte ends up set
+ * in at_least_a for bytes >= 'A', and in above_z for bytes > 'Z'.
+ */
+static inline uint64_t ascii_lower(uint64_t word) {
+  uint64_t at_least_a = word + 0x3f3f3f3f3f3f3f3fULL;
+  uint64_t above_z = word + 0x2525252525252525ULL;
+  uint64_t upper = at_least_a & ~above_z & ASCII_HIGH_BITS;
+  return word | (upper >> 2);
+}
+
+/* What a two byte code point folds to, itself if nothing */
+static uint32_t fold_code_point(uint32_t code) {
+  int low = 0, high = NUM_FOLD_RANGES - 1;
+  while(low <= high) {
+    int mid = (low + high)/2;
+    if(code < fold_ranges[mid].first) {
+      high = mid - 1;
+    } else if(code > fold_ranges[mid].last) {
+      low = mid + 1;
+    } else {
+      return fold_ranges[mid].target + (code - fold_ranges[mid].first);
+    }
+  }
+  return code;
+}
+
+/* Normalize the character starting at in (with len bytes left) into out,
+ * setting *used to the bytes of in it took up. Returns the bytes written.
+ */
+static inline unsigned int fold_char(const unsigned char* in,
+                                     unsigned int len,
+                                     char* out,
+                                     unsigned int* used) {
+  if(in[0] < 0x80) {
+    *used = 1;
+    out[0] = in[0] >= 'A' && in[0] <= 'Z' ? in[0] + ('a' - 'A') : in[0];
+    return 1;
+  }
+
+  /*only two byte sequences fold, anything else is copied a byte at a time*/
+  if(in[0] < 0xC2 || in[0] > 0xDF || len < 2 || (in[1] & 0xC0) != 0x80) {
+    *used = 1;
+    out[0] = in[0];
+    return 1;
+  }
+
+  *used = 2;
+  uint32_t code = ((uint32_t)(in[0] & 0x1F) << 6) | (in[1] & 0x3F);
+  if(code >= LATIN_FOLD_FIRST && code <= LATIN_FOLD_LAST &&
+     latin_fold[code - LATIN_FOLD_FIRST][0] != '\0') {
+    const char* folded = latin_fold[code - LATIN_FOLD_FIRST];
+    out[0] = folded[0];
+    if(folded[1] == '\0')
+      return 1;
+    out[1] = folded[1];
+    return 2;
+  }
+
+  /*all the ranges fold to other two byte code points*/
+  code = fold_code_point(code);
+  out[0] = (char)(0xC0 | (code >> 6));
+  out[1] = (char)(0x80 | (code & 0x3F));
+  return 2;
+}
+
+/* Normalize len bytes of in into out, returning the normalized length */
+static unsigned int fold(const char* in, unsigned int len, char* out) {
+  unsigned int i = 0, o = 0;
+
+  while(i < len) {
+    if(i + sizeof(uint64_t) <= len) {
+      uint64_t word;
+      memcpy(&word, in + i, sizeof(uint64_t));
+      if(!(word & ASCII_HIGH_BITS)) {
+        word = ascii_lower(word);
+        memcpy(out + o, &word, sizeof(uint64_t));
+        i += sizeof(uint64_t);
+        o += sizeof(uint64_t);
+        continue;
+      }
+    }
+    unsigned int used;
+    o += fold_char((const unsigned char*)in + i, len - i, out + o, &used);
+    i += used;
+  }
+  return o;
+}
+
+/* Normalize a string into buffer, which must have at least strlen(in)+1
+ * bytes (BAD_PARAM if capacity is less). The normalized string is null
+ * terminated, but only to make debugging easier. Nothing otherwise
+ * actually requires it, all operations are length-based.
+ * TODO: leading/trailing whitespace removal, middle whitespace
+ * normalization/reduction?
  */
+op_result normalize_buffer(char* in,
+                           string_data* data,
+                           char* buffer,
+                           unsigned int capacity) {
+  if(in == NULL || data == NULL || buffer == NULL)
+    return BAD_PARAM;
+
+  unsigned int len = strlen(in);
+  if(capacity < len + 1)
+    return BAD_PARAM;
+
+  data->full = in;
+  data->full_length = len;
+  data->normalized = buffer;
+  data->length = fold(in, len, buffer);
+  buffer[data->length] = '\0';
+  return NO_ERROR;
+}
+
+/* Returns a normalized copy of a given string, to be freed by the caller */
 op_result normalize(char* in, string_data* data) {
   if(in == NULL || data == NULL)
         return BAD_PARAM;
 
-  int len = strlen(in);
+  unsigned int capacity = strlen(in) + 1;
+  char* buffer = cmalloc(capacity);
+  if(buffer == NULL)
+    return MALLOC_FAIL;
+  return normalize_buffer(in, data, buffer, capacity);
+}
 
-  data->full = in;
-  data->length = len;
+/* Like normalize, but writes the normalized string into *buffer, growing
+ * it (to be freed by the caller) if it has less than len+1 bytes. Lets
+ * many strings be normalized in a row without a malloc for each.
+ */
+op_result normalize_into(char* in,
+                         string_data* data,
+                         char** buffer,
+                         unsigned int* capacity) {
+  if(in == NULL || data == NULL || buffer == NULL || capacity == NULL)
+    return BAD_PARAM;
 
-  /* We will add a null terminator, but only to make debugging easier. Nothing
-   * otherwise actually requires it, all operations are length-based.
-   */
-  data->normalized = cmalloc(len+1);
-  if(data->normalized == NULL)
+  unsigned int len = strlen(in);
+  if(*buffer == NULL || *capacity < len + 1) {
+    char* grown = cmalloc(len + 1);
+    if(grown == NULL)
+      return MALLOC_FAIL;
+    cfree(*buffer);
+    *buffer = grown;
+    *capacity = len + 1;
+  }
+  return normalize_buffer(in, data, *buffer, *capacity);
+}
+
+/* Like normalize, but with the normalized string allocated from scratch,
+ * so it needs no freeing and lasts until the arena is reset
+ */
+op_result normalize_arena(char* in, string_data* data, arena* scratch) {
+  if(in == NULL || data == NULL || scratch == NULL)
+    return BAD_PARAM;
+
+  unsigned int capacity = strlen(in) + 1;
+  char* buffer = arena_alloc(scratch, capacity);
+  if(buffer == NULL)
     return MALLOC_FAIL;
-  for(int i = 0; i < len; i++) {
-    data->normalized[i] = (char)tolower(in[i]);
+  return normalize_buffer(in, data, buffer, capacity);
+}
+
+/* Map the bytes start to end of the normalized form of full (which has len
+ * bytes) back to full, widening them to whole characters there. Used to
+ * report where a match in the normalized string is in the full one.
+ */
+void full_span(char* full,
+               unsigned int len,
+               unsigned int start,
+               unsigned int end,
+               unsigned int* full_start,
+               unsigned int* full_end) {
+  unsigned int i = 0, o = 0;
+  char folded[2];
+
+  *full_start = len;
+  while(i < len && o < end) {
+    unsigned int used;
+    unsigned int written = fold_char((const unsigned char*)full + i, len - i,
+                                     folded, &used);
+    if(o + written > start && *full_start == len)
+      *full_start = i;
+    o += written;
+    i += used;
   }
-  data->normalized[len] = '\0';
-  return NO_ERROR;
+  if(*full_start == len)
+    *full_start = i;
+  *full_end = i;
+}
+
+/* Decode the UTF-8 sequence starting at in (with len bytes left) into
+ * *code, returning its length, or 0 (leaving *code as it was) if it isn't
+ * a valid sequence.
+ */
+static unsigned int decode_char(const unsigned char* in,
+                                unsigned int len,
+                                uint32_t* code) {
+  static const uint32_t smallest[] = {0, 0, 0x80, 0x800, 0x10000};
+  unsigned int bytes;
+  uint32_t decoded;
+
+  if(in[0] < 0x80) {
+    *code = in[0];
+    return 1;
+  } else if(in[0] >= 0xC2 && in[0] <= 0xDF) {
+    bytes = 2;
+    decoded = in[0] & 0x1F;
+  } else if(in[0] >= 0xE0 && in[0] <= 0xEF) {
+    bytes = 3;
+    decoded = in[0] & 0x0F;
+  } else if(in[0] >= 0xF0 && in[0] <= 0xF4) {
+    bytes = 4;
+    decoded = in[0] & 0x07;
+  } else {
+    return 0;
+  }
+
+  if(len < bytes)
+    return 0;
+  for(unsigned int i = 1; i < bytes; i++) {
+    if((in[i] & 0xC0) != 0x80)
+      return 0;
+    decoded = (decoded << 6) | (in[i] & 0x3F);
+  }
+  /*no overlong forms, surrogates or code points past U+10FFFF*/
+  if(decoded < smallest[bytes] || decoded > 0x10FFFF ||
+     (decoded >= 0xD800 && decoded <= 0xDFFF))
+    return 0;
+  *code = decoded;
+  return bytes;
+}
+
+static int code_point_cmp(const void* a, const void* b) {
+  uint32_t c1 = *(const uint32_t*)a, c2 = *(const uint32_t*)b;
+  return c1 < c2 ? -1 : c1 > c2;
 }
 
-/* Pre-set up bit maps for a null-terminated string of characters, as to avoid
- * recalculating every time next_start is called
+/* Pre-set up a bit map for the ASCII characters in a null-terminated
+ * string of characters, and a sorted set of the code points of the rest,
+ * as to avoid recalculating every time next_start is called. Characters
+ * are matched against normalized strings, so they are normalized first.
+ * Returns BAD_PARAM if chars isn't valid UTF-8 or has more than
+ * PARSER_MAX_WIDE distinct non-ASCII characters.
  */
-static void bit_map_init(unsigned char* map,
-                         char* chars) {
-  char* current = chars;
+static op_result char_set_init(unsigned char* map,
+                               uint32_t* wide,
+                               int* num_wide,
+                               char* chars) {
   memset(map, 0, MAP_SIZE);
-  while(*current != '\0') {
-    map[*current>>3] |= (char)(1 << (*current & 7));
-    current++;
+  *num_wide = 0;
+
+  unsigned int len = strlen(chars);
+  unsigned char* folded = cmalloc(len + 1);
+  if(folded == NULL)
+    return MALLOC_FAIL;
+  len = fold(chars, len, (char*)folded);
+
+  op_result result = NO_ERROR;
+  unsigned int i = 0;
+  while(i < len && result == NO_ERROR) {
+    uint32_t code;
+    unsigned int used = decode_char(folded + i, len - i, &code);
+    if(used == 0) {
+      result = BAD_PARAM;
+    } else if(code < 0x80) {
+      map[code>>3] |= (unsigned char)(1 << (code & 7));
+    } else {
+      int j = 0;
+      while(j < *num_wide && wide[j] != code)
+        j++;
+      if(j == PARSER_MAX_WIDE)
+        result = BAD_PARAM;
+      else if(j == *num_wide)
+        wide[(*num_wide)++] = code;
+    }
+    i += used;
   }
+
+  cfree(folded);
+  qsort(wide, *num_wide, sizeof(uint32_t), code_point_cmp);
+  return result;
 }
 
-/* Sets up bitmaps for start/middle characters*/
-void parser_data_init(parser_data* data,
-                      char* start,
-                      char* middle) {
-  bit_map_init(data->start_map, start);
-  bit_map_init(data->middle_map, middle);
+/* Sets up bitmaps and code point sets for start/middle characters, which
+ * may be any UTF-8 characters. Returns BAD_PARAM as char_set_init does.
+ */
+op_result parser_data_init(parser_data* data,
+                           char* start,
+                           char* middle) {
+  if(data == NULL || start == NULL || middle == NULL)
+    return BAD_PARAM;
+
+  op_result result = char_set_init(data->start_map, data->start_wide,
+                                   &data->num_start_wide, start);
+  if(result != NO_ERROR)
+    return result;
+  return char_set_init(data->middle_map, data->middle_wide,
+                       &data->num_middle_wide, middle);
 }
 
 /* Helper to do the bitwise check if a given map has a given character */
@@ -61,6 +394,15 @@ static inline int in_map(unsigned char* map, char c) {
   return map[((unsigned char)c) >> 3] & (1 << (c & 7));
 }
 
+/* Whether a sorted set of num code points has the given one */
+static inline int in_wide(uint32_t* wide, int num, uint32_t code) {
+  for(int i = 0; i < num && wide[i] <= code; i++) {
+    if(wide[i] == code)
+      return 1;
+  }
+  return 0;
+}
+
 /* Iterates though the string to find the next start of a suffix in a string.
  * Its like strtok/strsep, except hopefully less shitty. (no modifying the input)
  * start_map is a bit map of characters for which seeing indicates the start of a
@@ -71,6 +413,9 @@ static inline int in_map(unsigned char* map, char c) {
  * If there are no more suffixes left in the string, next_start returns -1
  * 0 Is always the start of a new suffix, unless it starts with a middle
  * character, in which case the first suffix is the first non middle character
+ * Suffixes only start on the first byte of a UTF-8 character, the bytes
+ * continuing one being skipped over. A non-ASCII character is only decoded
+ * if the parser has any non-ASCII start or middle characters.
  */
 int next_start(string_data* string,
                parser_data* parser,
@@ -83,12 +428,29 @@ int next_start(string_data* string,
    */
   int prev_middle = token_start == 0 ? 1 : 0;
 
+  int any_wide = parser->num_start_wide + parser->num_middle_wide > 0;
+
   for(int c = token_start; c < string->length; c++) {
-    int is_middle = in_map(parser->middle_map, string->normalized[c]);
-    if((prev_middle && !is_middle) ||
-        in_map(parser->start_map, string->normalized[c])) {
-      return c;
+    unsigned char byte = (unsigned char)string->normalized[c];
+    if((byte & 0xC0) == 0x80)
+      continue;
+
+    int is_middle, is_start;
+    if(byte < 0x80) {
+      is_middle = in_map(parser->middle_map, byte);
+      is_start = in_map(parser->start_map, byte);
+    } else {
+      /*invalid UTF-8 leaves code 0, which is never in a set*/
+      uint32_t code = 0;
+      if(any_wide)
+        decode_char((unsigned char*)string->normalized + c,
+                    string->length - c, &code);
+      is_middle = in_wide(parser->middle_wide, parser->num_middle_wide, code);
+      is_start = in_wide(parser->start_wide, parser->num_start_wide, code);
     }
+
+    if((prev_middle && !is_middle) || is_start)
+      return c;
     prev_middle = is_middle;
   }
   /* Reached the end of the string, no more suffixes*/
@@ -1,27 +1,55 @@
 #ifndef _PARSE_H_
 #define _PARSE_H_
 
+#include "cmalloc.h"
 #include "cobb2.h"
 
 #define MAP_SIZE 32
 
+/* Most non-ASCII start (or middle) characters a parser can have */
+#define PARSER_MAX_WIDE 16
+
+/* ASCII start/middle characters are kept in bit maps, any others as sorted
+ * code points
+ */
 typedef struct parser_data {
   unsigned char start_map[MAP_SIZE];
   unsigned char middle_map[MAP_SIZE];
+  uint32_t start_wide[PARSER_MAX_WIDE];
+  uint32_t middle_wide[PARSER_MAX_WIDE];
+  int num_start_wide;
+  int num_middle_wide;
 } parser_data;
 
-/* For now, the full string must have the same byte length when normalized*/
+/* The normalized string may be shorter than the full one, but never longer */
 typedef struct string_data {
   char* full; /*full string to upsert*/
   char* normalized; /*normalized string to be indexed*/
-  unsigned int length; /*NOT including a trailing \0*/
+  unsigned int length; /*of normalized, NOT including a trailing \0*/
+  unsigned int full_length; /*likewise of full*/
 } string_data;
 
+op_result normalize_buffer(char* in,
+                           string_data* data,
+                           char* buffer,
+                           unsigned int capacity);
 op_result normalize(char* in, string_data* data);
-
-void parser_data_init(parser_data* data,
-                      char* start,
-                      char* middle);
+op_result normalize_into(char* in,
+                         string_data* data,
+                         char** buffer,
+                         unsigned int* capacity);
+op_result normalize_arena(char* in, string_data* data, arena* scratch);
+
+void full_span(char* full,
+               unsigned int len,
+               unsigned int start,
+               unsigned int end,
+               unsigned int* full_start,
+               unsigned int* full_end);
+
+op_result parser_data_init(parser_data* data,
+                           char* start,
+                           char* middle);
 
 int next_start(string_data* string,
                parser_data* parser,
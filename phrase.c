@@ -0,0 +1,183 @@
+#include <pthread.h>
+#include <string.h>
+#include "cmalloc.h"
+#include "cobb2.h"
+#include "epoch.h"
+#include "phrase.h"
+#include "snapshot.h"
+
+/* The phrase table. Only writers add and release ids, serialized by
+ * table_lock, while readers look ids up with phrase_get without locking.
+ * A slot is always filled in before any dline holding its id is published,
+ * so a reader which got the id from a dline sees it. Released ids wait in
+ * a queue, tagged with the epoch they were released in, until no reader
+ * can still have a dline holding them.
+ */
+
+global_data** phrase_chunks[PHRASE_MAX_CHUNKS];
+
+typedef struct released_id {
+  phrase_id id;
+  uint64_t epoch;
+} released_id;
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t next_id = NO_PHRASE + 1; /*never yet handed out*/
+static released_id* released = NULL;
+static int released_start = 0; /*first still waiting*/
+static int num_released = 0; /*one past the last*/
+static int released_capacity = 0;
+
+static inline global_data** phrase_slot(phrase_id id) {
+  return &phrase_chunks[id >> PHRASE_CHUNK_BITS][id & (PHRASE_CHUNK_SIZE-1)];
+}
+
+/* Make sure the chunk holding an id exists, returning 0 if it can't */
+static int chunk_for(uint64_t id) {
+  if(phrase_chunks[id >> PHRASE_CHUNK_BITS] != NULL)
+    return 1;
+  global_data** chunk = ccalloc(PHRASE_CHUNK_SIZE, sizeof(global_data*));
+  if(chunk == NULL)
+    return 0;
+  PUBLISH(phrase_chunks[id >> PHRASE_CHUNK_BITS], chunk);
+  return 1;
+}
+
+/* An id no reader can be holding, or NO_PHRASE if the table is full */
+static phrase_id take_id() {
+  if(released_start < num_released &&
+     released[released_start].epoch < epoch_safe()) {
+    return released[released_start++].id;
+  }
+
+  if(next_id > UINT32_MAX || !chunk_for(next_id))
+    return NO_PHRASE;
+  return (phrase_id)next_id++;
+}
+
+/* Queue an id to be handed out again once readers are past epoch */
+static void queue_released(phrase_id id, uint64_t epoch) {
+  if(released_start > 0 && num_released == released_capacity) {
+    /*reuse the space of ids already handed out again*/
+    memmove(released, &released[released_start],
+            (num_released - released_start)*sizeof(released_id));
+    num_released -= released_start;
+    released_start = 0;
+  }
+  if(num_released == released_capacity) {
+    int capacity = released_capacity == 0 ? 1024 : 2*released_capacity;
+    released_id* grown = cmalloc(capacity*sizeof(released_id));
+    if(grown == NULL)
+      return; /*the id is just never used again*/
+    if(released != NULL) {
+      memcpy(grown, released, num_released*sizeof(released_id));
+      cfree(released);
+    }
+    released = grown;
+    released_capacity = capacity;
+  }
+  released[num_released].id = id;
+  released[num_released].epoch = epoch;
+  num_released++;
+}
+
+/* Give a global string an id, storing it in global->id. Returns NO_PHRASE
+ * if the table can't be grown.
+ */
+phrase_id phrase_add(global_data* global) {
+  pthread_mutex_lock(&table_lock);
+  phrase_id id = take_id();
+  if(id != NO_PHRASE) {
+    global->id = id;
+    PUBLISH(*phrase_slot(id), global);
+  }
+  pthread_mutex_unlock(&table_lock);
+  return id;
+}
+
+/* Release the id of a string which has been removed from everything
+ * readers can reach, retiring the string itself too (unless it lives in
+ * the snapshot). Both stay readable until no reader can be holding them.
+ */
+void phrase_release(phrase_id id) {
+  pthread_mutex_lock(&table_lock);
+  global_data* global = *phrase_slot(id);
+  PUBLISH(*phrase_slot(id),
+          (global_data*)((uint64_t)global | PHRASE_RELEASED));
+  queue_released(id, epoch_now());
+  pthread_mutex_unlock(&table_lock);
+
+  if(!snapshot_contains(global))
+    epoch_retire(global);
+}
+
+/* Call function on every string in use. Writers must be held off. */
+void phrase_iterate(void* state, phrase_iter_fn function) {
+  for(uint64_t id = NO_PHRASE + 1; id < next_id; id++) {
+    global_data* global = *phrase_slot(id);
+    if(global != NULL && !((uint64_t)global & PHRASE_RELEASED))
+      function(global, state);
+  }
+}
+
+/* Write every string in use to a snapshot, followed by a table of where
+ * each went by id (0 for unused ids). Returns the tagged pointer to the
+ * table, setting count to its length, or NULL on failure. Writers must be
+ * held off.
+ */
+void* phrase_snapshot_write(snapshot_writer* writer, uint64_t* count) {
+  *count = next_id;
+  uint64_t* table = ccalloc(*count, sizeof(uint64_t));
+  if(table == NULL)
+    return NULL;
+
+  for(uint64_t id = NO_PHRASE + 1; id < *count; id++) {
+    global_data* global = *phrase_slot(id);
+    if(global != NULL && !((uint64_t)global & PHRASE_RELEASED)) {
+      uint64_t size = GLOBAL_SIZE(global->len, global->normalized_len);
+      table[id] = (uint64_t)snapshot_append(writer, global, size);
+    }
+  }
+
+  void* written = snapshot_append(writer, table, *count*sizeof(uint64_t));
+  cfree(table);
+  return written;
+}
+
+/* Replace the table with one from a mapped snapshot, whose strings keep
+ * their ids. The strings the table held before are freed, so nothing may
+ * still be using them, or be searching.
+ */
+op_result phrase_snapshot_load(uint64_t* table, uint64_t count) {
+  if(count > (uint64_t)UINT32_MAX + 1)
+    return BAD_PARAM;
+
+  pthread_mutex_lock(&table_lock);
+  for(uint64_t id = NO_PHRASE + 1; id < next_id; id++) {
+    global_data* global = *phrase_slot(id);
+    if(global != NULL && !((uint64_t)global & PHRASE_RELEASED) &&
+       !snapshot_contains(global)) {
+      cfree(global);
+    }
+    *phrase_slot(id) = NULL;
+  }
+  cfree(released);
+  released = NULL;
+  released_start = num_released = released_capacity = 0;
+  next_id = NO_PHRASE + 1;
+
+  op_result result = NO_ERROR;
+  for(uint64_t id = NO_PHRASE + 1; id < count && result == NO_ERROR; id++) {
+    if(!chunk_for(id)) {
+      result = MALLOC_FAIL;
+    } else if(table[id] != 0) {
+      *phrase_slot(id) = snapshot_resolve((void*)table[id]);
+    } else {
+      /*a gap, which can be handed out straight away*/
+      queue_released(id, 0);
+    }
+    next_id = id + 1;
+  }
+  pthread_mutex_unlock(&table_lock);
+  return result;
+}
@@ -0,0 +1,52 @@
+#ifndef _PHRASE_H_
+#define _PHRASE_H_
+
+#include <stdint.h>
+#include "cobb2.h"
+#include "epoch.h"
+#include "snapshot.h"
+
+/* Table of every global string by a 32 bit id, which is what dline entries
+ * store in place of a pointer. Ids of removed strings are only handed out
+ * again once no reader can still be looking them up.
+ */
+
+#define NO_PHRASE 0
+
+/* The table is split into fixed size chunks so it can grow without moving,
+ * readers only ever loading the chunk and then the slot.
+ */
+#define PHRASE_CHUNK_BITS 16
+#define PHRASE_CHUNK_SIZE (1 << PHRASE_CHUNK_BITS)
+#define PHRASE_MAX_CHUNKS (1 << (32 - PHRASE_CHUNK_BITS))
+
+/* Slots of removed strings keep the old pointer for readers still holding
+ * the id, tagged with this bit
+ */
+#define PHRASE_RELEASED 1
+
+extern global_data** phrase_chunks[PHRASE_MAX_CHUNKS];
+
+/* The global string with an id in use, safe to call from any thread */
+static inline global_data* phrase_get(phrase_id id) {
+  global_data** chunk = READ_SHARED(phrase_chunks[id >> PHRASE_CHUNK_BITS]);
+  global_data* global = READ_SHARED(chunk[id & (PHRASE_CHUNK_SIZE - 1)]);
+  return (global_data*)((uint64_t)global & ~(uint64_t)PHRASE_RELEASED);
+}
+
+/* Start loading the slot of an id which is about to be looked up */
+static inline void phrase_prefetch(phrase_id id) {
+  global_data** chunk = READ_SHARED(phrase_chunks[id >> PHRASE_CHUNK_BITS]);
+  PREFETCH(&chunk[id & (PHRASE_CHUNK_SIZE - 1)]);
+}
+
+typedef void(phrase_iter_fn)(global_data*, void*);
+
+phrase_id phrase_add(global_data* global);
+void phrase_release(phrase_id id);
+void phrase_iterate(void* state, phrase_iter_fn function);
+
+void* phrase_snapshot_write(snapshot_writer* writer, uint64_t* count);
+op_result phrase_snapshot_load(uint64_t* table, uint64_t count);
+
+#endif
@@ -1,33 +1,73 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "cmalloc.h"
 #include "cobb2.h"
+#include "epoch.h"
+#include "phrase.h"
 #include "server.h"
+#include "wal.h"
 
 /* Encapsulates operations on a server (which has a trie and parser)
  */
 
-/* Upsert a string with score into the server.*/
-op_result server_upsert(server_t* server,
-                        char* input,/*assumed to have a trailing /0*/
-                        unsigned int score) {
-  if(server == NULL || input == NULL) {
-    return BAD_PARAM;
-  }
-  
-  string_data string;
-  
-  op_result res = normalize(input, &string);
-  if(res != NO_ERROR)
-    return res;
-  
+/* Upsert a normalized string with the write lock held, logging the change
+ * if the server has a log. seq is set to the log sequence number to wait
+ * on before reporting the change done, or 0 if there is nothing to wait
+ * for. Strings longer than a dline entry can hold are rejected with
+ * BAD_PARAM.
+ */
+static op_result upsert_locked(server_t* server,
+                               char* input,
+                               string_data* string,
+                               unsigned int score,
+                               uint64_t* seq) {
   int suffix_start = -1;
   upsert_state state = {NULL,0,0};
-  
-  while((suffix_start = next_start(&string,
-                                   &server->parser,
-                                   suffix_start)) >= 0) {
+  op_result res;
+
+  *seq = 0;
+  if(string->length > DLINE_MAX_LEN)
+    return BAD_PARAM;
+
+  /* The index says up front whether this is an insert or an update, so
+   * the dlines don't have to be searched for the string to find out
+   */
+  global_data* global = index_find(server->index, string, 1);
+  if(global != NULL) {
+    /* An update to the same score changes nothing, so isn't logged. The
+     * change which set that score may not be on disk yet though, so this
+     * waits for everything logged so far like a real change would.
+     */
+    if(global->score == score) {
+      if(server->wal != NULL)
+        *seq = wal_appended(server->wal);
+      return NO_ERROR;
+    }
+    state.mode = UPSERT_MODE_UPDATE;
+    state.old_score = global->score;
+  } else {
+    global = create_global(string);
+    if(global == NULL)
+      return MALLOC_FAIL;
+    global->score = score;
+    res = index_add(server->index, global);
+    if(res != NO_ERROR) {
+      phrase_release(global->id);
+      return res;
+    }
+    state.mode = UPSERT_MODE_INSERT;
+  }
+  state.global_ptr = global;
+
+  /*each suffix's path starts loading while the one before is upserted*/
+  int next = next_start(string, &server->parser, suffix_start);
+  while((suffix_start = next) >= 0) {
+    next = next_start(string, &server->parser, suffix_start);
+    if(next >= 0)
+      trie_prefetch(server->trie, string, next);
     res = trie_upsert(server->trie,
-                      &string,
+                      string,
                       suffix_start,
                       score,
                       &state);
@@ -39,21 +79,481 @@ op_result server_upsert(server_t* server,
        * TODO: its possible that a trie_remove could undo enough to fix.
        */
       fprintf(stderr, "Failed mid-attempt update, be very afraid\n");
-      cfree(string.normalized);
       return res;
     }
-    
   }
+  PUBLISH(global->score, score);
+  PUBLISH(server->version, server->version + 1);
+
+  if(server->wal == NULL)
+    return NO_ERROR;
+  return wal_append(server->wal, WAL_SET, input, score, seq);
+}
+
+/* Upsert a string with score into the server. Safe to call from any
+ * thread, concurrent upserts wait on the server's write lock. If the
+ * server has a log, this returns once the change is on disk.
+ */
+op_result server_upsert(server_t* server,
+                        char* input,/*assumed to have a trailing /0*/
+                        unsigned int score) {
+  if(server == NULL || input == NULL) {
+    return BAD_PARAM;
+  }
+  
+  string_data string;
+  uint64_t seq;
+  
+  op_result res = normalize(input, &string);
+  if(res != NO_ERROR)
+    return res;
 
+  pthread_mutex_lock(&server->write_lock);
+  res = upsert_locked(server, input, &string, score, &seq);
+  /*free up whatever the upsert replaced, once readers are done with it*/
+  epoch_reclaim();
+  pthread_mutex_unlock(&server->write_lock);
   cfree(string.normalized);
-  return NO_ERROR;
+
+  /*the log is synced outside the lock, so other writers can share it*/
+  if(res == NO_ERROR && seq != 0)
+    res = wal_sync(server->wal, seq);
+  return res;
+}
+
+/* How many upserts a batch applies between epoch_reclaim calls */
+#define BATCH_RECLAIM_EVERY 1024
+
+/* Upsert many strings at once, taking the write lock and syncing the log
+ * once for the lot rather than once each. The result for each string is
+ * stored in results (if not NULL), and the first error is returned.
+ */
+op_result server_upsert_batch(server_t* server,
+                              char** inputs,
+                              unsigned int* scores,
+                              int count,
+                              op_result* results) {
+  if(server == NULL || count < 0 ||
+     (count > 0 && (inputs == NULL || scores == NULL)))
+    return BAD_PARAM;
+
+  op_result first_error = NO_ERROR;
+  uint64_t last_seq = 0;
+  /*one buffer is reused to normalize every string*/
+  char* normalized = NULL;
+  unsigned int normalized_capacity = 0;
+
+  pthread_mutex_lock(&server->write_lock);
+  for(int i = 0; i < count; i++) {
+    string_data string;
+    uint64_t seq = 0;
+    op_result res = normalize_into(inputs[i], &string, &normalized,
+                                   &normalized_capacity);
+    if(res == NO_ERROR)
+      res = upsert_locked(server, inputs[i], &string, scores[i], &seq);
+
+    if(seq != 0)
+      last_seq = seq;
+    if(results != NULL)
+      results[i] = res;
+    if(first_error == NO_ERROR)
+      first_error = res;
+    if(i % BATCH_RECLAIM_EVERY == BATCH_RECLAIM_EVERY - 1)
+      epoch_reclaim();
+  }
+  epoch_reclaim();
+  pthread_mutex_unlock(&server->write_lock);
+  cfree(normalized);
+
+  if(last_seq == 0)
+    return first_error;
+
+  /*everything logged is made durable together, or not at all*/
+  op_result res = wal_sync(server->wal, last_seq);
+  if(res != NO_ERROR) {
+    for(int i = 0; results != NULL && i < count; i++) {
+      if(results[i] == NO_ERROR)
+        results[i] = res;
+    }
+    if(first_error == NO_ERROR)
+      first_error = res;
+  }
+  return first_error;
+}
+
+/* Remove every suffix of a normalized string with the write lock held,
+ * releasing its global string and logging the removal like upsert_locked.
+ */
+static op_result remove_locked(server_t* server,
+                               char* input,
+                               string_data* string,
+                               uint64_t* seq) {
+  int suffix_start = -1;
+
+  *seq = 0;
+  global_data* global = index_find(server->index, string, 1);
+  if(global == NULL)
+    return NOT_FOUND;
+
+  remove_state state = {global};
+  int next = next_start(string, &server->parser, suffix_start);
+  while((suffix_start = next) >= 0) {
+    next = next_start(string, &server->parser, suffix_start);
+    if(next >= 0)
+      trie_prefetch(server->trie, string, next);
+    op_result res = trie_remove(server->trie, string, suffix_start, &state);
+    if(res != NO_ERROR && res != NOT_FOUND) {
+      /*same problem as a failed upsert, the string is left half removed*/
+      fprintf(stderr, "Failed mid-attempt removal, be very afraid\n");
+      return res;
+    }
+  }
+
+  /*searches may still be reading the string and its id*/
+  index_remove(server->index, global);
+  phrase_release(global->id);
+  PUBLISH(server->version, server->version + 1);
+
+  if(server->wal == NULL)
+    return NO_ERROR;
+  return wal_append(server->wal, WAL_REMOVE, input, 0, seq);
+}
+
+/* Remove a string, with all of its suffixes, from the server. Returns
+ * NOT_FOUND if it isn't there. Like server_upsert, this returns once the
+ * removal is on disk if the server has a log.
+ */
+op_result server_remove(server_t* server, char* input) {
+  if(server == NULL || input == NULL)
+    return BAD_PARAM;
+
+  string_data string;
+  uint64_t seq;
+
+  op_result res = normalize(input, &string);
+  if(res != NO_ERROR)
+    return res;
+
+  pthread_mutex_lock(&server->write_lock);
+  res = remove_locked(server, input, &string, &seq);
+  epoch_reclaim();
+  pthread_mutex_unlock(&server->write_lock);
+  cfree(string.normalized);
+
+  if(res == NO_ERROR && seq != 0)
+    res = wal_sync(server->wal, seq);
+  return res;
+}
+
+typedef struct bulk_phrase {
+  char* phrase;
+  unsigned int score;
+  int order;
+} bulk_phrase;
+
+/* Sort by string, and by position for duplicates, so that the last score
+ * given for a string can win like it would with repeated upserts
+ */
+static int bulk_phrase_cmp(const void* a, const void* b) {
+  const bulk_phrase* p1 = (const bulk_phrase*)a;
+  const bulk_phrase* p2 = (const bulk_phrase*)b;
+  int cmp = strcmp(p1->phrase, p2->phrase);
+  if(cmp != 0)
+    return cmp;
+  return p1->order < p2->order ? -1 : p1->order > p2->order;
+}
+
+/* Does the work of server_bulk_load on phrases already sorted by
+ * bulk_phrase_cmp. Every distinct phrase's normalized string and global
+ * string is left in strings/globals (with the count in num_unique) for the
+ * caller to clean up. Returns the new trie, or NULL on failure.
+ */
+static trie_t* bulk_build(server_t* server,
+                          bulk_phrase* sorted,
+                          int count,
+                          int pack,
+                          string_data* strings,
+                          global_data** globals,
+                          int* num_unique) {
+  int num_sources = 0;
+
+  /*first pass: one global string per distinct phrase, counting suffixes*/
+  for(int i = 0; i < count; i++) {
+    if(i + 1 < count && !strcmp(sorted[i].phrase, sorted[i+1].phrase))
+      continue;
+    if(normalize(sorted[i].phrase, &strings[*num_unique]) != NO_ERROR)
+      return NULL;
+    globals[*num_unique] = create_global(&strings[*num_unique]);
+    if(globals[*num_unique] == NULL) {
+      cfree(strings[*num_unique].normalized);
+      return NULL;
+    }
+    /*only the score is needed from here on*/
+    sorted[*num_unique].score = sorted[i].score;
+    globals[*num_unique]->score = sorted[i].score;
+    (*num_unique)++;
+
+    int suffix_start = -1;
+    while((suffix_start = next_start(&strings[*num_unique-1],
+                                     &server->parser,
+                                     suffix_start)) >= 0) {
+      num_sources++;
+    }
+  }
+
+  dline_source* sources = cmalloc((num_sources + 1)*sizeof(dline_source));
+  if(sources == NULL)
+    return NULL;
+
+  num_sources = 0;
+  for(int i = 0; i < *num_unique; i++) {
+    int suffix_start = -1;
+    while((suffix_start = next_start(&strings[i],
+                                     &server->parser,
+                                     suffix_start)) >= 0) {
+      sources[num_sources].id = globals[i]->id;
+      sources[num_sources].score = sorted[i].score;
+      sources[num_sources].len = strings[i].length - suffix_start;
+      sources[num_sources].suffix = strings[i].normalized + suffix_start;
+      num_sources++;
+    }
+  }
+
+  trie_t* trie = trie_bulk_build(sources, num_sources, pack);
+  cfree(sources);
+  return trie;
+}
+
+/* Replace the server's contents with the given phrases and scores, built
+ * in one go with trie_bulk_build. Much faster than upserting them one at a
+ * time, but the old trie is freed immediately so this must not run
+ * alongside searches, e.g. only before serving. If a phrase is given more
+ * than once, its last score is used. pack packs large dlines, which makes
+ * them smaller but slower to write, so it suits a base index which changes
+ * little afterwards. Returns BAD_PARAM, loading nothing, if any phrase is
+ * longer than a dline entry can hold.
+ */
+op_result server_bulk_load(server_t* server,
+                           char** phrases,
+                           unsigned int* scores,
+                           int count,
+                           int pack) {
+  if(server == NULL || count < 0 ||
+     (count > 0 && (phrases == NULL || scores == NULL)))
+    return BAD_PARAM;
+  for(int i = 0; i < count; i++) {
+    if(strlen(phrases[i]) > DLINE_MAX_LEN)
+      return BAD_PARAM;
+  }
+
+  bulk_phrase* sorted = cmalloc((count + 1)*sizeof(bulk_phrase));
+  string_data* strings = cmalloc((count + 1)*sizeof(string_data));
+  global_data** globals = cmalloc((count + 1)*sizeof(global_data*));
+  trie_t* trie = NULL;
+  int num_unique = 0;
+
+  if(sorted != NULL && strings != NULL && globals != NULL) {
+    for(int i = 0; i < count; i++) {
+      sorted[i].phrase = phrases[i];
+      sorted[i].score = scores[i];
+      sorted[i].order = i;
+    }
+    qsort(sorted, count, sizeof(bulk_phrase), bulk_phrase_cmp);
+    trie = bulk_build(server, sorted, count, pack, strings, globals,
+                      &num_unique);
+  }
+
+  /*the index is replaced along with the trie, which it has to match*/
+  op_result result = trie == NULL ? MALLOC_FAIL : NO_ERROR;
+  trie_t* old = NULL;
+  pthread_mutex_lock(&server->write_lock);
+  if(result == NO_ERROR)
+    result = index_reset(server->index, num_unique);
+  if(result == NO_ERROR) {
+    /*sized for them all, so these can't fail*/
+    for(int i = 0; i < num_unique; i++)
+      index_add(server->index, globals[i]);
+    old = server->trie;
+    server->trie = trie;
+    PUBLISH(server->version, server->version + 1);
+  }
+  pthread_mutex_unlock(&server->write_lock);
+
+  /*the trie keeps the global strings, but only if it is in use*/
+  for(int i = 0; i < num_unique; i++) {
+    cfree(strings[i].normalized);
+    if(result != NO_ERROR)
+      phrase_release(globals[i]->id);
+  }
+  if(result != NO_ERROR && trie != NULL)
+    trie_clean(trie);
+  cfree(globals);
+  cfree(strings);
+  cfree(sorted);
+  if(old != NULL)
+    trie_clean(old);
+  return result;
+}
+
+/* Write the server's trie out as a snapshot which server_snapshot_load can
+ * start from. Holds off writes while it runs, searches carry on.
+ */
+op_result server_snapshot_save(server_t* server, const char* path) {
+  if(server == NULL || path == NULL)
+    return BAD_PARAM;
+
+  pthread_mutex_lock(&server->write_lock);
+  op_result result = trie_snapshot_write(server->trie, path);
+  pthread_mutex_unlock(&server->write_lock);
+  return result;
+}
+
+static void count_phrase(global_data* global, void* count) {
+  (*(uint64_t*)count)++;
+}
+
+static void index_phrase(global_data* global, void* index) {
+  index_add((index_t*)index, global);
+}
+
+/* Replace the server's trie with the one in a snapshot, which is mapped in
+ * rather than read. Like server_bulk_load this frees the old trie, so it
+ * can't run alongside searches. The snapshot must have been written by a
+ * server with the same parser settings, since the suffixes in it were
+ * split by them. Returns BAD_PARAM if the file isn't a usable snapshot.
+ */
+op_result server_snapshot_load(server_t* server, const char* path) {
+  if(server == NULL || path == NULL)
+    return BAD_PARAM;
+
+  trie_t* trie = trie_snapshot_load(path);
+  if(trie == NULL)
+    return BAD_PARAM;
+
+  pthread_mutex_lock(&server->write_lock);
+  trie_t* old = server->trie;
+  server->trie = trie;
+  /*the index is rebuilt from the snapshot's strings, sized to fit them*/
+  uint64_t count = 0;
+  phrase_iterate(&count, count_phrase);
+  op_result result = index_reset(server->index, count);
+  if(result == NO_ERROR)
+    phrase_iterate(server->index, index_phrase);
+  PUBLISH(server->version, server->version + 1);
+  pthread_mutex_unlock(&server->write_lock);
+  if(old != NULL)
+    trie_clean(old);
+  return result;
+}
+
+/* Removals for server_open_log, applied under a single write lock. Strings
+ * which aren't there are skipped.
+ */
+static op_result replay_removes(server_t* server, char** inputs, int count) {
+  op_result result = NO_ERROR;
+  char* normalized = NULL;
+  unsigned int normalized_capacity = 0;
+
+  pthread_mutex_lock(&server->write_lock);
+  for(int i = 0; i < count && result == NO_ERROR; i++) {
+    string_data string;
+    uint64_t seq;
+    result = normalize_into(inputs[i], &string, &normalized,
+                            &normalized_capacity);
+    if(result == NO_ERROR)
+      result = remove_locked(server, inputs[i], &string, &seq);
+    if(result == NOT_FOUND)
+      result = NO_ERROR;
+    if(i % BATCH_RECLAIM_EVERY == BATCH_RECLAIM_EVERY - 1)
+      epoch_reclaim();
+  }
+  epoch_reclaim();
+  pthread_mutex_unlock(&server->write_lock);
+  cfree(normalized);
+  return result;
+}
+
+/* Replay the log at path on top of whatever the server has loaded, and
+ * then log every change from here on to it. Only the last change to each
+ * phrase is replayed, with upserts and removals each done as a batch.
+ * Must be called before serving.
+ */
+op_result server_open_log(server_t* server, const char* path) {
+  if(server == NULL || path == NULL || server->wal != NULL)
+    return BAD_PARAM;
+
+  wal_record* records;
+  int count;
+  uint64_t valid_len;
+  op_result result = wal_read(path, &records, &count, &valid_len);
+  if(result != NO_ERROR)
+    return result;
+
+  int latest = wal_latest(records, count);
+  if(latest >= 0)
+    count = latest;
+  char** phrases = cmalloc((count + 1)*sizeof(char*));
+  unsigned int* scores = cmalloc((count + 1)*sizeof(unsigned int));
+  char** removed = cmalloc((count + 1)*sizeof(char*));
+  if(latest < 0 || phrases == NULL || scores == NULL || removed == NULL) {
+    result = MALLOC_FAIL;
+  } else {
+    int num_phrases = 0, num_removed = 0;
+    for(int i = 0; i < count; i++) {
+      if(records[i].op == WAL_REMOVE) {
+        removed[num_removed++] = records[i].phrase;
+      } else {
+        phrases[num_phrases] = records[i].phrase;
+        scores[num_phrases++] = records[i].score;
+      }
+    }
+    /*each phrase only appears once, so the order of the two is moot*/
+    result = server_upsert_batch(server, phrases, scores, num_phrases, NULL);
+    if(result == NO_ERROR)
+      result = replay_removes(server, removed, num_removed);
+  }
+
+  cfree(phrases);
+  cfree(scores);
+  cfree(removed);
+  wal_records_free(records, count);
+  if(result != NO_ERROR)
+    return result;
+
+  server->wal = wal_open(path, valid_len);
+  return server->wal == NULL ? BAD_PARAM : NO_ERROR;
+}
+
+/* Compact the server's log down to the last change to each phrase. Holds
+ * off writes while it runs.
+ */
+op_result server_compact_log(server_t* server) {
+  if(server == NULL || server->wal == NULL)
+    return BAD_PARAM;
+
+  pthread_mutex_lock(&server->write_lock);
+  op_result result = wal_compact(server->wal);
+  pthread_mutex_unlock(&server->write_lock);
+  return result;
+}
+
+/* The phrase a normalized string was made from, or failing that any
+ * phrase which normalizes the same, or NULL if there is neither. Like
+ * search results, it can only be read until epoch_exit.
+ */
+global_data* server_find(server_t* server, string_data* string) {
+  return index_find(server->index, string, 0);
 }
 
 /* wrapper around trie_search */
 int server_search(server_t* server,
                   string_data* string,/*leave normalize() out for now */
                   result_entry* results,
-                  int results_len) {
+                  int results_len,
+                  search_page* page,
+                  arena* scratch,
+                  int* truncated) {
   
-  return trie_search(server->trie, string, results, results_len);
+  return trie_search(server->trie, string, results, results_len, page,
+                     scratch, truncated);
 }
@@ -1,22 +1,62 @@
 #ifndef _SERVER_H_
 #define _SERVER_H_
 
+#include <pthread.h>
 #include "cobb2.h"
+#include "index.h"
 #include "parse.h"
 #include "trie.h"
+#include "wal.h"
 
+/* Any number of threads can search a server at once, but writes are
+ * serialized by write_lock. If wal is set, every write is logged to it.
+ * index holds every phrase in the trie. version goes up after every change
+ * searches could see, so that what a search found can be reused for as
+ * long as it stays the same.
+ */
 typedef struct server_t {
   parser_data parser;
   trie_t* trie;
+  index_t* index;
+  pthread_mutex_t write_lock;
+  wal_t* wal;
+  uint64_t version;
 } server_t;
 
 op_result server_upsert(server_t* server,
                         char* input,
                         unsigned int score);
 
+op_result server_remove(server_t* server, char* input);
+
+op_result server_upsert_batch(server_t* server,
+                              char** inputs,
+                              unsigned int* scores,
+                              int count,
+                              op_result* results);
+
+op_result server_bulk_load(server_t* server,
+                           char** phrases,
+                           unsigned int* scores,
+                           int count,
+                           int pack);
+
+op_result server_snapshot_save(server_t* server, const char* path);
+
+op_result server_snapshot_load(server_t* server, const char* path);
+
+op_result server_open_log(server_t* server, const char* path);
+
+op_result server_compact_log(server_t* server);
+
 int server_search(server_t* server,
                   string_data* string,
                   result_entry* results,
-                  int results_len);
+                  int results_len,
+                  search_page* page,
+                  arena* scratch,
+                  int* truncated);
+
+global_data* server_find(server_t* server, string_data* string);
 
 #endif
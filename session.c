@@ -0,0 +1,191 @@
+#include <string.h>
+#include "cmalloc.h"
+#include "cobb2.h"
+#include "epoch.h"
+#include "phrase.h"
+#include "session.h"
+
+typedef struct session_candidate {
+  phrase_id id;
+  unsigned int score;
+  int start; /*of the first suffix matching*/
+} session_candidate;
+
+/* The matches of a session's last prefix, in the order searches return
+ * them, which is every match scoring at least min_score
+ */
+typedef struct session_slot {
+  uint64_t token_hash;
+  uint64_t version; /*of the server when the matches were found*/
+  unsigned int min_score;
+  int count; /*-1 if the session has no matches kept*/
+  unsigned int prefix_len;
+  char prefix[SESSION_PREFIX_MAX];
+  session_candidate candidates[SESSION_CANDIDATES];
+} session_slot;
+
+/* How many candidates ahead of the one being checked its global string is
+ * loaded, with its slot in the phrase table loaded twice as far ahead
+ */
+#define SESSION_PREFETCH_AHEAD 4
+
+struct session_cache {
+  uint64_t mask; /*number of slots - 1, a power of 2*/
+  session_slot slots[];
+};
+
+/* FNV-1a, like the index's */
+static uint64_t token_hash(char* token) {
+  uint64_t hash = 14695981039346656037ull;
+  for(; *token != '\0'; token++)
+    hash = (hash ^ (unsigned char)*token)*1099511628211ull;
+  return hash;
+}
+
+/* A cache of at least num_slots sessions */
+session_cache* session_cache_init(int num_slots) {
+  uint64_t rounded = 1;
+  while(rounded < (uint64_t)num_slots)
+    rounded *= 2;
+
+  session_cache* cache = cmalloc(sizeof(session_cache) +
+                                 rounded*sizeof(session_slot));
+  if(cache == NULL)
+    return NULL;
+  cache->mask = rounded - 1;
+  for(uint64_t i = 0; i < rounded; i++) {
+    cache->slots[i].token_hash = 0;
+    cache->slots[i].count = -1;
+  }
+  return cache;
+}
+
+void session_cache_clean(session_cache* cache) {
+  cfree(cache);
+}
+
+/* Where the first suffix of a global string starting with the prefix is,
+ * which is the one a search reports it by, or -1 if none does. Any suffix
+ * matching it also matches a shorter prefix, so the search starts from
+ * the first suffix which matched one.
+ */
+static int match_start(server_t* server,
+                       global_data* global,
+                       string_data* prefix,
+                       int start) {
+  string_data string;
+  string.full = GLOBAL_STR(global);
+  string.normalized = GLOBAL_NORMALIZED(global);
+  string.length = global->normalized_len;
+  string.full_length = global->len;
+
+  for(; start >= 0; start = next_start(&string, &server->parser, start)) {
+    if(string.length - start >= prefix->length &&
+       !memcmp(string.normalized + start, prefix->normalized,
+               prefix->length)) {
+      return start;
+    }
+  }
+  return -1;
+}
+
+/* Answer a search from the matches of a prefix of it, keeping the ones
+ * still matching as the session's matches for the longer prefix. truncated
+ * is set if more of them would have made the page.
+ */
+static int session_narrow(session_slot* slot,
+                          server_t* server,
+                          string_data* string,
+                          result_entry* results,
+                          int results_len,
+                          unsigned int min_score,
+                          int* truncated) {
+  int kept = 0;
+  int count = 0;
+  *truncated = 0;
+
+  for(int i = 0; i < slot->count; i++) {
+    if(i + 2*SESSION_PREFETCH_AHEAD < slot->count)
+      phrase_prefetch(slot->candidates[i + 2*SESSION_PREFETCH_AHEAD].id);
+    if(i + SESSION_PREFETCH_AHEAD < slot->count)
+      PREFETCH(phrase_get(slot->candidates[i + SESSION_PREFETCH_AHEAD].id));
+
+    session_candidate candidate = slot->candidates[i];
+    global_data* global = phrase_get(candidate.id);
+    candidate.start = match_start(server, global, string, candidate.start);
+    if(candidate.start < 0)
+      continue;
+
+    slot->candidates[kept++] = candidate;
+    if(candidate.score < min_score)
+      continue;
+    if(count == results_len) {
+      *truncated = 1;
+    } else {
+      results[count].global_ptr = global;
+      results[count].score = candidate.score;
+      results[count].id = candidate.id;
+      results[count].offset = 0;
+      results[count].len = global->normalized_len - candidate.start;
+      count++;
+    }
+  }
+
+  slot->count = kept;
+  slot->prefix_len = string->length;
+  memcpy(slot->prefix, string->normalized, string->length);
+  return count;
+}
+
+/* Search as server_search would for the first page of results scoring at
+ * least min_score, reusing what the session's last search found if this
+ * prefix extends its prefix. truncated is set as by server_search. Callers
+ * must hold epoch_enter() just like for server_search.
+ */
+int session_search(session_cache* cache,
+                   server_t* server,
+                   char* token,
+                   string_data* string,
+                   result_entry* results,
+                   int results_len,
+                   unsigned int min_score,
+                   arena* scratch,
+                   int* truncated) {
+  uint64_t hash = token_hash(token);
+  session_slot* slot = &cache->slots[hash & cache->mask];
+  /*read first, so a change during the search leaves the matches stale*/
+  uint64_t version = READ_SHARED(server->version);
+
+  if(slot->token_hash == hash && slot->count >= 0 &&
+     slot->version == version && min_score >= slot->min_score &&
+     string->length >= slot->prefix_len &&
+     string->length <= SESSION_PREFIX_MAX &&
+     !memcmp(string->normalized, slot->prefix, slot->prefix_len)) {
+    return session_narrow(slot, server, string, results, results_len,
+                          min_score, truncated);
+  }
+
+  slot->token_hash = hash;
+  slot->count = -1;
+
+  search_page page = {min_score, 0, 0, NO_PHRASE};
+  int count = server_search(server, string, results, results_len, &page,
+                            scratch, truncated);
+  /*a search which wasn't cut off found all of the matches*/
+  if(!*truncated && count <= SESSION_CANDIDATES &&
+     string->length <= SESSION_PREFIX_MAX) {
+    for(int i = 0; i < count; i++) {
+      global_data* global = results[i].global_ptr;
+      slot->candidates[i].id = results[i].id;
+      slot->candidates[i].score = results[i].score;
+      slot->candidates[i].start = global->normalized_len - results[i].len -
+        results[i].offset;
+    }
+    slot->count = count;
+    slot->version = version;
+    slot->min_score = min_score;
+    slot->prefix_len = string->length;
+    memcpy(slot->prefix, string->normalized, string->length);
+  }
+  return count;
+}
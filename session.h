@@ -0,0 +1,46 @@
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#include <stdint.h>
+#include "cmalloc.h"
+#include "cobb2.h"
+#include "parse.h"
+#include "server.h"
+
+/* Type-ahead sessions. A client typing sends a chain of searches, each
+ * prefix extending the last, tagged with a token of its choosing. Once a
+ * prefix has few enough matches that a search isn't cut off, those are
+ * all of them, so they are kept for the session, and later prefixes in
+ * the chain are answered by narrowing that set down rather than searching
+ * again. Sets are only used while the server is unchanged since they were
+ * found.
+ *
+ * A cache holds a fixed number of sessions, a newer one taking over the
+ * slot of an older one whose token hashes to the same place. Each cache
+ * belongs to a single thread.
+ */
+
+/* Most matches kept for a session. Searches aren't widened to fill it,
+ * since asking for more than a page is slower than searching again.
+ */
+#define SESSION_CANDIDATES 64
+
+/* Longest normalized prefix a session keeps matches for */
+#define SESSION_PREFIX_MAX 64
+
+typedef struct session_cache session_cache;
+
+session_cache* session_cache_init(int num_slots);
+void session_cache_clean(session_cache* cache);
+
+int session_search(session_cache* cache,
+                   server_t* server,
+                   char* token,
+                   string_data* string,
+                   result_entry* results,
+                   int results_len,
+                   unsigned int min_score,
+                   arena* scratch,
+                   int* truncated);
+
+#endif
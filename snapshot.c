@@ -0,0 +1,169 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L /*for mmap*/
+#endif
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cmalloc.h"
+#include "cobb2.h"
+#include "snapshot.h"
+#include "sync.h"
+
+/* Snapshots are a single file holding a whole index, written so that it
+ * can be mmap'ed and searched straight away, with pages faulted in as
+ * searches touch them. Nothing in the file is an absolute pointer: every
+ * pointer is an offset from the start of the file, tagged with
+ * SNAPSHOT_TAG so that readers know to resolve it. The layout of the
+ * objects themselves (and the header at the start) is up to the caller,
+ * this just handles laying them out in the file and mapping it back in.
+ */
+
+char* snapshot_base = NULL;
+uint64_t snapshot_length = 0;
+
+struct snapshot_writer {
+  FILE* fp;
+  char* path;
+  char* tmp_path;
+  uint64_t offset;
+  op_result result;
+};
+
+/* Start writing a snapshot to path, leaving header_size bytes for the
+ * header which is filled in by snapshot_finish. The file is written
+ * alongside and only renamed into place once complete.
+ */
+snapshot_writer* snapshot_create(const char* path, uint64_t header_size) {
+  snapshot_writer* writer = cmalloc(sizeof(snapshot_writer));
+  if(writer == NULL)
+    return NULL;
+  memset(writer, 0, sizeof(snapshot_writer));
+
+  writer->path = cmalloc(strlen(path) + 1);
+  writer->tmp_path = cmalloc(strlen(path) + 5);
+  if(writer->path == NULL || writer->tmp_path == NULL) {
+    cfree(writer->path);
+    cfree(writer->tmp_path);
+    cfree(writer);
+    return NULL;
+  }
+  strcpy(writer->path, path);
+  sprintf(writer->tmp_path, "%s.tmp", path);
+
+  writer->fp = fopen(writer->tmp_path, "wb");
+  if(writer->fp == NULL) {
+    writer->result = BAD_PARAM;
+    return writer;
+  }
+
+  /*the header is written last, just reserve room for it*/
+  char zero[8] = {0};
+  while(writer->offset < header_size) {
+    uint64_t len = header_size - writer->offset < 8 ?
+      header_size - writer->offset : 8;
+    if(fwrite(zero, 1, len, writer->fp) != len)
+      writer->result = MALLOC_FAIL;
+    writer->offset += len;
+  }
+  return writer;
+}
+
+/* Write out len bytes of data, returning the tagged pointer it will have
+ * in the snapshot. Errors are kept until snapshot_finish.
+ */
+void* snapshot_append(snapshot_writer* writer, void* data, uint64_t len) {
+  char zero[8] = {0};
+  uint64_t padding = (8 - (writer->offset & 7)) & 7;
+
+  if(writer->result == NO_ERROR &&
+     (fwrite(zero, 1, padding, writer->fp) != padding ||
+      fwrite(data, 1, len, writer->fp) != len)) {
+    writer->result = MALLOC_FAIL;
+  }
+  writer->offset += padding;
+
+  void* written = (void*)(writer->offset | SNAPSHOT_TAG);
+  writer->offset += len;
+  return written;
+}
+
+/* Total size of the snapshot so far */
+uint64_t snapshot_written(snapshot_writer* writer) {
+  return writer->offset;
+}
+
+/* Write the header and move the finished snapshot into place. The file is
+ * synced before it replaces whatever was at the path, and the directory
+ * after, so a crash leaves either the old snapshot or all of the new one.
+ * Frees the writer, returning the first error hit while writing.
+ */
+op_result snapshot_finish(snapshot_writer* writer,
+                          void* header,
+                          uint64_t header_size) {
+  op_result result = writer->result;
+
+  if(writer->fp != NULL) {
+    if(result == NO_ERROR &&
+       (fseek(writer->fp, 0, SEEK_SET) ||
+        fwrite(header, 1, header_size, writer->fp) != header_size ||
+        fflush(writer->fp) || fsync(fileno(writer->fp)))) {
+      result = MALLOC_FAIL;
+    }
+    if(fclose(writer->fp) && result == NO_ERROR)
+      result = MALLOC_FAIL;
+    if(result == NO_ERROR && rename(writer->tmp_path, writer->path))
+      result = BAD_PARAM;
+    if(result != NO_ERROR)
+      remove(writer->tmp_path);
+    else if(sync_parent(writer->path))
+      result = MALLOC_FAIL;
+  }
+
+  cfree(writer->path);
+  cfree(writer->tmp_path);
+  cfree(writer);
+  return result;
+}
+
+/* Map a snapshot into memory, returning where it starts (or NULL). Pages
+ * are private to the process, so structures in them can still be changed
+ * in place without touching the file.
+ */
+void* snapshot_map(const char* path, uint64_t* length) {
+  struct stat st;
+
+  if(snapshot_base != NULL)
+    return NULL;
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0)
+    return NULL;
+  if(fstat(fd, &st) || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  void* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    fd, 0);
+  close(fd);
+  if(base == MAP_FAILED)
+    return NULL;
+
+  snapshot_base = base;
+  snapshot_length = st.st_size;
+  *length = st.st_size;
+  return base;
+}
+
+/* Unmap the snapshot, which nothing may point into any more */
+void snapshot_unmap() {
+  if(snapshot_base == NULL)
+    return;
+  munmap(snapshot_base, snapshot_length);
+  snapshot_base = NULL;
+  snapshot_length = 0;
+}
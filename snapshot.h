@@ -0,0 +1,47 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdint.h>
+#include "cobb2.h"
+
+/* Pointers stored inside a snapshot are offsets from the start of the
+ * file, tagged with this bit (everything in a snapshot is 8 byte aligned,
+ * and the low bit is left for hash node tagging). Once the snapshot is
+ * mapped, snapshot_resolve turns them back into real pointers wherever
+ * they are loaded.
+ */
+#define SNAPSHOT_TAG 2
+
+/* Where the snapshot is mapped. Only one can be mapped per process. */
+extern char* snapshot_base;
+extern uint64_t snapshot_length;
+
+static inline void* snapshot_resolve(void* ptr) {
+  uint64_t value = (uint64_t)ptr;
+  if(!(value & SNAPSHOT_TAG))
+    return ptr;
+  return snapshot_base + (value & ~(uint64_t)SNAPSHOT_TAG);
+}
+
+/* Memory in the mapped snapshot is never freed */
+static inline int snapshot_contains(void* ptr) {
+  return (char*)ptr >= snapshot_base &&
+    (char*)ptr < snapshot_base + snapshot_length;
+}
+
+typedef struct snapshot_writer snapshot_writer;
+
+snapshot_writer* snapshot_create(const char* path, uint64_t header_size);
+
+void* snapshot_append(snapshot_writer* writer, void* data, uint64_t len);
+
+uint64_t snapshot_written(snapshot_writer* writer);
+
+op_result snapshot_finish(snapshot_writer* writer,
+                          void* header,
+                          uint64_t header_size);
+
+void* snapshot_map(const char* path, uint64_t* length);
+void snapshot_unmap();
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L /*for fsync*/
+#endif
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "cmalloc.h"
+#include "sync.h"
+
+/* Helpers for making changes to files durable, shared by the snapshot
+ * writer and the change log.
+ */
+
+/* Sync the directory holding path, so a rename into it is on disk.
+ * Returns nonzero on failure.
+ */
+int sync_parent(const char* path) {
+  const char* slash = strrchr(path, '/');
+  char* dir = cmalloc(slash == NULL ? 2 : slash - path + 2);
+  if(dir == NULL)
+    return -1;
+  if(slash == NULL) {
+    strcpy(dir, ".");
+  } else {
+    /*keep the slash itself, so the root directory stays "/"*/
+    memcpy(dir, path, slash - path + 1);
+    dir[slash - path + 1] = '\0';
+  }
+
+  int fd = open(dir, O_RDONLY);
+  cfree(dir);
+  if(fd < 0)
+    return -1;
+  int failed = fsync(fd);
+  close(fd);
+  return failed;
+}
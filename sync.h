@@ -0,0 +1,6 @@
+#ifndef _SYNC_H_
+#define _SYNC_H_
+
+int sync_parent(const char* path);
+
+#endif
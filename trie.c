@@ -1,89 +1,628 @@
 #include <assert.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "cmalloc.h"
 #include "cobb2.h"
 #include "dline.h"
+#include "epoch.h"
+#include "phrase.h"
+#include "snapshot.h"
 #include "trie.h"
 
 /* Functions that operate on a trie. Every trie node has a list of suffixes
- * which terminate at it, as well as an array of children nodes for each byte
+ * which terminate at it, as well as a set of children nodes keyed by byte
  * value. Children can either be other trie nodes, or hash table nodes, in
- * which there are a fixed number of buckets that the first unmatched byte
- * hashes to. In trie nodes, the lowest bit of each child pointer indicates
- * whether it points to a hash or trie node.
+ * which there are a fixed number of buckets that the first two unmatched
+ * bytes hash to. In trie nodes, the lowest bit of each child pointer
+ * indicates whether it points to a hash or trie node.
+ *
+ * Trie nodes come in 4 sizes, in the style of an adaptive radix tree, so
+ * that sparse nodes don't pay for 256 child pointers:
+ * NODE_4/NODE_16: sorted array of keys, with children at the same index
+ * NODE_48: 256 byte index of (child slot + 1), 0 meaning no child
+ * NODE_256: children indexed directly by byte
+ * Nodes grow to the next size when full, and shrink when enough children
+ * are removed. Since that reallocates the node, whoever points at it has to
+ * be updated, so mutating operations carry around the slot holding the
+ * current node. The root is always a NODE_256 so its address never changes.
+ *
+ * Trie nodes within TRIE_CACHE_DEPTH of the root can also hold a cache of
+ * the top TRIE_CACHE_SIZE results in their subtree, which lets short
+ * prefix searches skip fanning out over the whole subtree. A cache is built
+ * by the first search which needs it, and is then kept up to date by
+ * upserts and removes on the path down to where they apply.
+ *
+ * Every trie and hash node also records the highest score in its subtree,
+ * so that once a search has a full set of results it can skip any subtree
+ * which can't beat the lowest of them. Upserts raise it on the way down to
+ * where they apply, and anything which can lower a score (removes, and
+ * updates to a lower score) recomputes it on the way back up. A reader can
+ * catch it raised before a new entry is published, never lowered before an
+ * old one is gone.
+ *
+ * Any number of threads can search concurrently with a single writer.
+ * Everything readers can reach is either immutable once published (dlines,
+ * hash nodes, caches, NODE_4/NODE_16 keys) or changed by a single atomic
+ * store (child pointers, NODE_48 index entries). Writers build a new copy
+ * of whatever they change, PUBLISH it, and epoch_retire the old one, which
+ * frees it once no reader can still be looking at it.
+ *
+ * A trie can also be loaded straight from a mapped snapshot, in which case
+ * child pointers and terminated dlines are offsets into it (see
+ * snapshot.h) until they are replaced, so they are always loaded through
+ * load_child/node_terminated. Nothing in the snapshot is ever freed.
  */
-#define NUM_BUCKETS 63
-#define MIN(a,b) (a<b?a:b)
 
+/* Hash node buckets are grouped by the first unmatched byte, and within a
+ * group picked by the second. A search with a single unmatched byte left
+ * then only has to look at one group instead of every bucket.
+ */
+#define HASH_GROUPS 32
+#define HASH_GROUP_SIZE 4
+#define NUM_BUCKETS (HASH_GROUPS*HASH_GROUP_SIZE)
+/* Suffixes with no unmatched bytes go in their own extra bucket */
+#define TERMINATOR_BUCKET NUM_BUCKETS
+
+enum node_kind {
+  NODE_4 = 0,
+  NODE_16 = 1,
+  NODE_48 = 2,
+  NODE_256 = 3
+};
+
+/* Materialized top results of a trie node's subtree, sorted the same way
+ * as search results with at most one entry per phrase id. The entries
+ * are always the top count results of the subtree; if complete is set
+ * they are all of them. Entries have the offset a search from the root
+ * would give them, which is the same for any prefix ending at this node.
+ */
+typedef struct trie_cache {
+  int count;
+  int complete;
+  result_entry entries[TRIE_CACHE_SIZE];
+} trie_cache;
+
+/* Placeholder cache pointers. While a reader builds a cache the node points
+ * at it with the low bit set, so markers left by different builds are never
+ * confused. A retired node is marked dead so it never gets one.
+ */
+#define CACHE_BUILDING(cache) ((trie_cache*)((uint64_t)(cache) | 1))
+#define IS_CACHE_BUILDING(cache) (((uint64_t)(cache) & 1) != 0)
+#define CACHE_DEAD ((trie_cache*)2)
+
+/* Header shared by all node kinds */
 typedef struct trie_node {
   dline_t* terminated;
-  trie_t* children[256]; /*store type (trie/hash) in lowest bit*/
+  trie_cache* cache;
+  unsigned short kind;
+  unsigned short num_children;
+  unsigned int max_score; /*highest score in the subtree*/
 } trie_node;
 
+typedef struct trie_node4 {
+  trie_node header;
+  unsigned char keys[4];
+  trie_t* children[4]; /*store type (trie/hash) in lowest bit*/
+} trie_node4;
+
+typedef struct trie_node16 {
+  trie_node header;
+  unsigned char keys[16];
+  trie_t* children[16];
+} trie_node16;
+
+typedef struct trie_node48 {
+  trie_node header;
+  unsigned char index[256];
+  trie_t* children[48];
+} trie_node48;
+
+typedef struct trie_node256 {
+  trie_node header;
+  trie_t* children[256];
+} trie_node256;
+
+/* A hash node is a single contiguous block, in the style of the HAT-trie
+ * array hash: this header, followed by the dlines of every bucket (plus the
+ * terminator bucket) packed back to back. Bucket i occupies the bytes from
+ * offsets[i] to offsets[i+1] in data, and is empty if those are equal.
+ * Like dlines, hash nodes are never modified in place: an update builds a
+ * new copy of the node, which replaces the old one in its parent.
+ */
 typedef struct hash_node {
-  int size;
-  dline_t* entries[NUM_BUCKETS];
+  uint32_t size; /*number of entries*/
+  uint32_t bytes; /*total size of data*/
+  uint32_t max_score; /*highest score of any entry*/
+  uint32_t offsets[NUM_BUCKETS + 2];
+  uint32_t bucket_max[NUM_BUCKETS + 1]; /*highest score in each bucket*/
+  char data[];
 } hash_node;
 
-typedef struct split_state {
-  trie_t* new_node;
-  op_result result;
-} split_state;
-
 static inline uint64_t is_hash_node(trie_t* ptr) {
   return ((uint64_t)ptr)&1;
 }
 
-static int trie_node_count = 0;
+static inline trie_t* load_child(trie_t** slot) {
+  return snapshot_resolve(READ_SHARED(*slot));
+}
+
+static inline dline_t* node_terminated(trie_node* node) {
+  return snapshot_resolve(READ_SHARED(node->terminated));
+}
+
+static int node_kind_count[4] = {0, 0, 0, 0};
 static int hash_node_count = 0;
 
-/* Because we are doing prefix matching, we can only hash based on the first
- * byte. But yea, this is still stupid
+static const size_t node_sizes[4] = {
+  sizeof(trie_node4),
+  sizeof(trie_node16),
+  sizeof(trie_node48),
+  sizeof(trie_node256)
+};
+
+/* Max number of children each kind can hold */
+static const int node_capacity[4] = {4, 16, 48, 256};
+
+/* A node shrinks to the next smaller kind once it has this few children.
+ * Lower than the smaller kind's capacity, so that a node sitting on a
+ * boundary doesn't reallocate on every add/remove.
  */
-static inline uint64_t hash_idx(char first) {
-  return (uint64_t)first%NUM_BUCKETS;
+static const int node_shrink_at[4] = {0, 3, 12, 40};
+
+static op_result trie_upsert_slot(trie_t** root,
+                                  string_data* string,
+                                  unsigned int start,
+                                  unsigned int score,
+                                  upsert_state* state,
+                                  unsigned int* stored_at);
+static op_result trie_remove_entry(trie_t* existing,
+                                   string_data* string,
+                                   unsigned int start,
+                                   remove_state* state);
+
+/* Group of buckets for the first unmatched byte */
+static inline unsigned int hash_group(char first) {
+  return ((unsigned char)first)%HASH_GROUPS;
 }
 
-static void split_dline_iter_fn(dline_entry* entry,
-                                char* normalized_string,
-                                void* state) {
-  split_state* spl_state = (split_state*)state;
-  
-  /* Iterator just loops over everything, so if there is a problem the rest
-   * of of the dline will still be looped over, and we won't want to do
-   * anything.
-   */
-  if(spl_state->result != NO_ERROR)
+/* Bucket for the suffix of string starting at start. Suffixes with only one
+ * unmatched byte go into the first bucket of their group.
+ */
+static inline unsigned int hash_idx(string_data* string, unsigned int start) {
+  if(start >= string->length)
+    return TERMINATOR_BUCKET;
+
+  unsigned int idx = hash_group(string->normalized[start])*HASH_GROUP_SIZE;
+  if(start + 1 < string->length)
+    idx += ((unsigned char)string->normalized[start+1])%HASH_GROUP_SIZE;
+  return idx;
+}
+
+/* dline of the given bucket, NULL if it is empty */
+static inline dline_t* hash_bucket(hash_node* node, unsigned int idx) {
+  if(node->offsets[idx] == node->offsets[idx+1])
+    return NULL;
+  return (dline_t*)(node->data + node->offsets[idx]);
+}
+
+static inline trie_t* hash_node_tag(hash_node* node) {
+  return (trie_t*)((uint64_t)node+1);
+}
+
+/* Fill in the highest score of each bucket of a hash node, and of the node
+ * as a whole
+ */
+static void hash_node_scores(hash_node* node) {
+  node->max_score = MIN_SCORE;
+  for(int i = 0; i <= TERMINATOR_BUCKET; i++) {
+    node->bucket_max[i] = dline_max_score(hash_bucket(node, i));
+    if(node->bucket_max[i] > node->max_score)
+      node->max_score = node->bucket_max[i];
+  }
+}
+
+/* Create a copy of a hash node (or an empty one if existing is NULL) with
+ * bucket idx replaced by the given dline, which may be NULL. size_change is
+ * added to the entry count. Returns NULL on allocation failure.
+ */
+static hash_node* hash_node_replace(hash_node* existing,
+                                    unsigned int idx,
+                                    dline_t* dline,
+                                    int size_change) {
+  uint32_t old_start = 0, old_end = 0, old_bytes = 0;
+  if(existing != NULL) {
+    old_start = existing->offsets[idx];
+    old_end = existing->offsets[idx+1];
+    old_bytes = existing->bytes;
+  }
+  uint32_t new_len = (uint32_t)dline_size(dline);
+  uint32_t bytes = old_bytes - (old_end - old_start) + new_len;
+
+  hash_node* node = (hash_node*)cmalloc(sizeof(hash_node) + bytes);
+  if(node == NULL)
+    return NULL;
+
+  node->size = (existing == NULL ? 0 : existing->size) + size_change;
+  node->bytes = bytes;
+
+  if(existing == NULL) {
+    for(int i = 0; i <= NUM_BUCKETS + 1; i++)
+      node->offsets[i] = i <= idx ? 0 : new_len;
+    if(dline != NULL)
+      dline_copy(dline, node->data);
+  } else {
+    /*buckets after the replaced one shift by the change in its length*/
+    for(int i = 0; i <= NUM_BUCKETS + 1; i++) {
+      node->offsets[i] = i <= idx ? existing->offsets[i] :
+        existing->offsets[i] - (old_end - old_start) + new_len;
+    }
+    memcpy(node->data, existing->data, old_start);
+    if(dline != NULL)
+      dline_copy(dline, node->data + old_start);
+    memcpy(node->data + old_start + new_len, existing->data + old_end,
+           old_bytes - old_end);
+  }
+  hash_node_scores(node);
+
+  hash_node_count++;
+  return node;
+}
+
+/* Free a hash node, waiting for readers first if it has been shared */
+static void hash_node_free(hash_node* node, int shared) {
+  hash_node_count--;
+  if(snapshot_contains(node))
     return;
-  
-  /* Since this is re-inserting from a split, it is always an insert.
-   * Starting offset is 0 because this is the suffix string stored in the
-   * dline, not the full global string
-   */
-  upsert_state u_state = {entry->global_ptr, 0, UPSERT_MODE_INSERT};
-  string_data string_data =
-    {GLOBAL_STR(entry->global_ptr), normalized_string, entry->len};
-  spl_state->result = trie_upsert(spl_state->new_node,
-                                  &string_data,
-                                  0,
-                                  entry->score,
-                                  &u_state);
+  if(shared)
+    epoch_retire(node);
+  else
+    cfree(node);
 }
 
-trie_t* trie_init() {
-  trie_node* node = (trie_node*)cmalloc(sizeof(trie_node));
+/* Same for a dline hanging off a trie node */
+static void dline_release(dline_t* dline, int shared) {
+  if(dline == NULL || snapshot_contains(dline))
+    return;
+  if(shared)
+    epoch_retire(dline);
+  else
+    cfree(dline);
+}
+
+/* Smallest node kind which can hold the given number of children */
+static inline unsigned short kind_for(int num_children) {
+  if(num_children <= 4)
+    return NODE_4;
+  else if(num_children <= 16)
+    return NODE_16;
+  else if(num_children <= 48)
+    return NODE_48;
+  else
+    return NODE_256;
+}
+
+static trie_node* node_alloc(unsigned short kind) {
+  trie_node* node = (trie_node*)cmalloc(node_sizes[kind]);
   if(node == NULL)
     return NULL;
-  node->terminated = NULL;
-  
-  for(int i = 0; i < 256; i++)
-    node->children[i] = NULL;
-  
-  trie_node_count++;
+  memset(node, 0, node_sizes[kind]);
+  node->kind = kind;
+
+  node_kind_count[kind]++;
+  return node;
+}
+
+/* Free a node readers have never seen */
+static void node_free(trie_node* node) {
+  node_kind_count[node->kind]--;
+  if(!snapshot_contains(node))
+    cfree(node);
+}
+
+/* Hand a node which has been unlinked from the trie over to be freed once
+ * readers are done with it. Its cache is detached and returned, and the
+ * node marked so that no reader installs a new one on it.
+ */
+static trie_cache* node_retire(trie_node* node) {
+  trie_cache* cache = __atomic_exchange_n(&node->cache, CACHE_DEAD,
+                                          __ATOMIC_SEQ_CST);
+  node_kind_count[node->kind]--;
+  if(!snapshot_contains(node))
+    epoch_retire(node);
+  return IS_CACHE_BUILDING(cache) ? NULL : cache;
+}
+
+static inline int is_real_cache(trie_cache* cache) {
+  return cache != NULL && !IS_CACHE_BUILDING(cache) && cache != CACHE_DEAD;
+}
+
+/* Returns the address of the slot holding the child for byte c, or NULL if
+ * there is no such child.
+ */
+static trie_t** find_child(trie_node* node, unsigned char c) {
+  switch(node->kind) {
+    case NODE_4: {
+      trie_node4* n = (trie_node4*)node;
+      for(int i = 0; i < node->num_children; i++) {
+        if(n->keys[i] == c)
+          return &n->children[i];
+      }
+      return NULL;
+    }
+    case NODE_16: {
+      trie_node16* n = (trie_node16*)node;
+      for(int i = 0; i < node->num_children; i++) {
+        if(n->keys[i] == c)
+          return &n->children[i];
+      }
+      return NULL;
+    }
+    case NODE_48: {
+      trie_node48* n = (trie_node48*)node;
+      unsigned char idx = READ_SHARED(n->index[c]);
+      return idx ? &n->children[idx-1] : NULL;
+    }
+    default: {
+      trie_node256* n = (trie_node256*)node;
+      return READ_SHARED(n->children[c]) != NULL ? &n->children[c] : NULL;
+    }
+  }
+}
+
+static inline trie_t* get_child(trie_node* node, unsigned char c) {
+  trie_t** slot = find_child(node, c);
+  return slot == NULL ? NULL : load_child(slot);
+}
+
+/* Start loading what seeking on through a child by the suffix at depth
+ * will read, so the misses overlap rather than each waiting on the last:
+ * for a trie node its header and wherever the next byte's entry would be
+ * for the bigger kinds (before knowing its kind), for a hash node the
+ * offsets of the bucket the suffix goes in.
+ */
+static inline void prefetch_child(trie_t* child,
+                                  string_data* string,
+                                  unsigned int depth) {
+  if(child == NULL)
+    return;
+  if(is_hash_node(child)) {
+    hash_node* node = (hash_node*)((uint64_t)child-1);
+    PREFETCH(node);
+    PREFETCH(&node->offsets[hash_idx(string, depth)]);
+    return;
+  }
+
+  PREFETCH(child);
+  if(depth < string->length) {
+    unsigned char c = (unsigned char)string->normalized[depth];
+    PREFETCH((uint64_t)child + offsetof(trie_node48, index) + c);
+    PREFETCH((uint64_t)child + offsetof(trie_node256, children) +
+             c*sizeof(trie_t*));
+  }
+}
+
+/* Finds the first child with a byte value >= from, storing it in child.
+ * Returns that byte, or -1 if there are no more children. Iterating with
+ * this visits children in byte order regardless of node kind.
+ */
+static int next_child(trie_node* node, int from, trie_t** child) {
+  switch(node->kind) {
+    case NODE_4:
+    case NODE_16: {
+      /* keys/children are at the same offsets in both small kinds */
+      unsigned char* keys = node->kind == NODE_4 ?
+        ((trie_node4*)node)->keys : ((trie_node16*)node)->keys;
+      trie_t** children = node->kind == NODE_4 ?
+        ((trie_node4*)node)->children : ((trie_node16*)node)->children;
+      for(int i = 0; i < node->num_children; i++) {
+        if(keys[i] >= from) {
+          *child = load_child(&children[i]);
+          return keys[i];
+        }
+      }
+      return -1;
+    }
+    case NODE_48: {
+      trie_node48* n = (trie_node48*)node;
+      for(int c = from; c < 256; c++) {
+        unsigned char idx = READ_SHARED(n->index[c]);
+        if(idx) {
+          *child = load_child(&n->children[idx-1]);
+          return c;
+        }
+      }
+      return -1;
+    }
+    default: {
+      trie_node256* n = (trie_node256*)node;
+      for(int c = from; c < 256; c++) {
+        trie_t* found = load_child(&n->children[c]);
+        if(found != NULL) {
+          *child = found;
+          return c;
+        }
+      }
+      return -1;
+    }
+  }
+}
+
+/* Highest score under a child, whichever kind of node it is */
+static inline unsigned int child_max_score(trie_t* child) {
+  if(is_hash_node(child))
+    return ((hash_node*)((uint64_t)child-1))->max_score;
+  return READ_SHARED(((trie_node*)child)->max_score);
+}
+
+/* Work out the highest score under a trie node from its terminated dline
+ * and its children
+ */
+static unsigned int node_max_score(trie_node* node) {
+  unsigned int max_score = dline_max_score(node_terminated(node));
+  trie_t* child;
+  for(int c = next_child(node, 0, &child); c >= 0;
+      c = next_child(node, c + 1, &child)) {
+    unsigned int child_max = child_max_score(child);
+    if(child_max > max_score)
+      max_score = child_max;
+  }
+  return max_score;
+}
+
+/* Raise a node's max_score to cover a score about to be stored under it */
+static inline void raise_max_score(trie_node* node, unsigned int score) {
+  if(node->max_score < score)
+    PUBLISH(node->max_score, score);
+}
+
+/* Insert a child into a node known to have room for it. The small kinds
+ * have to shift keys around, so are only ever inserted into before being
+ * published. NODE_48/NODE_256 publish the new child atomically.
+ */
+static void node_insert(trie_node* node, unsigned char c, trie_t* child) {
+  switch(node->kind) {
+    case NODE_4:
+    case NODE_16: {
+      unsigned char* keys = node->kind == NODE_4 ?
+        ((trie_node4*)node)->keys : ((trie_node16*)node)->keys;
+      trie_t** children = node->kind == NODE_4 ?
+        ((trie_node4*)node)->children : ((trie_node16*)node)->children;
+      int pos = 0;
+      while(pos < node->num_children && keys[pos] < c)
+        pos++;
+      /*keep keys sorted so iteration stays in byte order*/
+      memmove(&keys[pos+1], &keys[pos], node->num_children - pos);
+      memmove(&children[pos+1], &children[pos],
+              (node->num_children - pos)*sizeof(trie_t*));
+      keys[pos] = c;
+      children[pos] = child;
+      break;
+    }
+    case NODE_48: {
+      /* A free slot has never been visible to readers, the index entry
+       * pointing at it is what publishes the child
+       */
+      trie_node48* n = (trie_node48*)node;
+      int slot = 0;
+      while(n->children[slot] != NULL)
+        slot++;
+      n->children[slot] = child;
+      PUBLISH(n->index[c], (unsigned char)(slot + 1));
+      break;
+    }
+    default:
+      PUBLISH(((trie_node256*)node)->children[c], child);
+  }
+  node->num_children++;
+}
+
+/* Create a copy of a node with the given kind, with the terminated dline,
+ * cache and all children except for byte skip (-1 to keep them all). The
+ * old node is released, so the copy must replace it in its parent.
+ */
+static trie_node* node_copy(trie_node* node,
+                            unsigned short kind,
+                            int skip,
+                            int shared) {
+  trie_node* copy = node_alloc(kind);
+  if(copy == NULL)
+    return NULL;
+
+  copy->terminated = node->terminated;
+  copy->max_score = node->max_score;
 
-  return (trie_t*)node;
+  trie_t* child;
+  for(int c = next_child(node, 0, &child); c >= 0;
+      c = next_child(node, c + 1, &child)) {
+    if(c != skip)
+      node_insert(copy, (unsigned char)c, child);
+  }
+
+  if(shared)
+    copy->cache = node_retire(node);
+  else
+    node_free(node);
+  return copy;
+}
+
+/* Add a child for byte c, which must not already exist. Returns the node
+ * now holding the children, which is a new copy (of a larger kind if this
+ * one was full) unless the child can be published in place. The caller
+ * must publish a new node in place of the old one. shared is set if readers
+ * may be looking at the node. Returns NULL on allocation failure, leaving
+ * the old node untouched.
+ */
+static trie_node* node_add_child(trie_node* node,
+                                 unsigned char c,
+                                 trie_t* child,
+                                 int shared) {
+  assert(find_child(node, c) == NULL);
+
+  if(node->num_children == node_capacity[node->kind]) {
+    node = node_copy(node, node->kind + 1, -1, shared);
+  } else if(node->kind == NODE_4 || node->kind == NODE_16) {
+    node = node_copy(node, node->kind, -1, shared);
+  }
+  if(node == NULL)
+    return NULL;
+
+  node_insert(node, c, child);
+  return node;
+}
+
+/* Remove the child for byte c, which must exist. Returns the node now
+ * holding the children, which may be a new copy (smaller, if allow_shrink
+ * is set and few enough children are left) for the caller to publish.
+ * Only a NODE_256 is changed in place. Returns NULL on allocation failure,
+ * leaving the old node untouched.
+ */
+static trie_node* node_remove_child(trie_node* node,
+                                    unsigned char c,
+                                    int allow_shrink,
+                                    int shared) {
+  int shrink = allow_shrink && node->kind != NODE_4 &&
+    node->num_children - 1 <= node_shrink_at[node->kind];
+
+  if(node->kind == NODE_256 && !shrink) {
+    PUBLISH(((trie_node256*)node)->children[c], NULL);
+    node->num_children--;
+    return node;
+  }
+
+  return node_copy(node, shrink ? node->kind - 1 : node->kind, c, shared);
+}
+
+/* Creates an empty trie. The root is always a NODE_256, so that it never
+ * needs to be reallocated and the returned pointer stays valid.
+ */
+trie_t* trie_init() {
+  return (trie_t*)node_alloc(NODE_256);
+}
+
+/* Recursive helper for trie_presplit, which sizes each node for the number
+ * of children it is going to get.
+ */
+static trie_node* presplit_node(trie_node* node,
+                                unsigned char low,
+                                unsigned char high,
+                                int depth) {
+  if(node == NULL || depth <= 0)
+    return node;
+  for(int i = low; i <= high; i++) {
+    trie_node* result = presplit_node(
+      node_alloc(depth > 1 ? kind_for(high - low + 1) : NODE_4),
+      low, high, depth - 1);
+    if(result == NULL) {
+      trie_clean(node);
+      return NULL;
+    }
+    node_insert(node, (unsigned char)i, (trie_t*)result);
+  }
+  return node;
 }
 
 /* Creates a trie with trie nodes pre-created in the low to high (inclusive)
@@ -93,51 +632,674 @@ trie_t* trie_init() {
 trie_t* trie_presplit(unsigned char low,
                       unsigned char high,
                       int depth) {
-  trie_t* node = trie_init();
-  if(node == NULL || depth <= 0)
-    return node;
-  for(unsigned char i = low; i <= high; i++) {
-    trie_t* result = trie_presplit(low, high, depth - 1);
-    if(result == NULL) {
+  return (trie_t*)presplit_node((trie_node*)trie_init(), low, high, depth);
+}
+
+/* qsort comparator putting dline_sources into suffix byte order, with a
+ * suffix before any longer ones it is a prefix of
+ */
+static int bulk_suffix_cmp(const void* a, const void* b) {
+  const dline_source* s1 = (const dline_source*)a;
+  const dline_source* s2 = (const dline_source*)b;
+  int cmp = memcmp(s1->suffix, s2->suffix,
+                   s1->len < s2->len ? s1->len : s2->len);
+  if(cmp != 0)
+    return cmp;
+  return s1->len < s2->len ? -1 : s1->len > s2->len;
+}
+
+static inline unsigned int bulk_hash_idx(dline_source* source,
+                                         unsigned int depth) {
+  string_data string = {NULL, source->suffix, source->len};
+  return hash_idx(&string, depth);
+}
+
+/* Builds a hash node holding the given sources, or returns NULL with
+ * *too_big set if they wouldn't fit in one (NULL without it is a malloc
+ * failure). Whether they fit goes by their size unpacked, so that writes
+ * unpacking its dlines don't burst it straight away. Sources are bucketed
+ * and put in dline order in scratch, then each bucket's dline is written
+ * straight into the slab, packed if pack is set.
+ */
+static hash_node* bulk_hash_node(dline_source* sources,
+                                 int count,
+                                 unsigned int depth,
+                                 int pack,
+                                 int* too_big) {
+  int bucket_counts[NUM_BUCKETS + 1] = {0};
+  int bucket_starts[NUM_BUCKETS + 2];
+  uint64_t bytes = 0;
+  uint64_t empty_dline = dline_build_size(NULL, 0, 0, 0);
+  *too_big = 0;
+
+  for(int i = 0; i < count; i++)
+    bucket_counts[bulk_hash_idx(&sources[i], depth)]++;
+
+  bucket_starts[0] = 0;
+  for(int i = 0; i <= TERMINATOR_BUCKET; i++) {
+    bucket_starts[i+1] = bucket_starts[i] + bucket_counts[i];
+    if(bucket_counts[i] > 0)
+      bytes += empty_dline;
+  }
+  for(int i = 0; i < count; i++)
+    bytes += dline_build_size(&sources[i], 1, depth, 0) - empty_dline;
+
+  if(bytes >= HASH_NODE_BYTE_LIMIT) {
+    *too_big = 1;
+    return NULL;
+  }
+
+  dline_source* scratch = cmalloc(count*sizeof(dline_source));
+  if(scratch == NULL)
+    return NULL;
+
+  int placed[NUM_BUCKETS + 1] = {0};
+  for(int i = 0; i < count; i++) {
+    unsigned int idx = bulk_hash_idx(&sources[i], depth);
+    scratch[bucket_starts[idx] + placed[idx]++] = sources[i];
+  }
+
+  /*packed dlines depend on the order, so the real size comes after sorting*/
+  bytes = 0;
+  for(int i = 0; i <= TERMINATOR_BUCKET; i++) {
+    if(bucket_counts[i] == 0)
+      continue;
+    dline_source* bucket = &scratch[bucket_starts[i]];
+    qsort(bucket, bucket_counts[i], sizeof(dline_source), dline_source_cmp);
+    bytes += dline_build_size(bucket, bucket_counts[i], depth, pack);
+  }
+
+  hash_node* node = (hash_node*)cmalloc(sizeof(hash_node) + bytes);
+  if(node == NULL) {
+    cfree(scratch);
+    return NULL;
+  }
+
+  node->size = count;
+  node->bytes = bytes;
+  uint32_t offset = 0;
+  for(int i = 0; i <= TERMINATOR_BUCKET; i++) {
+    node->offsets[i] = offset;
+    if(bucket_counts[i] == 0)
+      continue;
+    dline_source* bucket = &scratch[bucket_starts[i]];
+    dline_build(bucket, bucket_counts[i], depth, pack, node->data + offset);
+    offset += dline_build_size(bucket, bucket_counts[i], depth, pack);
+  }
+  node->offsets[NUM_BUCKETS + 1] = offset;
+  assert(offset == bytes);
+  hash_node_scores(node);
+
+  cfree(scratch);
+  hash_node_count++;
+  return node;
+}
+
+/* State for collecting every entry under a node into dline_sources, to be
+ * rebuilt by the bulk builder. Each suffix is rebuilt in suffixes from the
+ * path down to where it is stored, with the bytes above the node zeroed
+ * (they are the same for every entry, so never change the order).
+ */
+typedef struct collect_state {
+  dline_source* sources;
+  char* suffixes;
+  char* path;
+  unsigned int depth;
+  unsigned int path_len;
+  int count;
+  uint64_t suffix_bytes;
+} collect_state;
+
+/* Bytes of dlines under a (sub)trie, stopping early once over limit.
+ * height is set to the most trie nodes on a path down from it.
+ */
+static uint64_t subtree_bytes(trie_t* trie,
+                              uint64_t limit,
+                              unsigned int* height) {
+  *height = 0;
+  if(is_hash_node(trie))
+    return ((hash_node*)((uint64_t)trie-1))->bytes;
+
+  trie_node* node = (trie_node*)trie;
+  uint64_t bytes = dline_size(node_terminated(node));
+  trie_t* child;
+  for(int c = next_child(node, 0, &child); c >= 0 && bytes <= limit;
+      c = next_child(node, c + 1, &child)) {
+    unsigned int child_height;
+    bytes += subtree_bytes(child, limit - bytes, &child_height);
+    if(child_height > *height)
+      *height = child_height;
+  }
+  (*height)++;
+  return bytes;
+}
+
+static void collect_iter_fn(dline_entry* entry, char* suffix, void* arg) {
+  collect_state* state = (collect_state*)arg;
+  unsigned int len = state->depth + state->path_len + entry->len;
+
+  if(state->sources != NULL) {
+    char* dest = state->suffixes + state->suffix_bytes;
+    memset(dest, 0, state->depth);
+    memcpy(dest + state->depth, state->path, state->path_len);
+    memcpy(dest + state->depth + state->path_len, suffix, entry->len);
+
+    dline_source* source = &state->sources[state->count];
+    source->id = entry->id;
+    source->score = entry->score;
+    source->len = len;
+    source->suffix = dest;
+  }
+  state->count++;
+  state->suffix_bytes += len;
+}
+
+/* Run every entry under a (sub)trie through collect_iter_fn, which just
+ * counts them if state->sources isn't set yet
+ */
+static void collect_entries(trie_t* trie, collect_state* state) {
+  if(is_hash_node(trie)) {
+    hash_node* h_node = (hash_node*)((uint64_t)trie-1);
+    for(int i = 0; i <= TERMINATOR_BUCKET; i++) {
+      if(hash_bucket(h_node, i) != NULL)
+        dline_iterate(hash_bucket(h_node, i), state, collect_iter_fn);
+    }
+    return;
+  }
+
+  trie_node* node = (trie_node*)trie;
+  if(node_terminated(node) != NULL)
+    dline_iterate(node_terminated(node), state, collect_iter_fn);
+
+  trie_t* child;
+  for(int c = next_child(node, 0, &child); c >= 0;
+      c = next_child(node, c + 1, &child)) {
+    state->path[state->path_len++] = (char)c;
+    collect_entries(child, state);
+    state->path_len--;
+  }
+}
+
+/* Collect every entry under the (sub)trie at the given depth, which has
+ * height trie nodes on its longest path, as dline_sources in bulk build
+ * order. The sources and the suffixes they point into are left in
+ * state for the caller to free.
+ */
+static op_result collect_sources(trie_t* trie,
+                                 unsigned int depth,
+                                 unsigned int height,
+                                 collect_state* state) {
+  memset(state, 0, sizeof(collect_state));
+  state->depth = depth;
+  char* path = cmalloc(height + 1);
+  if(path == NULL)
+    return MALLOC_FAIL;
+  state->path = path;
+  collect_entries(trie, state);
+
+  dline_source* sources = cmalloc((state->count + 1)*sizeof(dline_source));
+  char* suffixes = cmalloc(state->suffix_bytes + 1);
+  if(sources == NULL || suffixes == NULL) {
+    cfree(path);
+    cfree(sources);
+    cfree(suffixes);
+    return MALLOC_FAIL;
+  }
+
+  state->sources = sources;
+  state->suffixes = suffixes;
+  state->count = 0;
+  state->suffix_bytes = 0;
+  collect_entries(trie, state);
+  cfree(path);
+  state->path = NULL;
+
+  qsort(sources, state->count, sizeof(dline_source), bulk_suffix_cmp);
+  return NO_ERROR;
+}
+
+static trie_t* bulk_build_node(dline_source* sources,
+                               int count,
+                               unsigned int depth,
+                               int pack);
+
+/* Builds a trie node at the given depth over a run of sources in suffix
+ * order which all share their first depth bytes, with children built by
+ * bulk_build_node. Large dlines are packed if pack is set.
+ */
+static trie_node* bulk_trie_node(dline_source* sources,
+                                 int count,
+                                 unsigned int depth,
+                                 int pack) {
+  /* Suffixes ending here sort first, the rest come in runs by their next
+   * byte, one per child
+   */
+  int terminated = 0;
+  while(terminated < count && sources[terminated].len == depth)
+    terminated++;
+
+  int num_children = 0;
+  for(int i = terminated; i < count; i++) {
+    if(i == terminated ||
+       sources[i].suffix[depth] != sources[i-1].suffix[depth])
+      num_children++;
+  }
+
+  trie_node* node = node_alloc(depth == 0 ? NODE_256 :
+                               kind_for(num_children));
+  if(node == NULL)
+    return NULL;
+
+  if(terminated > 0) {
+    qsort(sources, terminated, sizeof(dline_source), dline_source_cmp);
+    node->terminated = cmalloc(dline_build_size(sources, terminated, depth,
+                                                pack));
+    if(node->terminated == NULL) {
+      node_free(node);
+      return NULL;
+    }
+    dline_build(sources, terminated, depth, pack, node->terminated);
+  }
+
+  int run_start = terminated;
+  while(run_start < count) {
+    int run_end = run_start + 1;
+    while(run_end < count &&
+          sources[run_end].suffix[depth] == sources[run_start].suffix[depth])
+      run_end++;
+
+    trie_t* child = bulk_build_node(&sources[run_start],
+                                    run_end - run_start,
+                                    depth + 1,
+                                    pack);
+    if(child == NULL) {
       trie_clean(node);
       return NULL;
     }
-    ((trie_node*)node)->children[i] = result;
+    node_insert(node, (unsigned char)sources[run_start].suffix[depth], child);
+    run_start = run_end;
   }
+
+  node->max_score = node_max_score(node);
   return node;
 }
 
+/* Recursive helper for trie_bulk_build over a run of sources in suffix
+ * order which all share their first depth bytes. They go in a hash node
+ * if they fit in one, otherwise a trie node.
+ */
+static trie_t* bulk_build_node(dline_source* sources,
+                               int count,
+                               unsigned int depth,
+                               int pack) {
+  if(depth > 0) {
+    int too_big;
+    hash_node* hash = bulk_hash_node(sources, count, depth, pack, &too_big);
+    if(hash != NULL)
+      return hash_node_tag(hash);
+    if(!too_big)
+      return NULL;
+  }
+  return (trie_t*)bulk_trie_node(sources, count, depth, pack);
+}
+
+/* Builds a whole trie at once from every suffix it is to hold, rather than
+ * upserting them one at a time. Every dline and hash node is written once
+ * at its exact size and nothing is ever split. The same suffix of a string
+ * must not be given twice. sources is reordered. pack packs large dlines,
+ * for a trie which will mostly be read. Returns NULL on allocation failure.
+ */
+trie_t* trie_bulk_build(dline_source* sources, int count, int pack) {
+  if(sources == NULL && count > 0)
+    return NULL;
 
+  qsort(sources, count, sizeof(dline_source), bulk_suffix_cmp);
+  return bulk_build_node(sources, count, 0, pack);
+}
+
+/* Snapshot files start with this header, the rest of the file being the
+ * nodes of the trie, each written after its children with the root last,
+ * and then the global strings and the phrase table.
+ */
+#define SNAPSHOT_MAGIC "cobb2snp"
+#define SNAPSHOT_VERSION 7
 
+typedef struct trie_snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_buckets;
+  uint64_t length; /*of the whole file*/
+  trie_t* root;
+  uint64_t* phrases;
+  uint64_t phrase_count;
+  int32_t node_kind_count[4];
+  int32_t hash_node_count;
+} trie_snapshot_header;
 
-/* Recursively free up a trie. Big TODO: this doesn't clean out the
- * relevant global pointers, hence is a leak if used for deleteing a whole
- * trie.
+/* Write a copy of the dline without its spare capacity, returning where
+ * it went, or NULL on failure. Entries refer to their strings by phrase
+ * id, which the snapshot's phrase table keeps.
+ */
+static dline_t* snapshot_dline(dline_t* dline, snapshot_writer* writer) {
+  dline_t* copy = cmalloc(dline_size(dline));
+  if(copy == NULL)
+    return NULL;
+  dline_copy(dline, copy);
+
+  dline_t* written = snapshot_append(writer, copy, dline_size(copy));
+  cfree(copy);
+  return written;
+}
+
+/* Recursively write out a (sub)trie, returning the tagged child pointer to
+ * it in the snapshot, or NULL on failure.
+ */
+static trie_t* snapshot_node(trie_t* trie,
+                             snapshot_writer* writer,
+                             trie_snapshot_header* header) {
+  if(is_hash_node(trie)) {
+    hash_node* h_node = (hash_node*)((uint64_t)trie-1);
+    header->hash_node_count++;
+    return hash_node_tag(snapshot_append(writer, h_node,
+                                         sizeof(hash_node) + h_node->bytes));
+  }
+
+  trie_node* t_node = (trie_node*)trie;
+  trie_node* copy = cmalloc(node_sizes[t_node->kind]);
+  if(copy == NULL)
+    return NULL;
+  memcpy(copy, t_node, node_sizes[t_node->kind]);
+  copy->cache = NULL;
+
+  int ok = 1;
+  if(copy->terminated != NULL) {
+    copy->terminated = snapshot_dline(node_terminated(t_node), writer);
+    ok = copy->terminated != NULL;
+  }
+
+  /* Every slot of the copy in use is rewritten in place, which keeps the
+   * keys/index of the node as they are
+   */
+  trie_t** children;
+  int slots;
+  switch(copy->kind) {
+    case NODE_4:
+      children = ((trie_node4*)copy)->children;
+      slots = copy->num_children;
+      break;
+    case NODE_16:
+      children = ((trie_node16*)copy)->children;
+      slots = copy->num_children;
+      break;
+    case NODE_48:
+      children = ((trie_node48*)copy)->children;
+      slots = 48;
+      break;
+    default:
+      children = ((trie_node256*)copy)->children;
+      slots = 256;
+  }
+  for(int i = 0; i < slots && ok; i++) {
+    if(children[i] != NULL) {
+      children[i] = snapshot_node(load_child(&children[i]), writer, header);
+      ok = children[i] != NULL;
+    }
+  }
+
+  trie_t* written = ok ?
+    snapshot_append(writer, copy, node_sizes[copy->kind]) : NULL;
+  header->node_kind_count[copy->kind]++;
+  cfree(copy);
+  return written;
+}
+
+/* Write the whole trie to a snapshot file at path, which trie_snapshot_load
+ * can map back in. The trie must not be changed while this runs, though it
+ * can be searched.
+ */
+op_result trie_snapshot_write(trie_t* trie, const char* path) {
+  if(trie == NULL || path == NULL)
+    return BAD_PARAM;
+
+  trie_snapshot_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.num_buckets = NUM_BUCKETS;
+
+  snapshot_writer* writer = snapshot_create(path, sizeof(header));
+  if(writer == NULL)
+    return MALLOC_FAIL;
+
+  header.root = snapshot_node(trie, writer, &header);
+  header.phrases = phrase_snapshot_write(writer, &header.phrase_count);
+  header.length = snapshot_written(writer);
+  op_result result = snapshot_finish(writer, &header, sizeof(header));
+  if(result == NO_ERROR && (header.root == NULL || header.phrases == NULL))
+    result = MALLOC_FAIL;
+  return result;
+}
+
+/* Map in a snapshot written by trie_snapshot_write and return the trie in
+ * it, which can be searched and changed like any other. Pages are only read
+ * in as they are used. Returns NULL if the file can't be mapped or isn't a
+ * snapshot from this build. Only one snapshot can be loaded per process.
+ */
+trie_t* trie_snapshot_load(const char* path) {
+  uint64_t length;
+  trie_snapshot_header* header = snapshot_map(path, &length);
+  if(header == NULL)
+    return NULL;
+
+  if(length < sizeof(trie_snapshot_header) ||
+     memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+     header->version != SNAPSHOT_VERSION ||
+     header->num_buckets != NUM_BUCKETS ||
+     header->length != length ||
+     phrase_snapshot_load(snapshot_resolve(header->phrases),
+                          header->phrase_count) != NO_ERROR) {
+    snapshot_unmap();
+    return NULL;
+  }
+
+  for(int i = 0; i < 4; i++)
+    node_kind_count[i] += header->node_kind_count[i];
+  hash_node_count += header->hash_node_count;
+  return snapshot_resolve(header->root);
+}
+
+/* Recursively free up a trie, which no reader can still be searching. Big
+ * TODO: this doesn't clean out the relevant global pointers, hence is a leak
+ * if used for deleteing a whole trie.
  */
 void trie_clean(trie_t* trie) {
   assert(trie != NULL);
   if(is_hash_node(trie)) {
-    hash_node* hash_ptr = (hash_node*)((uint64_t)trie-1);
-    for(int i = 0; i < NUM_BUCKETS; i++) {
-      if(hash_ptr->entries[i] != NULL)
-        cfree(hash_ptr->entries[i]);
-    }
-    cfree(hash_ptr);
-    hash_node_count--;
+    hash_node_free((hash_node*)((uint64_t)trie-1), 0);
   } else {
     trie_node* trie_ptr = (trie_node*)trie;
-    for(int i = 0; i < 256; i++) {
-      if(trie_ptr->children[i] != NULL)
-        trie_clean(trie_ptr->children[i]);
+    trie_t* child;
+    for(int c = next_child(trie_ptr, 0, &child); c >= 0;
+        c = next_child(trie_ptr, c + 1, &child)) {
+      trie_clean(child);
     }
-    if(trie_ptr->terminated != NULL)
-      cfree(trie_ptr->terminated);
-    cfree(trie);
-    trie_node_count--;
+    dline_release(node_terminated(trie_ptr), 0);
+    if(is_real_cache(trie_ptr->cache))
+      cfree(trie_ptr->cache);
+    node_free(trie_ptr);
+  }
+}
+
+/* Index of the entry for a phrase in a cache, or -1 */
+static int cache_find(trie_cache* cache, phrase_id id) {
+  for(int i = 0; i < cache->count; i++) {
+    if(cache->entries[i].id == id)
+      return i;
   }
+  return -1;
+}
+
+static void cache_delete(trie_cache* cache, int idx) {
+  memmove(&cache->entries[idx], &cache->entries[idx+1],
+          (cache->count - idx - 1)*sizeof(result_entry));
+  cache->count--;
 }
 
-/* Apply the upsert to this trie, returning the success/error
+/* Apply a new score for one suffix of a string to a cache. An entry which
+ * would sort after the last cached one is only kept if the cache is
+ * complete, since otherwise there may be uncached entries ahead of it.
+ */
+static void cache_upsert(trie_cache* cache, result_entry* entry) {
+  int idx = cache_find(cache, entry->id);
+  if(idx >= 0) {
+    if(cache->entries[idx].score == entry->score) {
+      /* Another suffix of the same string, keep the longest as searches do*/
+      if(entry->len > cache->entries[idx].len)
+        cache->entries[idx] = *entry;
+      return;
+    }
+    cache_delete(cache, idx);
+  }
+
+  int pos = 0;
+  while(pos < cache->count &&
+        (cache->entries[pos].score > entry->score ||
+         (cache->entries[pos].score == entry->score &&
+          cache->entries[pos].id > entry->id))) {
+    pos++;
+  }
+
+  if(pos == cache->count && !cache->complete)
+    return;
+  if(pos == TRIE_CACHE_SIZE) {
+    cache->complete = 0;
+    return;
+  }
+
+  if(cache->count == TRIE_CACHE_SIZE) {
+    /*the last entry falls out*/
+    cache->count--;
+    cache->complete = 0;
+  }
+  memmove(&cache->entries[pos+1], &cache->entries[pos],
+          (cache->count - pos)*sizeof(result_entry));
+  cache->entries[pos] = *entry;
+  cache->count++;
+}
+
+/* Drop a removed string from a cache. Returns 0 once an incomplete cache
+ * has lost too many entries to be useful, so that it is dropped and the
+ * next search rebuilds it.
+ */
+static int cache_remove(trie_cache* cache, global_data* global_ptr) {
+  int idx = cache_find(cache, global_ptr->id);
+  if(idx < 0)
+    return 1;
+
+  cache_delete(cache, idx);
+  return cache->complete || cache->count >= TRIE_CACHE_SIZE/2;
+}
+
+/* Apply a change to a node's cache. Readers may be using the cache, so the
+ * function is applied to a copy which then replaces it, or the cache is
+ * dropped if the function returns 0 (or the copy can't be made). A cache
+ * still being built by a reader is dropped too, since it may have missed
+ * the change.
+ */
+typedef int(cache_walk_fn)(trie_cache*, void*);
+
+static void cache_apply(trie_node* node, void* arg, cache_walk_fn function) {
+  trie_cache* cache = __atomic_load_n(&node->cache, __ATOMIC_SEQ_CST);
+  while(cache != NULL && cache != CACHE_DEAD) {
+    trie_cache* replacement = NULL;
+    if(!IS_CACHE_BUILDING(cache)) {
+      replacement = (trie_cache*)cmalloc(sizeof(trie_cache));
+      if(replacement != NULL) {
+        memcpy(replacement, cache, sizeof(trie_cache));
+        if(!function(replacement, arg)) {
+          cfree(replacement);
+          replacement = NULL;
+        }
+      }
+    }
+
+    /*on failure cache is reloaded with whatever a reader swapped in*/
+    if(__atomic_compare_exchange_n(&node->cache, &cache, replacement, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      if(!IS_CACHE_BUILDING(cache))
+        epoch_retire(cache);
+      return;
+    }
+    if(replacement != NULL)
+      cfree(replacement);
+  }
+}
+
+/* Walk down the cached levels of the trie along the given suffix, applying
+ * the function to every trie node with a cache. max_depth limits the walk
+ * to nodes above where the suffix is stored.
+ */
+static void cache_walk(trie_t* trie,
+                       string_data* string,
+                       unsigned int start,
+                       unsigned int max_depth,
+                       void* arg,
+                       cache_walk_fn function) {
+  trie_t* current_ptr = trie;
+  unsigned int depth = 0;
+
+  /* The change has been published, order that before looking for caches so
+   * that a reader starting a build afterwards is sure to see it
+   */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  while(current_ptr != NULL && !is_hash_node(current_ptr) &&
+        depth <= TRIE_CACHE_DEPTH && depth <= max_depth) {
+    cache_apply((trie_node*)current_ptr, arg, function);
+    if(start + depth >= string->length)
+      break;
+    current_ptr = get_child((trie_node*)current_ptr,
+      (unsigned char)string->normalized[start + depth]);
+    depth++;
+    prefetch_child(current_ptr, string, start + depth);
+  }
+}
+
+static int cache_upsert_fn(trie_cache* cache, void* arg) {
+  cache_upsert(cache, (result_entry*)arg);
+  return 1;
+}
+
+static int cache_remove_fn(trie_cache* cache, void* arg) {
+  return cache_remove(cache, (global_data*)arg);
+}
+
+/* Recompute max_score on the way back up the path of the suffix of string
+ * from node at depth, after a score under it may have gone down. Returns
+ * whether the node's max_score changed, since its parent can only change
+ * if it did.
+ */
+static int refresh_max_score(trie_node* node,
+                             string_data* string,
+                             unsigned int depth) {
+  if(depth < string->length) {
+    trie_t* child = get_child(node, (unsigned char)string->normalized[depth]);
+    if(child != NULL && !is_hash_node(child) &&
+       !refresh_max_score((trie_node*)child, string, depth + 1)) {
+      return 0;
+    }
+  }
+
+  unsigned int max_score = node_max_score(node);
+  if(max_score == node->max_score)
+    return 0;
+  PUBLISH(node->max_score, max_score);
+  return 1;
+}
+
+/* Apply the upsert to this trie, returning the success/error. Only one
+ * thread may be changing the trie at a time, though any number can be
+ * searching it. Anything replaced is handed to epoch_retire.
  */
 op_result trie_upsert(trie_t* existing,
                       string_data* string,
@@ -146,11 +1308,52 @@ op_result trie_upsert(trie_t* existing,
                       upsert_state* state) {
   if(existing == NULL || string == NULL || state == NULL)
     return BAD_PARAM;
-  
+
+  trie_t* root = existing;
+  unsigned int stored_at;
+  op_result result = trie_upsert_slot(&root, string, start, score, state,
+                                      &stored_at);
+  /*the root is a NODE_256 so it can't have been reallocated*/
+  assert(root == existing);
+
+  /*an update to the same score changes nothing*/
+  int changed = state->mode != UPSERT_MODE_UPDATE ||
+    (unsigned int)state->old_score != score;
+  if(result == NO_ERROR && changed) {
+    /* The entry a search would return for this suffix, with the offset
+     * and remaining length of wherever the suffix ended up being stored
+     */
+    result_entry entry = {state->global_ptr,
+                          score,
+                          string->length - stored_at,
+                          stored_at - start,
+                          state->global_ptr->id};
+    cache_walk(existing, string, start, stored_at - start, &entry,
+               cache_upsert_fn);
+  }
+  if(result == NO_ERROR && state->mode == UPSERT_MODE_UPDATE &&
+     (unsigned int)state->old_score > score) {
+    /*the old score may have been the highest on the way down*/
+    refresh_max_score((trie_node*)existing, string, start);
+  }
+  return result;
+}
+
+/* Does the work of trie_upsert on the (sub)trie held in *root, which is
+ * updated if the node there has to be reallocated. The position in the
+ * string where the stored suffix starts is set in stored_at.
+ */
+static op_result trie_upsert_slot(trie_t** root,
+                                  string_data* string,
+                                  unsigned int start,
+                                  unsigned int score,
+                                  upsert_state* state,
+                                  unsigned int* stored_at) {
   int current_start = start;
-  trie_t* current_ptr = existing;
-  trie_node* parent_ptr = NULL;
-  
+  trie_t** slot = root;
+  trie_t** parent_slot = NULL;
+  trie_t* current_ptr = *root;
+
   /* Loop down to either
    * 1) The trie node where this suffix terminates
    * 2) the hash node where this suffix goes (potentially terminating)
@@ -158,133 +1361,192 @@ op_result trie_upsert(trie_t* existing,
    */
   while(current_start < string->length && current_ptr != NULL &&
         !is_hash_node(current_ptr)) {
-    parent_ptr = (trie_node*)current_ptr;
-    current_ptr =
-      parent_ptr->children[(int)(string->normalized[current_start])];
+    raise_max_score((trie_node*)current_ptr, score);
+    parent_slot = slot;
+    slot = find_child((trie_node*)current_ptr,
+                      (unsigned char)string->normalized[current_start]);
+    current_ptr = slot == NULL ? NULL : load_child(slot);
     current_start++;
+    prefetch_child(current_ptr, string, current_start);
   }
-  
+  *stored_at = current_start;
+
   if(current_ptr != NULL && !is_hash_node(current_ptr)) {
     /*suffix terminates at this trie node*/
+    trie_node* trie_ptr = (trie_node*)current_ptr;
+    raise_max_score(trie_ptr, score);
+    dline_t* old_dline = node_terminated(trie_ptr);
     dline_t* new_dline;
-    assert(!is_hash_node(current_ptr));
-    op_result result = dline_upsert(((trie_node*)current_ptr)->terminated,
+    op_result result = dline_upsert(old_dline,
                                     &new_dline,
                                     string,
                                     current_start,
                                     score,
                                     state);
-    if(result == NO_ERROR) {
-      cfree(((trie_node*)current_ptr)->terminated);
-      ((trie_node*)current_ptr)->terminated = new_dline;
+    if(result == NO_ERROR && new_dline != old_dline) {
+      PUBLISH(trie_ptr->terminated, new_dline);
+      dline_release(old_dline, 1);
     }
-    
+
     return result;
   } else {
-    /*inserting into a hash_node, create it if it doesn't exist*/
-    hash_node* hash_ptr = (hash_node*)((uint64_t)current_ptr-1);
-    if(current_ptr == NULL) {
-      hash_ptr = (hash_node*)cmalloc(sizeof(hash_node));
-      if(hash_ptr == NULL) 
-        return MALLOC_FAIL;
-      
-      hash_node_count++;
-      hash_ptr->size = 0;
-      for(int i = 0; i < NUM_BUCKETS; i++) {
-        hash_ptr->entries[i] = NULL;
-      }
-      
-      /*set parent trie node to point to our new hash node*/
-      parent_ptr->children[(int)(string->normalized[current_start-1])] =
-        (trie_t*)((uint64_t)hash_ptr+1);
-    } else if(state->mode != UPSERT_MODE_UPDATE &&
-              hash_ptr->size >= HASH_NODE_SIZE_LIMIT) {
+    /* inserting into a hash_node, which is created below if it doesn't
+     * exist yet
+     */
+    hash_node* hash_ptr = current_ptr == NULL ? NULL :
+      (hash_node*)((uint64_t)current_ptr-1);
+    if(hash_ptr != NULL && state->mode != UPSERT_MODE_UPDATE &&
+       hash_ptr->bytes >= HASH_NODE_BYTE_LIMIT &&
+       (state->splits < SPLITS_PER_UPSERT ||
+        hash_ptr->bytes >= HASH_NODE_HARD_LIMIT)) {
       /* Time to split the current hash node into a trie node with any
        * number of hash node children.
-       * NOTE: since we do this before a dline_upsert call, its possible
-       * that an update causes a split, because before the first suffix's
-       * upsert the state->mode will still be INITIAL at this point.
-       * TODO1: this is pretty inefficient, because we know in advance we
-       * will be doing large numbers of inserts, thus a dline in a single
-       * hash child will likely (but not necessarily, depending on
-       * distribution), get multiple inserts, so a continual doubling-style
-       * allocation is probably more appropriate than doing a perfect fit
-       * malloc on every dline_upsert call here.
-       * TODO2: we also probably will want to have the ability to limit the
-       * number of splits done in a whole insert to some fixed number, most
-       * likely 1, in order to avoid a slow worst case insert which happens
-       * to be unlucky enough to have to split multiple hash nodes.
+       * The new subtree is put together by the bulk builder from the
+       * entries in their final order, so every dline and hash node in it
+       * is written once at its exact size. Only SPLITS_PER_UPSERT splits
+       * are done for a whole string, other full nodes it goes into just
+       * keep growing until an upsert with splits to spare comes along, so
+       * no one upsert pays for more than one.
        */
-      trie_node* trie_ptr = (trie_node*)trie_init();
-      split_state spl_state = {trie_ptr, NO_ERROR};
-      
-      if(trie_ptr == NULL)
+      collect_state collected;
+      op_result result = collect_sources(current_ptr, current_start, 0,
+                                         &collected);
+      if(result != NO_ERROR)
+        return result;
+      /*the subtree is being written to, so don't pack it*/
+      trie_node* split = bulk_trie_node(collected.sources, collected.count,
+                                        current_start, 0);
+      cfree(collected.sources);
+      cfree(collected.suffixes);
+      if(split == NULL)
         return MALLOC_FAIL;
-      
-      /* Loop over hash entries and re-insert into a new trie node */
-      for(int i = 0; i < NUM_BUCKETS && spl_state.result == NO_ERROR; i++) {
-        if(hash_ptr->entries[i] != NULL) {
-          dline_iterate(hash_ptr->entries[i], &spl_state,
-                        split_dline_iter_fn);
-        }
-      }
-      
-      if(spl_state.result != NO_ERROR) {
-        trie_clean(trie_ptr);
-        return spl_state.result;
-      }
-      
-      /*set parent trie node to point to our newly split trie node*/
-      parent_ptr->children[(int)(string->normalized[current_start-1])] =
-        (trie_t*)trie_ptr;
-      
-      /*recursively free up the old hash node*/
-      trie_clean(current_ptr);
-      
+      state->splits++;
+
+      /*nobody else can see the new subtree until it is published here*/
+      PUBLISH(*slot, (trie_t*)split);
+
+      /*dlines live inside the hash node, so this frees the lot*/
+      hash_node_free(hash_ptr, 1);
+
       /* Now do the actual upsert we came here to do, which may not still
        * insert onto a hash node (could have terminated at the hash node,
        * so it will now terminate at the newly split trie node)
        */
-      return trie_upsert((trie_t*)trie_ptr,
-                         string,
-                         current_start,
-                         score,
-                         state);
-    }
-    
-    /* If terminating, just hash to bucket 0. A terminating search
-     * on this node will search across all buckets anyways, so it doesn't
-     * particularly matter. However, it does mean searches on that bucket
-     * for other prefixes may seek across unecessary terminating entries, so
-     * it might be better to move those to a separate bucket.
-     */
-    uint64_t idx;
-    if(current_start == string->length) {
-      idx = 0;
-    } else {
-      idx = hash_idx(string->normalized[current_start]);
+      return trie_upsert_slot(slot,
+                              string,
+                              current_start,
+                              score,
+                              state,
+                              stored_at);
     }
-    
+
+    unsigned int idx = hash_idx(string, current_start);
+    dline_t* old_dline = hash_ptr == NULL ? NULL : hash_bucket(hash_ptr, idx);
+
     dline_t* new_dline;
-    op_result result = dline_upsert(hash_ptr->entries[idx],
+    op_result result = dline_upsert(old_dline,
                                     &new_dline,
                                     string,
                                     current_start,
                                     score,
                                     state);
-    if(result == NO_ERROR) {
-      cfree(hash_ptr->entries[idx]);
-      hash_ptr->entries[idx] = new_dline;
-      
-      if(state->mode != UPSERT_MODE_UPDATE)
-        hash_ptr->size++;
+    if(result != NO_ERROR || new_dline == old_dline)
+      return result;
+
+    /* Rebuild the node around the new bucket, then swap it in for the old
+     * one (or add it to the parent, which may grow it into a larger kind)
+     */
+    hash_node* new_hash = hash_node_replace(hash_ptr, idx, new_dline,
+      state->mode != UPSERT_MODE_UPDATE ? 1 : 0);
+    cfree(new_dline);
+    if(new_hash == NULL)
+      return MALLOC_FAIL;
+
+    if(hash_ptr != NULL) {
+      PUBLISH(*slot, hash_node_tag(new_hash));
+      hash_node_free(hash_ptr, 1);
+    } else {
+      trie_node* old_parent = (trie_node*)load_child(parent_slot);
+      trie_node* parent = node_add_child(
+        old_parent,
+        (unsigned char)string->normalized[current_start-1],
+        hash_node_tag(new_hash),
+        1);
+      if(parent == NULL) {
+        hash_node_free(new_hash, 0);
+        return MALLOC_FAIL;
+      }
+      if(parent != old_parent)
+        PUBLISH(*parent_slot, (trie_t*)parent);
     }
-    return result;
+    return NO_ERROR;
+  }
+}
+
+/* Retire everything in a subtree which has been unlinked from the trie */
+static void subtree_retire(trie_t* trie) {
+  if(is_hash_node(trie)) {
+    hash_node_free((hash_node*)((uint64_t)trie-1), 1);
+    return;
+  }
+
+  trie_node* node = (trie_node*)trie;
+  trie_t* child;
+  for(int c = next_child(node, 0, &child); c >= 0;
+      c = next_child(node, c + 1, &child)) {
+    subtree_retire(child);
+  }
+  dline_release(node_terminated(node), 1);
+  trie_cache* cache = node_retire(node);
+  if(is_real_cache(cache))
+    epoch_retire(cache);
+}
+
+/* After a removal, shrink the trie node at *slot (reached from the trie
+ * node at *parent_slot by byte c, at the given depth) back into a hash
+ * node if its subtree has got small enough, or drop it from its parent if
+ * it is empty. This only ever looks at one node, so a subtree shrinks one
+ * level at a time as removals go past it. A failure to allocate just
+ * leaves the node as it is.
+ */
+static void collapse_node(trie_t** slot,
+                          trie_t** parent_slot,
+                          unsigned char c,
+                          unsigned int depth,
+                          int parent_is_root) {
+  trie_t* trie = load_child(slot);
+  unsigned int height;
+  uint64_t bytes = subtree_bytes(trie, COLLAPSE_BYTE_LIMIT, &height);
+  if(bytes > COLLAPSE_BYTE_LIMIT)
+    return;
+
+  if(bytes == 0) {
+    trie_node* old_parent = (trie_node*)load_child(parent_slot);
+    trie_node* parent = node_remove_child(old_parent, c, !parent_is_root, 1);
+    if(parent == NULL)
+      return;
+    if(parent != old_parent)
+      PUBLISH(*parent_slot, (trie_t*)parent);
+  } else {
+    collect_state collected;
+    if(collect_sources(trie, depth, height, &collected) != NO_ERROR)
+      return;
+    int too_big;
+    hash_node* collapsed = bulk_hash_node(collected.sources, collected.count,
+                                          depth, 0, &too_big);
+    cfree(collected.sources);
+    cfree(collected.suffixes);
+    if(collapsed == NULL)
+      return;
+    PUBLISH(*slot, hash_node_tag(collapsed));
   }
+  subtree_retire(trie);
 }
 
- /* Delete from this trie, returning success/error. Caller must free the
-  * global_pointer in state after the last suffix removal
+ /* Delete from this trie, returning success/error. Caller must retire the
+  * global_pointer in state after the last suffix removal, and should remove
+  * every suffix of the string (caches only track the string as a whole).
+  * Like trie_upsert, this can run alongside searches but not other writes.
   */
 op_result trie_remove(trie_t* existing,
                       string_data* string,
@@ -292,330 +1554,1127 @@ op_result trie_remove(trie_t* existing,
                       remove_state* state) {
   if(existing == NULL || string == NULL || state == NULL)
     return BAD_PARAM;
-  
+
+  op_result result = trie_remove_entry(existing, string, start, state);
+  if(result == NO_ERROR) {
+    refresh_max_score((trie_node*)existing, string, start);
+    cache_walk(existing, string, start, string->length - start,
+               state->global_ptr, cache_remove_fn);
+  }
+  return result;
+}
+
+/* Does the work of trie_remove. Hash nodes left empty are dropped, which
+ * may shrink their parent trie node, and the trie node removed from is
+ * collapsed back into a hash node if it has got small enough.
+ */
+static op_result trie_remove_entry(trie_t* existing,
+                                   string_data* string,
+                                   unsigned int start,
+                                   remove_state* state) {
   int current_start = start;
+  trie_t* root = existing;
+  trie_t** slot = &root;
+  trie_t** parent_slot = NULL;
+  trie_t** grandparent_slot = NULL;
   trie_t* current_ptr = existing;
-  
+
   /*seek to the node we will remove from*/
   while(current_start < string->length && current_ptr != NULL &&
         !is_hash_node(current_ptr)) {
-    current_ptr = ((trie_node*)current_ptr)->children[
-      (int)(string->normalized[current_start])];
+    grandparent_slot = parent_slot;
+    parent_slot = slot;
+    slot = find_child((trie_node*)current_ptr,
+                      (unsigned char)string->normalized[current_start]);
+    current_ptr = slot == NULL ? NULL : load_child(slot);
     current_start++;
+    prefetch_child(current_ptr, string, current_start);
   }
-  
+
   if(current_ptr == NULL) {
     return NOT_FOUND;
   } else if(!is_hash_node(current_ptr)) {
     /*suffix terminates at this trie node, delete from its terminated dline
      */
+    trie_node* trie_ptr = (trie_node*)current_ptr;
+    dline_t* old_dline = node_terminated(trie_ptr);
     dline_t* new_dline;
 
-    op_result result = dline_remove(((trie_node*)current_ptr)->terminated,
+    op_result result = dline_remove(old_dline,
                                     &new_dline,
                                     string,
                                     current_start,
                                     state);
     if(result == NO_ERROR) {
-      cfree(((trie_node*)current_ptr)->terminated);
-      ((trie_node*)current_ptr)->terminated = new_dline;
+      PUBLISH(trie_ptr->terminated, new_dline);
+      dline_release(old_dline, 1);
+      if(slot != &root) {
+        collapse_node(slot, parent_slot,
+                      (unsigned char)string->normalized[current_start-1],
+                      current_start, parent_slot == &root);
+      }
     }
-    
+
     return result;
   } else {
-    /* Deleting from a hash_node. Note: we don't delete the hash_node
-     * if it is empty, which could be optimized
-     */
+    /* Deleting from a hash_node. */
     hash_node* hash_ptr = (hash_node*)((uint64_t)current_ptr-1);
-    
-    uint64_t idx;
-    if(current_start == string->length) {
-      idx = 0;
-    } else {
-      idx = hash_idx(string->normalized[current_start]);
-    }
-    
+    unsigned int idx = hash_idx(string, current_start);
+
+    if(hash_bucket(hash_ptr, idx) == NULL)
+      return NOT_FOUND;
+
     dline_t* new_dline;
-    op_result result = dline_remove(hash_ptr->entries[idx],
+    op_result result = dline_remove(hash_bucket(hash_ptr, idx),
                                     &new_dline,
                                     string,
                                     current_start,
                                     state);
-    if(result == NO_ERROR) {
-      cfree(hash_ptr->entries[idx]);
-      hash_ptr->entries[idx] = new_dline;
-      hash_ptr->size--;
+    if(result != NO_ERROR)
+      return result;
+
+    if(hash_ptr->size == 1) {
+      /* Drop the now empty hash node from its parent, letting the parent
+       * shrink unless it is the root (which has to stay put).
+       */
+      trie_node* old_parent = (trie_node*)load_child(parent_slot);
+      trie_node* parent = node_remove_child(
+        old_parent,
+        (unsigned char)string->normalized[current_start-1],
+        parent_slot != &root,
+        1);
+      if(parent == NULL) {
+        cfree(new_dline);
+        return MALLOC_FAIL;
+      }
+      if(parent != old_parent)
+        PUBLISH(*parent_slot, (trie_t*)parent);
+    } else {
+      hash_node* new_hash = hash_node_replace(hash_ptr, idx, new_dline, -1);
+      if(new_hash == NULL) {
+        cfree(new_dline);
+        return MALLOC_FAIL;
+      }
+      PUBLISH(*slot, hash_node_tag(new_hash));
     }
-    return result;
+
+    cfree(new_dline);
+    hash_node_free(hash_ptr, 1);
+
+    /*the trie node above may now be small enough to collapse*/
+    if(parent_slot != &root) {
+      collapse_node(parent_slot, grandparent_slot,
+                    (unsigned char)string->normalized[current_start-2],
+                    current_start-1, grandparent_slot == &root);
+    }
+    return NO_ERROR;
+  }
+}
+
+/* Fan out searches, which fill node caches, merge the sorted streams of
+ * results under a node k ways in a loser tree (tournament tree). Each
+ * internal node of the tree holds the leaf which lost the match played
+ * there, with the overall winner in losers[0], so that once the winner
+ * moves on to its next result only the matches on its path to the root are
+ * played again. Leaves start out as just a bound on their best result, and
+ * are only opened once that bound wins, so streams which can't make the
+ * results are never looked at. The results go straight into the caller's
+ * array.
+ */
+enum merge_kind {
+  MERGE_DONE = 0, /*nothing left*/
+  MERGE_DLINE_BOUND = 1, /*dline not opened yet*/
+  MERGE_TRIE_BOUND = 2, /*subtree not searched yet*/
+  MERGE_DLINE = 3, /*dline being walked for matches*/
+  MERGE_ARRAY = 4 /*results being taken in order*/
+};
+
+/* Bounds get an id higher than any phrase's, like search_key */
+#define MERGE_BOUND UINT64_MAX
+
+typedef struct merge_leaf {
+  unsigned short kind;
+  unsigned short owned; /*whether entries were allocated with cmalloc*/
+  unsigned int depth;
+  uint64_t id; /*of head, or MERGE_BOUND*/
+  void* source; /*dline or subtree while a bound*/
+  result_entry* entries;
+  int count;
+  int next;
+  dline_cursor cursor;
+  result_entry head; /*only the score is set for a bound*/
+} merge_leaf;
+
+typedef struct merge_tree {
+  merge_leaf* leaves;
+  int* losers;
+  int num_leaves;
+  string_data* string;
+  unsigned int min_score;
+  arena* scratch; /*what opened subtrees are searched into, or NULL*/
+} merge_tree;
+
+static int trie_fan_search(trie_t* trie,
+                           string_data* string,
+                           unsigned int start,
+                           unsigned int min_score,
+                           result_entry* results,
+                           int results_len,
+                           arena* scratch);
+
+/* Ordered the same way as results, with finished leaves last */
+static inline int merge_before(merge_leaf* a, merge_leaf* b) {
+  if(a->kind == MERGE_DONE)
+    return 0;
+  if(b->kind == MERGE_DONE)
+    return 1;
+  return a->head.score > b->head.score ||
+    (a->head.score == b->head.score && a->id > b->id);
+}
+
+static merge_leaf* merge_add(merge_tree* tree,
+                             unsigned short kind,
+                             void* source,
+                             unsigned int depth,
+                             unsigned int bound) {
+  merge_leaf* leaf = &tree->leaves[tree->num_leaves++];
+  leaf->kind = kind;
+  leaf->owned = 0;
+  leaf->depth = depth;
+  leaf->id = MERGE_BOUND;
+  leaf->source = source;
+  leaf->head.score = bound;
+  return leaf;
+}
+
+/* Play the matches under an internal node, returning the winning leaf.
+ * Leaves sit after the n-1 internal nodes, numbered from n.
+ */
+static int merge_play(merge_tree* tree, int node) {
+  if(node >= tree->num_leaves)
+    return node - tree->num_leaves;
+  int a = merge_play(tree, 2*node);
+  int b = merge_play(tree, 2*node + 1);
+  if(merge_before(&tree->leaves[b], &tree->leaves[a])) {
+    tree->losers[node] = a;
+    return b;
   }
+  tree->losers[node] = b;
+  return a;
 }
 
-static inline void copy_entry(result_entry* restrict dest,
-                              result_entry* restrict src) {
-  memcpy(dest, src, sizeof(result_entry));
+/* Play the matches from a leaf up to the root again, after it changed */
+static void merge_replay(merge_tree* tree, int winner) {
+  for(int node = (winner + tree->num_leaves)/2; node > 0; node /= 2) {
+    if(merge_before(&tree->leaves[tree->losers[node]],
+                    &tree->leaves[winner])) {
+      int loser = winner;
+      winner = tree->losers[node];
+      tree->losers[node] = loser;
+    }
+  }
+  tree->losers[0] = winner;
 }
 
-/* Merge 2 sorted dline result lists, returning the number stored in dest.
+/* Move a leaf on to its next result, opening it first if it is a bound.
+ * A subtree is searched for the wanted top results when opened. Returns 0
+ * if that fails.
  */
-static int merge(result_entry* restrict s1,
-                 int s1_num,
-                 result_entry* restrict s2,
-                 int s2_num,
-                 result_entry* restrict dest,
-                 int dest_len) {
-  assert(s1 != NULL && s2 != NULL && dest != NULL);
-  
-  uint64_t s1_idx = 0, s2_idx = 0, dest_idx = 0;
-  
-  while(dest_idx < dest_len && s1_idx < s1_num && s2_idx < s2_num) {
-    if(s1[s1_idx].score > s2[s2_idx].score ||
-       (s1[s1_idx].score == s2[s2_idx].score &&
-        (uint64_t)s1[s1_idx].global_ptr > (uint64_t)s2[s2_idx].global_ptr)) {
-      copy_entry(&dest[dest_idx], &s1[s1_idx]);
-      dest_idx++;
-      s1_idx++;
-    } else if(s2[s2_idx].score > s1[s1_idx].score ||
-              (s2[s2_idx].score == s1[s1_idx].score &&
-               ((uint64_t)s2[s2_idx].global_ptr >
-                 (uint64_t)s1[s1_idx].global_ptr))) {
-      copy_entry(&dest[dest_idx], &s2[s2_idx]);
-      dest_idx++;
-      s2_idx++;
+static int merge_advance(merge_tree* tree, merge_leaf* leaf, int wanted) {
+  if(leaf->kind == MERGE_TRIE_BOUND) {
+    if(tree->scratch != NULL) {
+      leaf->entries = arena_alloc(tree->scratch,
+                                  wanted*sizeof(result_entry));
     } else {
-      /* s1.score=s2.score and s1.global_ptr=s2.global_ptr, so these are 2
-       * different suffixes for the same entry. Save the result with the
-       * longer length (ie, whose suffix starts earlier in the string)
-       */
-      if(s1[s1_idx].len > s2[s2_idx].len) {
-        copy_entry(&dest[dest_idx], &s1[s1_idx]);
-      } else {
-        copy_entry(&dest[dest_idx], &s2[s2_idx]);
-      }
-      dest_idx++;
-      s1_idx++;
-      s2_idx++;
+      leaf->entries = cmalloc(wanted*sizeof(result_entry));
+      leaf->owned = 1;
     }
+    if(leaf->entries == NULL)
+      return 0;
+    leaf->count = trie_fan_search(leaf->source, tree->string, leaf->depth,
+                                  tree->min_score, leaf->entries, wanted,
+                                  tree->scratch);
+    if(leaf->count < 0)
+      return 0;
+    leaf->next = 0;
+    leaf->kind = MERGE_ARRAY;
+  } else if(leaf->kind == MERGE_DLINE_BOUND) {
+    dline_cursor_init(&leaf->cursor, leaf->source, tree->string,
+                      leaf->depth);
+    leaf->kind = MERGE_DLINE;
   }
-  
-  /* If dest isn't full, check to see if one of the sources has extra
-   * entries to copy
-   */
-  if(dest_idx < dest_len) {
-    if(s1_idx < s1_num) {
-      uint64_t smaller = MIN(dest_len-dest_idx,s1_num-s1_idx);
-      memcpy(&dest[dest_idx], &s1[s1_idx],
-             smaller*sizeof(result_entry));
-      dest_idx += smaller;
-    } else if (s2_idx < s2_num) {
-      uint64_t smaller = MIN(dest_len-dest_idx,s2_num-s2_idx);
-      memcpy(&dest[dest_idx], &s2[s2_idx],
-             smaller*sizeof(result_entry));
-      dest_idx += smaller;
+
+  if(leaf->kind == MERGE_DLINE &&
+     dline_cursor_next(&leaf->cursor, tree->min_score, &leaf->head)) {
+    leaf->id = leaf->head.id;
+  } else if(leaf->kind == MERGE_ARRAY && leaf->next < leaf->count &&
+            leaf->entries[leaf->next].score >= tree->min_score) {
+    leaf->head = leaf->entries[leaf->next++];
+    leaf->id = leaf->head.id;
+  } else {
+    leaf->kind = MERGE_DONE;
+  }
+  return 1;
+}
+
+/* Merge every leaf of a tree into results, storing at most results_len.
+ * Suffixes of the same string come out next to each other, and only the
+ * longest is kept, as in search_emit. Returns the number stored, or -1 if
+ * a leaf couldn't be opened.
+ */
+static int merge_run(merge_tree* tree, result_entry* results, int results_len) {
+  int count = 0;
+  int ok = 1;
+
+  if(tree->num_leaves == 0 || results_len <= 0)
+    return 0;
+  tree->losers[0] = merge_play(tree, 1);
+  for(;;) {
+    int winner = tree->losers[0];
+    merge_leaf* leaf = &tree->leaves[winner];
+    result_entry* last = count > 0 ? &results[count-1] : NULL;
+    if(leaf->kind == MERGE_DONE)
+      break;
+    /*once full, only another suffix of the last string can matter*/
+    if(count == results_len &&
+       (leaf->head.score < last->score ||
+        (leaf->head.score == last->score && leaf->id < last->id))) {
+      break;
     }
+
+    if(leaf->id == MERGE_BOUND) {
+      /*room for what's left, plus a suffix of the last string*/
+      int wanted = count > 0 ? results_len - count + 1 : results_len;
+      ok = merge_advance(tree, leaf, wanted);
+      if(!ok)
+        break;
+      merge_replay(tree, winner);
+      continue;
+    }
+
+    if(last != NULL && last->id == leaf->head.id &&
+       last->score == leaf->head.score) {
+      if(leaf->head.len > last->len)
+        *last = leaf->head;
+    } else {
+      results[count++] = leaf->head;
+    }
+    merge_advance(tree, leaf, 0);
+    merge_replay(tree, winner);
   }
-  
-  return dest_idx;
+
+  for(int i = 0; i < tree->num_leaves; i++) {
+    if(tree->leaves[i].owned)
+      cfree(tree->leaves[i].entries);
+  }
+  return ok ? count : -1;
 }
 
 /* Search the given hash node for suffixes starting with the given prefix.
- * Stores at most results_len results in to, returning the number stored.
+ * Stores at most results_len results, returning the number stored.
  */
 static int hash_node_search(hash_node* node,
                             string_data* string,
                             unsigned int start,
                             unsigned int min_score,
-                            result_entry* from,
-                            result_entry* to,
-                            result_entry* spare,
-                            int from_size,
+                            result_entry* results,
                             int results_len) {
-  assert(node != NULL && string != NULL && from != NULL && to != NULL
-         && spare != NULL);
+  assert(node != NULL && string != NULL && results != NULL);
   
-  /* If there are any unmatched bytes, just search on the line the next byte
-   * hashes to.
+  /* If there are at least 2 unmatched bytes, just search on the line they
+   * hash to.
    */
-  if(start < string->length) {
-    uint64_t idx = hash_idx(string->normalized[start]);
-    
-    int build_size = dline_search(node->entries[idx],
-                                  string,
-                                  start,
-                                  min_score,
-                                  spare,
-                                  results_len);
-    return merge(from, from_size,
-                 spare, build_size,
-                 to, results_len);
+  if(start + 1 < string->length) {
+    return dline_search(hash_bucket(node, hash_idx(string, start)),
+                        string,
+                        start,
+                        min_score,
+                        results,
+                        results_len);
   }
   
-  /* Otherwise, prefix terminates at this node, so search across all lines.
-   * We alternate which buffer dline_search holds the results so far,
-   * and then merge with the results from dline_search into the other buffer
+  /* With a single unmatched byte, merge the lines in its group. Otherwise
+   * the prefix terminates at this node, so merge across all lines.
    */
-  result_entry* built = from;
-  int built_size = from_size;
-  
-  for(int i = 0; i < NUM_BUCKETS; i++) {
-    /*for each bucket, get results & merge*/
-    if(node->entries[i] != NULL) {
-      int to_size = dline_search(node->entries[i],
-                                 string,
-                                 start,
-                                 min_score,
-                                 to,
-                                 results_len);
-
-      if(to_size > 0) {
-        if(built == spare) {
-          built_size = merge(to, to_size,
-                             built, built_size,
-                             from, results_len);
-          built = from;
-        } else {
-          built_size = merge(to, to_size,
-                            built, built_size,
-                            spare, results_len);
-          built = spare;
-        }
+  unsigned int first_bucket = 0, last_bucket = TERMINATOR_BUCKET;
+  if(start < string->length) {
+    first_bucket = hash_group(string->normalized[start])*HASH_GROUP_SIZE;
+    last_bucket = first_bucket + HASH_GROUP_SIZE - 1;
+  }
 
-        if(built_size == results_len) {
-          min_score = built[built_size-1].score;
-        }
+  merge_leaf leaves[TERMINATOR_BUCKET + 1];
+  int losers[TERMINATOR_BUCKET + 1];
+  merge_tree tree = {leaves, losers, 0, string, min_score, NULL};
+  for(unsigned int i = first_bucket; i <= last_bucket; i++) {
+    if(hash_bucket(node, i) != NULL && node->bucket_max[i] >= min_score) {
+      merge_add(&tree, MERGE_DLINE_BOUND, hash_bucket(node, i), start,
+                node->bucket_max[i]);
+    }
+  }
+  return merge_run(&tree, results, results_len);
+}
+
+/* Fan out over a trie node: merge its terminators with every child,
+ * ignoring the node's cache. The buckets of hash node children are merged
+ * in directly, while trie node children are each searched in turn once
+ * their bound wins. Returns -1 if working space runs out.
+ */
+static int trie_node_fan_search(trie_node* t_node,
+                                string_data* string,
+                                unsigned int start,
+                                unsigned int min_score,
+                                result_entry* results,
+                                int results_len,
+                                arena* scratch) {
+  /* Counting the leaves only needs the child pointers, so the children
+   * themselves are loaded in the meantime: for a hash child that's all of
+   * its bucket offsets and bounds, which are read next
+   */
+  trie_t* child;
+  int num_leaves = 1;
+  for(int c = next_child(t_node, 0, &child); c >= 0;
+      c = next_child(t_node, c + 1, &child)) {
+    if(is_hash_node(child)) {
+      for(size_t i = 0; i < offsetof(hash_node, data); i += CACHE_LINE)
+        PREFETCH((uint64_t)child - 1 + i);
+      num_leaves += TERMINATOR_BUCKET + 1;
+    } else {
+      PREFETCH(child);
+      num_leaves++;
+    }
+  }
+
+  size_t size = num_leaves*(sizeof(merge_leaf) + sizeof(int));
+  merge_leaf* leaves = scratch != NULL ? arena_alloc(scratch, size) :
+    cmalloc(size);
+  if(leaves == NULL)
+    return -1;
+  merge_tree tree = {leaves, (int*)&leaves[num_leaves], 0, string,
+                     min_score, scratch};
+
+  dline_t* terminated = node_terminated(t_node);
+  if(terminated != NULL && dline_max_score(terminated) >= min_score) {
+    merge_add(&tree, MERGE_DLINE_BOUND, terminated, start,
+              dline_max_score(terminated));
+  }
+  for(int c = next_child(t_node, 0, &child); c >= 0;
+      c = next_child(t_node, c + 1, &child)) {
+    if(child_max_score(child) < min_score)
+      continue;
+    if(!is_hash_node(child)) {
+      merge_add(&tree, MERGE_TRIE_BOUND, child, start + 1,
+                child_max_score(child));
+      continue;
+    }
+    hash_node* node = (hash_node*)((uint64_t)child-1);
+    for(int i = 0; i <= TERMINATOR_BUCKET; i++) {
+      if(hash_bucket(node, i) != NULL && node->bucket_max[i] >= min_score) {
+        merge_add(&tree, MERGE_DLINE_BOUND, hash_bucket(node, i), start + 1,
+                  node->bucket_max[i]);
       }
     }
   }
-  
-  /* This could be slightly optimized by writing to one of the buffers,
-   * giving a 50% chance we don't have to do this copy. Or alternatively,
-   * just rewriting which pointer has the results (or something of the sort)
+
+  int count = merge_run(&tree, results, results_len);
+  if(scratch == NULL)
+    cfree(leaves);
+  return count;
+}
+
+/* Get a cache for the node at the given depth able to serve results_len
+ * results, building one if the node has none or it has been depleted.
+ * Returns NULL if the node can't be cached, another thread is building
+ * its cache, or we fail to build one. Building takes its working space
+ * from scratch if given.
+ */
+static trie_cache* trie_node_cache(trie_node* t_node,
+                                   string_data* string,
+                                   unsigned int depth,
+                                   int results_len,
+                                   arena* scratch) {
+  if(depth > TRIE_CACHE_DEPTH || results_len > TRIE_CACHE_SIZE)
+    return NULL;
+
+  trie_cache* cache = READ_SHARED(t_node->cache);
+  if(cache == CACHE_DEAD || IS_CACHE_BUILDING(cache))
+    return NULL;
+  if(cache != NULL && (cache->complete || cache->count >= results_len))
+    return cache;
+
+  trie_cache* built = (trie_cache*)cmalloc(sizeof(trie_cache));
+  if(built == NULL)
+    return NULL;
+
+  /* Claim the node, replacing any depleted cache. A writer changing the
+   * subtree from here on drops the marker, so the finished cache is only
+   * installed if nothing changed while it was being built.
    */
-  memcpy(to, built, built_size*sizeof(result_entry));
-  return built_size;
+  if(!__atomic_compare_exchange_n(&t_node->cache, &cache,
+                                  CACHE_BUILDING(built), 0,
+                                  __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    cfree(built);
+    return NULL;
+  }
+  if(cache != NULL)
+    epoch_retire(cache);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  built->count = trie_node_fan_search(t_node,
+                                      string,
+                                      depth,
+                                      MIN_SCORE,
+                                      built->entries,
+                                      TRIE_CACHE_SIZE,
+                                      scratch);
+  built->complete = built->count < TRIE_CACHE_SIZE;
+
+  /*a failed build gives the node back, to be tried again later*/
+  cache = CACHE_BUILDING(built);
+  if(!__atomic_compare_exchange_n(&t_node->cache, &cache,
+                                  built->count < 0 ? NULL : built, 0,
+                                  __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ||
+     built->count < 0) {
+    cfree(built);
+    return NULL;
+  }
+  return built;
 }
 
-/* Internal recursive trie search from the first node which could not
- * be seeked down further, meaning either
+/* Depth first fan out over everything under a node below the prefix,
+ * which is how node caches get filled. Used from the first node which
+ * could not be seeked down further, meaning either
  * 1) The node is a hash node
  * 2) The node is a trie node either at *or below* where the string ends,
  * and thus all entries must be recursively returned.
+ * Returns -1 if working space runs out.
  */
 static int trie_fan_search(trie_t* trie,
                            string_data* string,
                            unsigned int start,
                            unsigned int min_score,
-                           result_entry* from,
-                           result_entry* to,
-                           result_entry* spare,
-                           int from_size,
-                           int results_len) {
-  assert(trie != NULL && string != NULL && from != NULL && to != NULL
-         && spare != NULL);
+                           result_entry* results,
+                           int results_len,
+                           arena* scratch) {
+  assert(trie != NULL && string != NULL && results != NULL);
   if(is_hash_node(trie)) {
     return hash_node_search((hash_node*)((uint64_t)trie-1),
                             string,
                             start,
                             min_score,
-                            from,
-                            to,
-                            spare,
-                            from_size,
+                            results,
                             results_len);
+  }
+
+  /* Since searches start at the root, start is the node's depth, and
+   * the whole prefix has been matched by now
+   */
+  trie_node* t_node = (trie_node*)trie;
+  trie_cache* cache = trie_node_cache(t_node, string, start, results_len,
+                                      scratch);
+  if(cache != NULL) {
+    int cached = 0;
+    while(cached < cache->count && cached < results_len &&
+          cache->entries[cached].score >= min_score) {
+      cached++;
+    }
+    memcpy(results, cache->entries, cached*sizeof(result_entry));
+    return cached;
+  }
+
+  return trie_node_fan_search(t_node,
+                              string,
+                              start,
+                              min_score,
+                              results,
+                              results_len,
+                              scratch);
+}
+
+/* Best-first search. Rather than fanning out over everything below the
+ * prefix in byte order, work still to be done is kept in a max heap
+ * ordered by the best result it could give: unopened trie and hash nodes
+ * and dlines by their highest score, and dlines and caches being walked by
+ * their next match. Results then come off the heap in order, so the search
+ * ends as soon as the last one wanted is settled, having only opened what
+ * could beat it.
+ */
+enum search_kind {
+  SEARCH_NODE = 0, /*trie or hash node not opened yet*/
+  SEARCH_BUCKETS = 1, /*buckets of a hash node still to be opened*/
+  SEARCH_DLINE = 2, /*dline being walked for matches*/
+  SEARCH_CACHE = 3 /*trie node cache being walked*/
+};
+
+typedef struct search_item {
+  unsigned short kind;
+  unsigned short matched; /*whether result holds the next match yet*/
+  unsigned short started; /*whether cursor has been set up*/
+  unsigned int depth;
+  void* source; /*the node, dline or cache*/
+  int next; /*bucket to open or cache entry to take next*/
+  dline_cursor cursor;
+  result_entry result;
+} search_item;
+
+/* Heap entries are ordered the same way as results are. Bounds
+ * which aren't a real result yet get an id higher than any phrase's, so
+ * they are opened before any result with the same score.
+ */
+typedef struct search_key {
+  unsigned int score;
+  int item;
+  uint64_t id;
+} search_key;
+
+#define SEARCH_BOUND UINT64_MAX
+
+/* Items and heap entries held in the state itself before any are
+ * allocated, which is plenty for most searches
+ */
+#define SEARCH_LOCAL_ITEMS 32
+
+typedef struct search_state {
+  string_data* string;
+  search_page* page;
+  result_entry* results;
+  unsigned int min_score; /*of the last result, once there are enough*/
+  int results_len;
+  int count;
+  int capacity;
+  int num_items;
+  int heap_size;
+  search_item* items;
+  search_key* heap;
+  arena* scratch; /*what items and heap grow into, cmalloc if NULL*/
+  search_item local_items[SEARCH_LOCAL_ITEMS];
+  search_key local_heap[SEARCH_LOCAL_ITEMS];
+} search_state;
+
+static inline int search_key_before(search_key* a, search_key* b) {
+  return a->score > b->score ||
+    (a->score == b->score && a->id > b->id);
+}
+
+/* Put an item on the heap with the given key. Every item is on the heap
+ * at most once, so it never holds more entries than there are items.
+ */
+static void search_push(search_state* state,
+                        int item,
+                        unsigned int score,
+                        uint64_t id) {
+  search_key key = {score, item, id};
+  int pos = state->heap_size++;
+  while(pos > 0 && search_key_before(&key, &state->heap[(pos-1)/2])) {
+    state->heap[pos] = state->heap[(pos-1)/2];
+    pos = (pos-1)/2;
+  }
+  state->heap[pos] = key;
+}
+
+static search_key search_pop(search_state* state) {
+  search_key top = state->heap[0];
+  search_key last = state->heap[--state->heap_size];
+  int pos = 0;
+  while(2*pos + 1 < state->heap_size) {
+    int child = 2*pos + 1;
+    if(child + 1 < state->heap_size &&
+       search_key_before(&state->heap[child+1], &state->heap[child]))
+      child++;
+    if(!search_key_before(&state->heap[child], &last))
+      break;
+    state->heap[pos] = state->heap[child];
+    pos = child;
+  }
+  state->heap[pos] = last;
+  return top;
+}
+
+static void* search_alloc(search_state* state, size_t size) {
+  if(state->scratch != NULL)
+    return arena_alloc(state->scratch, size);
+  return cmalloc(size);
+}
+
+/* Free items and heap if they were allocated, an arena being reset by
+ * whoever owns it
+ */
+static void search_release(search_state* state,
+                           search_item* items,
+                           search_key* heap) {
+  if(state->scratch != NULL || items == state->local_items)
+    return;
+  cfree(items);
+  cfree(heap);
+}
+
+/* A new item, or NULL if there is no room for one and the items and heap
+ * can't be grown. Growing moves the items, so pointers to them don't last.
+ */
+static search_item* search_new_item(search_state* state,
+                                    unsigned short kind,
+                                    unsigned int depth) {
+  if(state->num_items == state->capacity) {
+    int capacity = 2*state->capacity;
+    search_item* items = search_alloc(state, capacity*sizeof(search_item));
+    search_key* heap = search_alloc(state, capacity*sizeof(search_key));
+    if(items == NULL || heap == NULL) {
+      if(state->scratch == NULL) {
+        cfree(items);
+        cfree(heap);
+      }
+      return NULL;
+    }
+    memcpy(items, state->items, state->num_items*sizeof(search_item));
+    memcpy(heap, state->heap, state->heap_size*sizeof(search_key));
+    search_release(state, state->items, state->heap);
+    state->items = items;
+    state->heap = heap;
+    state->capacity = capacity;
+  }
+
+  search_item* item = &state->items[state->num_items++];
+  item->kind = kind;
+  item->matched = 0;
+  item->started = 0;
+  item->depth = depth;
+  return item;
+}
+
+/* Queue up a node, unless nothing under it can make the results. Like
+ * everything else it is only looked into once it comes off the heap.
+ */
+static int search_add_node(search_state* state,
+                           trie_t* trie,
+                           unsigned int depth) {
+  unsigned int max_score = child_max_score(trie);
+  if(max_score < state->min_score)
+    return 1;
+
+  search_item* item = search_new_item(state, SEARCH_NODE, depth);
+  if(item == NULL)
+    return 0;
+  item->source = trie;
+  search_push(state, item - state->items, max_score, SEARCH_BOUND);
+  return 1;
+}
+
+static int search_add_dline(search_state* state,
+                            dline_t* dline,
+                            unsigned int depth,
+                            unsigned int max_score) {
+  if(dline == NULL || max_score < state->min_score)
+    return 1;
+
+  /*it is read as soon as it comes off the heap, often straight away*/
+  PREFETCH(dline);
+  search_item* item = search_new_item(state, SEARCH_DLINE, depth);
+  if(item == NULL)
+    return 0;
+  item->source = dline;
+  search_push(state, item - state->items, max_score, SEARCH_BOUND);
+  return 1;
+}
+
+/* The bucket of a hash node to open after the one with the given index
+ * and score, or -1 if there are no more worth opening. Buckets are opened
+ * by highest score, then by index, which only needs the last one opened
+ * to find the next.
+ */
+static int search_next_bucket(search_state* state,
+                              hash_node* node,
+                              unsigned int score,
+                              int after) {
+  int next = -1;
+  for(int i = 0; i <= TERMINATOR_BUCKET; i++) {
+    unsigned int bound = node->bucket_max[i];
+    if(node->offsets[i] == node->offsets[i+1] || bound < state->min_score ||
+       bound > score || (bound == score && i <= after)) {
+      continue;
+    }
+    if(next < 0 || bound > node->bucket_max[next])
+      next = i;
+  }
+  return next;
+}
+
+/* Whether the search is over before an item with the given key, which is
+ * once there are enough results and it can only sort after the last
+ */
+static inline int search_finished(search_state* state, search_key* key) {
+  if(state->count < state->results_len)
+    return 0;
+  result_entry* last = &state->results[state->count-1];
+  search_key last_key = {last->score, 0, last->id};
+  return search_key_before(&last_key, key);
+}
+
+/* Where a page starts in a cache, or -1 if the cache can't be used for it:
+ * one which isn't complete must hold a full page of results after where
+ * the page starts, since anything after that may be missing.
+ */
+static int cache_first(trie_cache* cache, search_page* page, int results_len) {
+  int first = 0;
+  if(page->after) {
+    while(first < cache->count &&
+          !page_contains(page, cache->entries[first].score,
+                         cache->entries[first].id) &&
+          cache->entries[first].score >= page->after_score) {
+      first++;
+    }
+  }
+  if(!cache->complete && cache->count - first < results_len)
+    return -1;
+  return first;
+}
+
+/* Move a dline or cache item on to its next result, returning 0 if it has
+ * no more
+ */
+static int search_advance(search_state* state, search_item* item) {
+  if(item->kind == SEARCH_CACHE) {
+    trie_cache* cache = item->source;
+    if(item->matched)
+      item->next++;
+    /*caches are only walked when they hold enough, see cache_first*/
+    if(item->next >= cache->count ||
+       cache->entries[item->next].score < state->min_score)
+      return 0;
+    item->result = cache->entries[item->next];
   } else {
-    /*recurse over the terminators, and then every child*/
-    trie_node* t_node = (trie_node*)trie;
-    
-    int built_size = dline_search(t_node->terminated,
-                                  string,
-                                  start,
-                                  min_score,
-                                  spare,
-                                  results_len);
-    
-    built_size = merge(spare, built_size,
-                       from, from_size,
-                       to, results_len);
-    
-    result_entry* old_results = from;
-    result_entry* new_results = to;
-    
-    if(built_size == results_len) {
-      min_score = to[results_len-1].score;
+    if(!item->started) {
+      dline_cursor_init(&item->cursor, item->source, state->string,
+                        item->depth);
+      if(state->page->after) {
+        dline_cursor_seek(&item->cursor, state->page->after_score,
+                          state->page->after_id);
+      }
+      item->started = 1;
     }
-    
-    for(int i = 0; i < 256; i++) {
-      if(t_node->children[i] != NULL) {
-        if(old_results == from) {
-          new_results = from;
-          old_results = to;
-        } else {
-          new_results = to;
-          old_results = from;
-        }
-        built_size = trie_fan_search(t_node->children[i],
-                                     string,
-                                     start+1,
-                                     min_score,
-                                     old_results,
-                                     new_results,
-                                     spare,
-                                     built_size,
-                                     results_len);
-        if(built_size == results_len) {
-          min_score = new_results[built_size-1].score;
-        }
+    if(!dline_cursor_next(&item->cursor, state->min_score, &item->result))
+      return 0;
+  }
+  item->matched = 1;
+  return 1;
+}
+
+/* Open up a hash node, queueing the buckets the prefix can match: the one
+ * the next two bytes hash to, the group for a single byte, or if the prefix
+ * ends here all of them. Those are left for a SEARCH_BUCKETS item to queue
+ * one at a time, as only the best few are usually needed.
+ */
+static int search_open_hash(search_state* state,
+                            hash_node* node,
+                            unsigned int depth) {
+  string_data* string = state->string;
+
+  if(depth >= string->length) {
+    int first = search_next_bucket(state, node, UINT_MAX, -1);
+    if(first < 0)
+      return 1;
+    search_item* item = search_new_item(state, SEARCH_BUCKETS, depth);
+    if(item == NULL)
+      return 0;
+    item->source = node;
+    item->next = first;
+    search_push(state, item - state->items, node->bucket_max[first],
+                SEARCH_BOUND);
+    return 1;
+  }
+
+  unsigned int first_bucket = hash_idx(string, depth), last_bucket;
+  if(depth + 1 < string->length) {
+    last_bucket = first_bucket;
+  } else {
+    last_bucket = first_bucket + HASH_GROUP_SIZE - 1;
+  }
+  for(unsigned int i = first_bucket; i <= last_bucket; i++) {
+    if(!search_add_dline(state, hash_bucket(node, i), depth,
+                         node->bucket_max[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Queue the next bucket from a SEARCH_BUCKETS item, which came off the heap
+ * with the score of that bucket, and put the item back for the one after.
+ */
+static int search_open_bucket(search_state* state,
+                              int idx,
+                              unsigned int score) {
+  search_item* item = &state->items[idx];
+  hash_node* node = item->source;
+  int bucket = item->next;
+  unsigned int depth = item->depth;
+
+  int next = search_next_bucket(state, node, score, bucket);
+  if(next >= 0) {
+    item->next = next;
+    search_push(state, idx, node->bucket_max[next], SEARCH_BOUND);
+  }
+  return search_add_dline(state, hash_bucket(node, bucket), depth, score);
+}
+
+/* Open up a node, queueing whatever is in it that the prefix can match.
+ * Returns 0 on allocation failure.
+ */
+static int search_open(search_state* state,
+                       trie_t* trie,
+                       unsigned int depth) {
+  if(is_hash_node(trie))
+    return search_open_hash(state, (hash_node*)((uint64_t)trie-1), depth);
+
+  trie_node* t_node = (trie_node*)trie;
+  trie_cache* cache = trie_node_cache(t_node, state->string, depth,
+                                      state->results_len, state->scratch);
+  int first = cache == NULL ? -1 :
+    cache_first(cache, state->page, state->results_len);
+  if(first >= 0) {
+    search_item* item = search_new_item(state, SEARCH_CACHE, depth);
+    if(item == NULL)
+      return 0;
+    item->source = cache;
+    item->next = first;
+    if(search_advance(state, item)) {
+      search_push(state, item - state->items, item->result.score,
+                  item->result.id);
+    }
+    return 1;
+  }
+
+  /* Each child's bound is in its header, so start loading every one of
+   * them before reading any
+   */
+  trie_t* child;
+  for(int c = next_child(t_node, 0, &child); c >= 0;
+      c = next_child(t_node, c + 1, &child)) {
+    PREFETCH((uint64_t)child & ~(uint64_t)1);
+  }
+
+  dline_t* terminated = node_terminated(t_node);
+  if(!search_add_dline(state, terminated, depth, dline_max_score(terminated)))
+    return 0;
+  for(int c = next_child(t_node, 0, &child); c >= 0;
+      c = next_child(t_node, c + 1, &child)) {
+    if(!search_add_node(state, child, depth + 1))
+      return 0;
+  }
+  return 1;
+}
+
+/* Add the next result, which sorts no earlier than the last one. Another
+ * suffix of the same string as the last is merged into it, keeping the
+ * longest (results from different depths split their suffix differently
+ * between len and offset).
+ */
+static void search_emit(search_state* state, result_entry* result) {
+  result_entry* results = state->results;
+  if(state->count > 0 &&
+     results[state->count-1].id == result->id &&
+     results[state->count-1].score == result->score) {
+    if(result->len + result->offset >
+       results[state->count-1].len + results[state->count-1].offset)
+      results[state->count-1] = *result;
+  } else if(state->count < state->results_len) {
+    results[state->count++] = *result;
+    if(state->count == state->results_len)
+      state->min_score = result->score;
+  }
+}
+
+/* Best-first search from the node the prefix leads to at the given depth,
+ * giving the same results a fan out over it would, for the given page. If
+ * the heap can't be grown the results found so far are returned, which are
+ * the first of the full set.
+ */
+static int trie_best_first_search(trie_t* trie,
+                                  string_data* string,
+                                  unsigned int depth,
+                                  result_entry* results,
+                                  int results_len,
+                                  search_page* page,
+                                  arena* scratch) {
+  int count = 0;
+
+  /* Short prefixes mostly end at a node with a cache, and long ones at a
+   * single bucket, both of which already hold the answer in order
+   */
+  if(is_hash_node(trie) && depth + 1 < string->length) {
+    hash_node* h_node = (hash_node*)((uint64_t)trie-1);
+    dline_cursor cursor;
+    dline_cursor_init(&cursor, hash_bucket(h_node, hash_idx(string, depth)),
+                      string, depth);
+    if(page->after)
+      dline_cursor_seek(&cursor, page->after_score, page->after_id);
+    while(count < results_len &&
+          dline_cursor_next(&cursor, page->min_score, &results[count])) {
+      count++;
+    }
+    return count;
+  } else if(!is_hash_node(trie)) {
+    trie_cache* cache = trie_node_cache((trie_node*)trie, string, depth,
+                                        results_len, scratch);
+    int first = cache == NULL ? -1 : cache_first(cache, page, results_len);
+    if(first >= 0) {
+      while(count < results_len && first + count < cache->count &&
+            cache->entries[first + count].score >= page->min_score) {
+        results[count] = cache->entries[first + count];
+        count++;
       }
+      return count;
+    }
+  }
+
+  search_state state;
+  state.string = string;
+  state.page = page;
+  state.results = results;
+  state.min_score = page->min_score;
+  state.results_len = results_len;
+  state.count = 0;
+  state.capacity = SEARCH_LOCAL_ITEMS;
+  state.num_items = 0;
+  state.heap_size = 0;
+  state.items = state.local_items;
+  state.heap = state.local_heap;
+  state.scratch = scratch;
+
+  int ok = search_add_node(&state, trie, depth);
+  while(ok && state.heap_size > 0 && !search_finished(&state, &state.heap[0])) {
+    search_key top = search_pop(&state);
+    search_item* item = &state.items[top.item];
+    if(item->kind == SEARCH_NODE) {
+      ok = search_open(&state, item->source, item->depth);
+      continue;
+    } else if(item->kind == SEARCH_BUCKETS) {
+      ok = search_open_bucket(&state, top.item, top.score);
+      continue;
+    }
+
+    /* Keep taking results from the item while they sort ahead of all else
+     * on the heap, and only put it back once they don't
+     */
+    for(;;) {
+      if(item->matched)
+        search_emit(&state, &item->result);
+      if(!search_advance(&state, item))
+        break;
+      search_key next = {item->result.score, top.item, item->result.id};
+      if(search_finished(&state, &next) ||
+         (state.heap_size > 0 && search_key_before(&state.heap[0], &next))) {
+        search_push(&state, top.item, next.score, next.id);
+        break;
+      }
+    }
+  }
+
+  search_release(&state, state.items, state.heap);
+  return state.count;
+}
+
+/* Start loading the top of the path the suffix of string at start takes,
+ * so that it loads while something else is done, such as applying the
+ * suffix before it.
+ */
+void trie_prefetch(trie_t* trie, string_data* string, unsigned int start) {
+  if(trie == NULL || is_hash_node(trie) || start >= string->length)
+    return;
+  trie_t* child = get_child((trie_node*)trie,
+                            (unsigned char)string->normalized[start]);
+  prefetch_child(child, string, start + 1);
+}
+
+/* A string updated while we were searching can show up under both its
+ * old and new score, keep only the first (highest) one. Ids already kept
+ * go in an open addressing set in scratch (cmalloc if NULL). If there is
+ * no room for one the results are left as they are.
+ */
+static int dedup_results(result_entry* results, int count, arena* scratch) {
+  uint32_t mask = 1;
+  while(mask < 2*(uint32_t)count)
+    mask *= 2;
+  mask--;
+
+  size_t size = (mask + 1)*sizeof(phrase_id);
+  phrase_id* seen = scratch != NULL ? arena_alloc(scratch, size) :
+    cmalloc(size);
+  if(seen == NULL)
+    return count;
+  memset(seen, 0, size); /*all NO_PHRASE*/
+
+  int kept = 0;
+  for(int i = 0; i < count; i++) {
+    uint32_t slot = (results[i].id*2654435761u) & mask;
+    while(seen[slot] != NO_PHRASE && seen[slot] != results[i].id)
+      slot = (slot + 1) & mask;
+    if(seen[slot] == NO_PHRASE) {
+      seen[slot] = results[i].id;
+      results[kept++] = results[i];
     }
-    
-    if(new_results == from)
-      memcpy(to, from, built_size*sizeof(result_entry));
-    return built_size;
   }
+
+  if(scratch == NULL)
+    cfree(seen);
+  return kept;
 }
 
 /* Search the given trie for suffixes starting with the given prefix.
- * Stores at most results_len results, and returns the number stored.
+ * Stores at most results_len results from the given page (NULL for the
+ * first page with no score threshold), and returns the number stored.
+ * truncated (if not NULL) is set if the search stopped at results_len, so
+ * there may be another page, even if duplicates leave fewer results than
+ * that. Safe to call from any number of threads alongside a writer, though
+ * callers reading the returned global pointers must hold their own
+ * epoch_enter(). Any working space needed comes from scratch, which the
+ * caller resets, or if it is NULL from cmalloc.
  */
 int trie_search(trie_t* trie,
                 string_data* string,
                 result_entry* results,
-                int results_len) {
-  if(trie == NULL || string == NULL || results == NULL)
+                int results_len,
+                search_page* page,
+                arena* scratch,
+                int* truncated) {
+  if(truncated != NULL)
+    *truncated = 0;
+  if(trie == NULL || string == NULL || results == NULL || results_len <= 0)
     return 0;
-  
+
+  search_page everything = {MIN_SCORE, 0, 0, NO_PHRASE};
+  if(page == NULL)
+    page = &everything;
+
   int current_start = 0;
   trie_t* current_ptr = trie;
+  epoch_enter();
   
   /* first seek down to where we need to start collecting */
   while(current_start < string->length && current_ptr != NULL &&
         !is_hash_node(current_ptr)) {
-    current_ptr = ((trie_node*)current_ptr)->children[
-      (int)(string->normalized[current_start])];
+    current_ptr = get_child((trie_node*)current_ptr,
+                            (unsigned char)string->normalized[current_start]);
     current_start++;
+    prefetch_child(current_ptr, string, current_start);
   }
   
   if(current_ptr == NULL) {
+    epoch_exit();
     return 0;
   }
   
-  result_entry* spare = (result_entry*)ccalloc(2*results_len,
-                                               sizeof(result_entry));
-  if(spare == NULL) {
-    return 0;
-  }
+  int result = trie_best_first_search(current_ptr,
+                                      string,
+                                      current_start,
+                                      results,
+                                      results_len,
+                                      page,
+                                      scratch);
+  if(truncated != NULL)
+    *truncated = result == results_len;
+  int kept = dedup_results(results, result, scratch);
 
-  int result = trie_fan_search(current_ptr,
-                               string,
-                               current_start,
-                               MIN_SCORE,
-                               spare,
-                               results,
-                               &spare[results_len],
-                               0,
-                               results_len);
-  
-  cfree(spare);
-  return result;
+  epoch_exit();
+  return kept;
 }
 
 void hash_node_debug(trie_t* node) {
@@ -625,12 +2684,15 @@ void hash_node_debug(trie_t* node) {
   }
   
   hash_node* h_node = (hash_node*)node;
-  printf("hash node at %p with %d elements\n", node,
-                                               h_node->size);
+  printf("hash node at %p with %u elements in %u bytes\n", node,
+                                                         h_node->size,
+                                                         h_node->bytes);
   
-  for(int i = 0; i < NUM_BUCKETS; i++) {
-    if(h_node->entries[i] != NULL) {
-      printf("%d: %p\n", i, h_node->entries[i]);
+  for(int i = 0; i <= TERMINATOR_BUCKET; i++) {
+    if(hash_bucket(h_node, i) != NULL) {
+      printf("%d: %u bytes at %u\n", i,
+             h_node->offsets[i+1] - h_node->offsets[i],
+             h_node->offsets[i]);
     }
   }
 }
@@ -642,13 +2704,14 @@ void trie_node_debug(trie_t* node) {
   }
   
   trie_node* t_node = (trie_node*)node;
-  printf("trie node at %p\n", node);
+  trie_t* child;
+  printf("trie node at %p of capacity %d with %d children\n", node,
+         node_capacity[t_node->kind], t_node->num_children);
   printf("terminated: %p\n", t_node->terminated);
   
-  for(int i = 0; i < 256; i++) {
-    if(t_node->children[i] != NULL) {
-      printf("%d: %p\n", i, t_node->children[i]);
-    }
+  for(int c = next_child(t_node, 0, &child); c >= 0;
+      c = next_child(t_node, c + 1, &child)) {
+    printf("%d: %p\n", c, child);
   }
 }
 
@@ -663,7 +2726,13 @@ void trie_debug(trie_t* trie) {
 }
 
 void trie_print_stats() {
-  printf("%d trie nodes\n", trie_node_count);
+  printf("%d trie nodes (%d/%d/%d/%d of size 4/16/48/256)\n",
+         node_kind_count[NODE_4] + node_kind_count[NODE_16] +
+         node_kind_count[NODE_48] + node_kind_count[NODE_256],
+         node_kind_count[NODE_4],
+         node_kind_count[NODE_16],
+         node_kind_count[NODE_48],
+         node_kind_count[NODE_256]);
   printf("%d hash nodes\n", hash_node_count);
 }
 
@@ -674,25 +2743,19 @@ uint64_t trie_memory_usage(trie_t* trie) {
   uint64_t count = 0;
   
   if(is_hash_node(trie)) {
-    count += sizeof(hash_node);
     hash_node* h_node = (hash_node*)((uint64_t)trie-1);
-    
-    for(int i = 0; i < NUM_BUCKETS; i++) {
-      if(h_node->entries[i] != NULL) {
-        count += dline_size(h_node->entries[i]);
-      }
-    }
+    count += sizeof(hash_node) + h_node->bytes;
   } else {
-    count += sizeof(trie_node);
     trie_node* t_node = (trie_node*)trie;
+    trie_t* child;
+    count += node_sizes[t_node->kind];
     if(t_node->terminated != NULL) {
-      count += dline_size(t_node->terminated);
+      count += dline_size(node_terminated(t_node));
     }
     
-    for(int i = 0; i < 256; i++) {
-      if(t_node->children[i] != NULL) {
-        count += trie_memory_usage((trie_t*)(t_node->children[i]));
-      }
+    for(int c = next_child(t_node, 0, &child); c >= 0;
+        c = next_child(t_node, c + 1, &child)) {
+      count += trie_memory_usage(child);
     }
   }
   
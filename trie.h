@@ -1,11 +1,32 @@
 #ifndef _TRIE_H_
 #define _TRIE_H_
 
+#include "cmalloc.h"
 #include "cobb2.h"
 #include "dline.h"
 
-/*Constant for now*/
-#define HASH_NODE_SIZE_LIMIT 15000
+/* Hash nodes whose buckets take up at least this many bytes are burst into
+ * a trie node on the next insert. Constant for now.
+ */
+#define HASH_NODE_BYTE_LIMIT (64*1024)
+
+/* Trie nodes whose subtree shrinks to this many bytes are collapsed back
+ * into a hash node. Well under the split limit, so that a node doesn't go
+ * back and forth between the two.
+ */
+#define COLLAPSE_BYTE_LIMIT (HASH_NODE_BYTE_LIMIT/4)
+
+/* At most this many hash nodes are split by a single string's upsert, the
+ * rest are left over the limit for later ones, up to the hard limit.
+ */
+#define SPLITS_PER_UPSERT 1
+#define HASH_NODE_HARD_LIMIT (2*HASH_NODE_BYTE_LIMIT)
+
+/* Trie nodes at most this deep keep a cache of the top TRIE_CACHE_SIZE
+ * results in their subtree, serving searches for up to that many results.
+ */
+#define TRIE_CACHE_DEPTH 2
+#define TRIE_CACHE_SIZE 32
 
 typedef void trie_t;
 
@@ -13,8 +34,12 @@ trie_t* trie_init();
 trie_t* trie_presplit(unsigned char low,
                       unsigned char high,
                       int depth);
+trie_t* trie_bulk_build(dline_source* sources, int count, int pack);
 void trie_clean(trie_t* trie);
 
+op_result trie_snapshot_write(trie_t* trie, const char* path);
+trie_t* trie_snapshot_load(const char* path);
+
 op_result trie_upsert(trie_t* existing,
                       string_data* string,
                       unsigned int start,
@@ -26,10 +51,15 @@ op_result trie_remove(trie_t* existing,
                       unsigned int start,
                       remove_state* state);
 
+void trie_prefetch(trie_t* trie, string_data* string, unsigned int start);
+
 int trie_search(trie_t* trie,
                 string_data* string,
                 result_entry* results,
-                int results_len);
+                int results_len,
+                search_page* page,
+                arena* scratch,
+                int* truncated);
 
 void trie_print_stats();
 
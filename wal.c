@@ -0,0 +1,454 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L /*for fsync/ftruncate*/
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cmalloc.h"
+#include "cobb2.h"
+#include "sync.h"
+#include "wal.h"
+
+/* The log is a file of records, each a header followed by the phrase
+ * (without a terminator), only ever appended to. Appends are buffered in
+ * memory, and writers then wait in wal_sync for their record to be on
+ * disk. Whichever waiter gets there first writes out everything buffered
+ * so far with a single fsync, while the rest wait for it, so concurrent
+ * writers share fsyncs rather than paying for one each (group commit).
+ *
+ * A crash can leave a partly written record at the end of the log, which
+ * the checksum catches. Reading stops there, and wal_open cuts it off.
+ */
+
+typedef struct wal_header {
+  uint32_t checksum; /*of the rest of the header and the phrase*/
+  uint32_t op;
+  uint32_t score;
+  uint32_t len;
+} wal_header;
+
+struct wal_t {
+  int fd;
+  char* path;
+  pthread_mutex_t lock;
+  pthread_cond_t synced;
+  char* buffer; /*records appended but not yet written*/
+  uint64_t buffer_len;
+  uint64_t buffer_capacity;
+  char* spare; /*swapped in for buffer while it is being written*/
+  uint64_t spare_capacity;
+  uint64_t appended; /*sequence number of the last record appended*/
+  uint64_t durable; /*and of the last one on disk*/
+  int flushing;
+  op_result error; /*once a write fails, nothing after it is durable*/
+};
+
+#define WAL_BUFFER_SIZE 4096
+
+/* FNV-1a over everything in the record after the checksum */
+static uint32_t wal_checksum(wal_header* header, const char* phrase) {
+  const unsigned char* bytes = (const unsigned char*)&header->op;
+  uint32_t hash = 2166136261u;
+
+  for(int i = 0; i < sizeof(wal_header) - sizeof(uint32_t); i++)
+    hash = (hash ^ bytes[i])*16777619u;
+  for(uint32_t i = 0; i < header->len; i++)
+    hash = (hash ^ (unsigned char)phrase[i])*16777619u;
+  return hash;
+}
+
+static inline uint64_t record_size(uint32_t len) {
+  return sizeof(wal_header) + len;
+}
+
+/* Encode a record into dest, which must have record_size bytes free */
+static void write_record(char* dest,
+                         unsigned int op,
+                         char* phrase,
+                         uint32_t len,
+                         unsigned int score) {
+  wal_header header = {0, op, score, len};
+  header.checksum = wal_checksum(&header, phrase);
+  memcpy(dest, &header, sizeof(wal_header));
+  memcpy(dest + sizeof(wal_header), phrase, len);
+}
+
+/* Decode the record at offset into header, returning 0 if there isn't a
+ * whole, intact one there
+ */
+static int read_record(char* data,
+                       uint64_t len,
+                       uint64_t offset,
+                       wal_header* header) {
+  if(len - offset < sizeof(wal_header))
+    return 0;
+  memcpy(header, data + offset, sizeof(wal_header));
+  if(len - offset - sizeof(wal_header) < header->len)
+    return 0;
+  return header->checksum ==
+    wal_checksum(header, data + offset + sizeof(wal_header));
+}
+
+static op_result write_all(int fd, char* data, uint64_t len) {
+  while(len > 0) {
+    ssize_t written = write(fd, data, len);
+    if(written < 0 && errno == EINTR)
+      continue;
+    if(written <= 0)
+      return IO_ERROR;
+    data += written;
+    len -= written;
+  }
+  return NO_ERROR;
+}
+
+/* Open the log at path for appending, creating it if needed. valid_len is
+ * how much of it wal_read could read, anything after that is dropped.
+ * Returns NULL on failure.
+ */
+wal_t* wal_open(const char* path, uint64_t valid_len) {
+  struct stat st;
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if(fd < 0)
+    return NULL;
+  if(fstat(fd, &st) ||
+     ((uint64_t)st.st_size > valid_len && ftruncate(fd, valid_len))) {
+    close(fd);
+    return NULL;
+  }
+
+  wal_t* wal = cmalloc(sizeof(wal_t));
+  if(wal == NULL) {
+    close(fd);
+    return NULL;
+  }
+  memset(wal, 0, sizeof(wal_t));
+  wal->fd = fd;
+  wal->path = cmalloc(strlen(path) + 1);
+  wal->buffer = cmalloc(WAL_BUFFER_SIZE);
+  wal->spare = cmalloc(WAL_BUFFER_SIZE);
+  if(wal->path == NULL || wal->buffer == NULL || wal->spare == NULL) {
+    wal_close(wal);
+    return NULL;
+  }
+  strcpy(wal->path, path);
+  wal->buffer_capacity = WAL_BUFFER_SIZE;
+  wal->spare_capacity = WAL_BUFFER_SIZE;
+  pthread_mutex_init(&wal->lock, NULL);
+  pthread_cond_init(&wal->synced, NULL);
+  return wal;
+}
+
+/* Close the log. Anything appended but not synced is lost. */
+void wal_close(wal_t* wal) {
+  if(wal == NULL)
+    return;
+  close(wal->fd);
+  cfree(wal->path);
+  cfree(wal->buffer);
+  cfree(wal->spare);
+  cfree(wal);
+}
+
+/* Add a change to the log, setting seq to the sequence number to wait on
+ * with wal_sync before reporting it done. Changes must be appended in the
+ * order they were applied.
+ */
+op_result wal_append(wal_t* wal,
+                     unsigned int op,
+                     char* phrase,
+                     unsigned int score,
+                     uint64_t* seq) {
+  if(wal == NULL || phrase == NULL || seq == NULL)
+    return BAD_PARAM;
+
+  uint32_t len = strlen(phrase);
+  pthread_mutex_lock(&wal->lock);
+
+  uint64_t needed = wal->buffer_len + record_size(len);
+  if(needed > wal->buffer_capacity) {
+    uint64_t capacity = wal->buffer_capacity*2 > needed ?
+      wal->buffer_capacity*2 : needed;
+    char* grown = cmalloc(capacity);
+    if(grown == NULL) {
+      pthread_mutex_unlock(&wal->lock);
+      return MALLOC_FAIL;
+    }
+    memcpy(grown, wal->buffer, wal->buffer_len);
+    cfree(wal->buffer);
+    wal->buffer = grown;
+    wal->buffer_capacity = capacity;
+  }
+
+  write_record(wal->buffer + wal->buffer_len, op, phrase, len, score);
+  wal->buffer_len = needed;
+  *seq = ++wal->appended;
+
+  pthread_mutex_unlock(&wal->lock);
+  return NO_ERROR;
+}
+
+/* The sequence number of the last change appended, which is what to wait
+ * on for everything appended so far to be on disk
+ */
+uint64_t wal_appended(wal_t* wal) {
+  pthread_mutex_lock(&wal->lock);
+  uint64_t appended = wal->appended;
+  pthread_mutex_unlock(&wal->lock);
+  return appended;
+}
+
+/* Wait until the change with the given sequence number is on disk, writing
+ * out everything appended so far if nobody else is already doing so.
+ */
+op_result wal_sync(wal_t* wal, uint64_t seq) {
+  if(wal == NULL)
+    return BAD_PARAM;
+
+  pthread_mutex_lock(&wal->lock);
+  while(wal->durable < seq && wal->error == NO_ERROR) {
+    if(wal->flushing) {
+      pthread_cond_wait(&wal->synced, &wal->lock);
+      continue;
+    }
+
+    /* Take the buffer, so appends can carry on into the spare while it is
+     * written out without the lock held
+     */
+    char* data = wal->buffer;
+    uint64_t len = wal->buffer_len;
+    uint64_t capacity = wal->buffer_capacity;
+    uint64_t target = wal->appended;
+    wal->buffer = wal->spare;
+    wal->buffer_capacity = wal->spare_capacity;
+    wal->buffer_len = 0;
+    wal->flushing = 1;
+    pthread_mutex_unlock(&wal->lock);
+
+    op_result result = write_all(wal->fd, data, len);
+    if(result == NO_ERROR && fsync(wal->fd))
+      result = IO_ERROR;
+
+    pthread_mutex_lock(&wal->lock);
+    wal->spare = data;
+    wal->spare_capacity = capacity;
+    wal->flushing = 0;
+    if(result == NO_ERROR)
+      wal->durable = target;
+    else
+      wal->error = result;
+    pthread_cond_broadcast(&wal->synced);
+  }
+
+  op_result result = wal->durable >= seq ? NO_ERROR : wal->error;
+  pthread_mutex_unlock(&wal->lock);
+  return result;
+}
+
+/* Read every intact record of the log at path, in the order they were
+ * appended. valid_len is set to how many bytes of the log they take up. A
+ * log which doesn't exist yet is empty.
+ */
+op_result wal_read(const char* path,
+                   wal_record** records,
+                   int* count,
+                   uint64_t* valid_len) {
+  if(path == NULL || records == NULL || count == NULL || valid_len == NULL)
+    return BAD_PARAM;
+  *records = NULL;
+  *count = 0;
+  *valid_len = 0;
+
+  FILE* fp = fopen(path, "rb");
+  if(fp == NULL)
+    return errno == ENOENT ? NO_ERROR : BAD_PARAM;
+
+  struct stat st;
+  if(fstat(fileno(fp), &st)) {
+    fclose(fp);
+    return BAD_PARAM;
+  }
+  uint64_t len = st.st_size;
+  char* data = cmalloc(len + 1);
+  if(data == NULL) {
+    fclose(fp);
+    return MALLOC_FAIL;
+  }
+  len = fread(data, 1, len, fp);
+  fclose(fp);
+
+  wal_header header;
+  uint64_t offset = 0;
+  int num_records = 0;
+  while(read_record(data, len, offset, &header)) {
+    offset += record_size(header.len);
+    num_records++;
+  }
+
+  *records = cmalloc((num_records + 1)*sizeof(wal_record));
+  if(*records == NULL) {
+    cfree(data);
+    return MALLOC_FAIL;
+  }
+
+  offset = 0;
+  for(int i = 0; i < num_records; i++) {
+    read_record(data, len, offset, &header);
+    wal_record* record = &(*records)[i];
+    record->phrase = cmalloc(header.len + 1);
+    if(record->phrase == NULL) {
+      wal_records_free(*records, i);
+      *records = NULL;
+      cfree(data);
+      return MALLOC_FAIL;
+    }
+    memcpy(record->phrase, data + offset + sizeof(wal_header), header.len);
+    record->phrase[header.len] = '\0';
+    record->score = header.score;
+    record->op = header.op;
+    offset += record_size(header.len);
+  }
+
+  cfree(data);
+  *count = num_records;
+  *valid_len = offset;
+  return NO_ERROR;
+}
+
+typedef struct record_order {
+  wal_record record;
+  int order;
+} record_order;
+
+static int record_order_cmp(const void* a, const void* b) {
+  const record_order* r1 = (const record_order*)a;
+  const record_order* r2 = (const record_order*)b;
+  int cmp = strcmp(r1->record.phrase, r2->record.phrase);
+  if(cmp != 0)
+    return cmp;
+  return r1->order < r2->order ? -1 : r1->order > r2->order;
+}
+
+/* Cut records read from a log down to the last one for each phrase, which
+ * is all that matters to the end result. Records are reordered, and the new
+ * count is returned (-1 on allocation failure, leaving them untouched).
+ */
+int wal_latest(wal_record* records, int count) {
+  record_order* sorted = cmalloc((count + 1)*sizeof(record_order));
+  if(sorted == NULL)
+    return -1;
+
+  for(int i = 0; i < count; i++) {
+    sorted[i].record = records[i];
+    sorted[i].order = i;
+  }
+  qsort(sorted, count, sizeof(record_order), record_order_cmp);
+
+  int kept = 0;
+  for(int i = 0; i < count; i++) {
+    if(i + 1 < count &&
+       !strcmp(sorted[i].record.phrase, sorted[i+1].record.phrase)) {
+      cfree(sorted[i].record.phrase);
+    } else {
+      records[kept++] = sorted[i].record;
+    }
+  }
+
+  cfree(sorted);
+  return kept;
+}
+
+void wal_records_free(wal_record* records, int count) {
+  if(records == NULL)
+    return;
+  for(int i = 0; i < count; i++)
+    cfree(records[i].phrase);
+  cfree(records);
+}
+
+/* Rewrite the log down to the last change for each phrase, so that it
+ * (and replaying it) only grows with the number of phrases changed rather
+ * than the number of changes. Nothing may be appended while this runs.
+ * The new log is written alongside and renamed over the old one, so a
+ * crash part way leaves the old log as it was. Appends only move to the
+ * new log once the rename is on disk. Returns IO_ERROR if the new log
+ * can't be written, after which the old one is still used; if only the
+ * rename can't be synced, no later change can be made durable either.
+ */
+op_result wal_compact(wal_t* wal) {
+  if(wal == NULL)
+    return BAD_PARAM;
+
+  op_result result = wal_sync(wal, wal_appended(wal));
+  if(result != NO_ERROR)
+    return result;
+
+  /*holding the lock keeps out anyone else writing to the file*/
+  pthread_mutex_lock(&wal->lock);
+
+  wal_record* records;
+  int count;
+  uint64_t valid_len;
+  result = wal_read(wal->path, &records, &count, &valid_len);
+  if(result == NO_ERROR) {
+    int latest = wal_latest(records, count);
+    if(latest < 0)
+      result = MALLOC_FAIL;
+    else
+      count = latest;
+  }
+
+  uint64_t len = 0;
+  for(int i = 0; i < count; i++)
+    len += record_size(strlen(records[i].phrase));
+  char* data = result == NO_ERROR ? cmalloc(len + 1) : NULL;
+  char* tmp_path = cmalloc(strlen(wal->path) + 5);
+  if(result == NO_ERROR && (data == NULL || tmp_path == NULL))
+    result = MALLOC_FAIL;
+
+  int fd = -1;
+  if(result == NO_ERROR) {
+    char* dest = data;
+    for(int i = 0; i < count; i++) {
+      uint32_t phrase_len = strlen(records[i].phrase);
+      write_record(dest, records[i].op, records[i].phrase, phrase_len,
+                   records[i].score);
+      dest += record_size(phrase_len);
+    }
+
+    sprintf(tmp_path, "%s.tmp", wal->path);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if(fd < 0 || write_all(fd, data, len) != NO_ERROR || fsync(fd) ||
+       rename(tmp_path, wal->path)) {
+      result = IO_ERROR;
+      if(fd >= 0)
+        close(fd);
+      remove(tmp_path);
+    } else if(sync_parent(wal->path)) {
+      /* The path may come back as either log after a crash, so nothing
+       * appended from here on can be acknowledged as durable
+       */
+      result = IO_ERROR;
+      wal->error = IO_ERROR;
+      close(fd);
+    }
+  }
+
+  /*the new file is already open for appending, just swap it in*/
+  if(result == NO_ERROR) {
+    close(wal->fd);
+    wal->fd = fd;
+  }
+
+  pthread_mutex_unlock(&wal->lock);
+  wal_records_free(records, count);
+  cfree(data);
+  cfree(tmp_path);
+  return result;
+}
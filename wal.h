@@ -0,0 +1,45 @@
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include <stdint.h>
+#include "cobb2.h"
+
+/* Write-ahead log of changes made to a server since its base (a phrase
+ * file or snapshot) was loaded, replayed on top of the base at startup.
+ */
+
+enum wal_op {
+  WAL_SET = 1,
+  WAL_REMOVE = 2
+};
+
+/* A change read back from a log */
+typedef struct wal_record {
+  char* phrase;
+  unsigned int score;
+  unsigned int op;
+} wal_record;
+
+typedef struct wal_t wal_t;
+
+wal_t* wal_open(const char* path, uint64_t valid_len);
+void wal_close(wal_t* wal);
+
+op_result wal_append(wal_t* wal,
+                     unsigned int op,
+                     char* phrase,
+                     unsigned int score,
+                     uint64_t* seq);
+uint64_t wal_appended(wal_t* wal);
+op_result wal_sync(wal_t* wal, uint64_t seq);
+
+op_result wal_read(const char* path,
+                   wal_record** records,
+                   int* count,
+                   uint64_t* valid_len);
+int wal_latest(wal_record* records, int count);
+void wal_records_free(wal_record* records, int count);
+
+op_result wal_compact(wal_t* wal);
+
+#endif